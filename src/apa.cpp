@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+
+#include "apa.h"
+#include "fileio.h"
+
+static const char APA_MBR_MAGIC[] = "Sony Computer Entertainment Inc.";
+
+uint32_t ApaChecksum(const ApaHeader &Header)
+{
+    const uint32_t *Words = (const uint32_t *)&Header;
+    uint32_t Sum          = 0;
+    for (size_t i = 1; i < sizeof(Header) / 4; i++)
+        Sum += Words[i];
+    return Sum;
+}
+
+int InjectMbrKelf(const std::string &filename, const std::string &Data)
+{
+    std::string Sectors;
+    int ret = ReadFileRange(filename, 0, sizeof(ApaHeader), Sectors);
+    if (ret != 0)
+        return ret;
+    if (Sectors.size() < sizeof(ApaHeader))
+        return APA_ERROR_NOT_APA;
+
+    ApaHeader Header;
+    memcpy(&Header, Sectors.data(), sizeof(Header));
+    if (Header.Magic != APA_MAGIC || memcmp(Header.Mbr.Magic, APA_MBR_MAGIC, sizeof(Header.Mbr.Magic)) != 0)
+        return APA_ERROR_NOT_APA;
+    if (Header.Checksum != ApaChecksum(Header))
+        return APA_ERROR_BAD_CHECKSUM;
+
+    uint32_t OsdStart = Header.Mbr.OsdStart ? Header.Mbr.OsdStart : APA_MBR_DEFAULT_START;
+    uint32_t OsdSize  = (Data.size() + APA_SECTOR_SIZE - 1) / APA_SECTOR_SIZE;
+    // the KELF must stay inside the partition and clear of its header
+    if (OsdStart < 2 || (uint64_t)OsdStart + OsdSize > Header.Length)
+        return APA_ERROR_NO_SPACE;
+
+    std::string Padded = Data;
+    Padded.resize((size_t)OsdSize * APA_SECTOR_SIZE, 0);
+    if (WriteFileRange(filename, ((uint64_t)Header.Start + OsdStart) * APA_SECTOR_SIZE, Padded) != 0)
+        return APA_ERROR_IO;
+
+    // OsdStart, OsdSize and Checksum all live in the first sector
+    Header.Mbr.OsdStart = OsdStart;
+    Header.Mbr.OsdSize  = OsdSize;
+    Header.Checksum     = ApaChecksum(Header);
+    if (WriteFileRange(filename, (uint64_t)Header.Start * APA_SECTOR_SIZE, std::string((const char *)&Header, APA_SECTOR_SIZE)) != 0)
+        return APA_ERROR_IO;
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __APA_H__
+#define __APA_H__
+
+#include <stdint.h>
+#include <string>
+
+#define APA_ERROR_NOT_APA      -400
+#define APA_ERROR_BAD_CHECKSUM -401
+#define APA_ERROR_NO_SPACE     -402
+#define APA_ERROR_IO           -403
+
+#define APA_SECTOR_SIZE 512
+#define APA_MAGIC       0x00415041 // "APA\0"
+// where installers put the MBR program when the header does not name a place yet
+#define APA_MBR_DEFAULT_START 0x2000
+
+#pragma pack(push, 1)
+struct ApaTime
+{
+    uint8_t Unused;
+    uint8_t Sec;
+    uint8_t Min;
+    uint8_t Hour;
+    uint8_t Day;
+    uint8_t Month;
+    uint16_t Year;
+};
+
+// header of the __mbr partition, the first two sectors of the disk
+struct ApaHeader
+{
+    uint32_t Checksum; // sum of all other words
+    uint32_t Magic;
+    uint32_t Next;
+    uint32_t Prev;
+    char Id[32];
+    char Rpwd[8];
+    char Fpwd[8];
+    uint32_t Start;  // sectors
+    uint32_t Length; // sectors
+    uint16_t Type;
+    uint16_t Flags;
+    uint32_t NSub;
+    ApaTime Created;
+    uint32_t Main;
+    uint32_t Number;
+    uint32_t ModVer;
+    uint32_t Padding1[7];
+    uint8_t Padding2[128];
+    struct
+    {
+        char Magic[32]; // "Sony Computer Entertainment Inc."
+        uint32_t Version;
+        uint32_t NSector;
+        ApaTime Created;
+        uint32_t OsdStart; // sectors from the start of the partition
+        uint32_t OsdSize;  // sectors
+        uint8_t Padding3[200];
+    } Mbr;
+    struct
+    {
+        uint32_t Start;
+        uint32_t Length;
+    } Subs[64];
+};
+#pragma pack(pop)
+
+uint32_t ApaChecksum(const ApaHeader &Header);
+
+// Writes an MBR KELF into the __mbr partition of a raw PS2 HDD image and points the header at it.
+// Only the sectors of the KELF and the first header sector are written, whatever the size of the image.
+int InjectMbrKelf(const std::string &filename, const std::string &Data);
+
+#endif
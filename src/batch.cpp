@@ -0,0 +1,426 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include <errno.h>
+#include <memory>
+#include <thread>
+
+#include "batch.h"
+#include "fileio.h"
+#include "trace.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+typedef BoundedQueue<BatchJob *> JobQueue;
+
+// Moves whole files between disk and the pipeline queues
+class BatchIO
+{
+public:
+    virtual ~BatchIO() {}
+    // reads every job, handing finished ones to Ready
+    virtual void ReadAll(std::vector<BatchJob> &Jobs, JobQueue &Ready) = 0;
+    // writes the jobs coming out of Finished until it is closed
+    virtual void WriteAll(JobQueue &Finished, const BatchCallback &Done) = 0;
+};
+
+static void ReleaseJob(BatchJob &Job)
+{
+    std::string().swap(Job.Data);
+}
+
+// Portable backend: plain blocking stdio, overlap comes from the stage threads
+class SyncBatchIO : public BatchIO
+{
+public:
+    void ReadAll(std::vector<BatchJob> &Jobs, JobQueue &Ready) override
+    {
+        for (BatchJob &Job : Jobs) {
+            TraceScope trace("ReadFile");
+            if (ReadWholeFile(Job.Input, Job.Data) != 0)
+                Job.Result = BATCH_ERROR_READ_FAILED;
+            Ready.Push(&Job);
+        }
+    }
+
+    void WriteAll(JobQueue &Finished, const BatchCallback &Done) override
+    {
+        BatchJob *Job;
+        while (Finished.Pop(Job)) {
+            TraceScope trace("WriteFile", Job->Data.size());
+            if (Job->Result == 0 && !Job->Output.empty() && WriteWholeFile(Job->Output, Job->Data) != 0)
+                Job->Result = BATCH_ERROR_WRITE_FAILED;
+            ReleaseJob(*Job);
+            Done(*Job);
+        }
+    }
+};
+
+#ifdef HAVE_IO_URING
+// Minimal io_uring wrapper on top of the raw syscalls, so no liburing is needed
+class Uring
+{
+    int Fd = -1;
+    unsigned Entries;
+    unsigned Pending = 0;
+
+    void *SqRing = MAP_FAILED;
+    void *CqRing = MAP_FAILED;
+    io_uring_sqe *Sqes = (io_uring_sqe *)MAP_FAILED;
+    size_t SqRingSize, CqRingSize, SqesSize;
+
+    unsigned *SqHead, *SqTail, *SqMask, *SqArray;
+    unsigned *CqHead, *CqTail, *CqMask;
+    io_uring_cqe *Cqes;
+
+public:
+    ~Uring()
+    {
+        if (Sqes != MAP_FAILED)
+            munmap(Sqes, SqesSize);
+        if (CqRing != MAP_FAILED)
+            munmap(CqRing, CqRingSize);
+        if (SqRing != MAP_FAILED)
+            munmap(SqRing, SqRingSize);
+        if (Fd >= 0)
+            close(Fd);
+    }
+
+    bool Init(unsigned entries)
+    {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        Fd = syscall(__NR_io_uring_setup, entries, &p);
+        if (Fd < 0)
+            return false;
+        Entries = p.sq_entries;
+
+        SqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        CqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        SqesSize   = p.sq_entries * sizeof(io_uring_sqe);
+        SqRing     = mmap(NULL, SqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Fd, IORING_OFF_SQ_RING);
+        CqRing     = mmap(NULL, CqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Fd, IORING_OFF_CQ_RING);
+        Sqes       = (io_uring_sqe *)mmap(NULL, SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Fd, IORING_OFF_SQES);
+        if (SqRing == MAP_FAILED || CqRing == MAP_FAILED || Sqes == MAP_FAILED)
+            return false;
+
+        SqHead  = (unsigned *)((char *)SqRing + p.sq_off.head);
+        SqTail  = (unsigned *)((char *)SqRing + p.sq_off.tail);
+        SqMask  = (unsigned *)((char *)SqRing + p.sq_off.ring_mask);
+        SqArray = (unsigned *)((char *)SqRing + p.sq_off.array);
+        CqHead  = (unsigned *)((char *)CqRing + p.cq_off.head);
+        CqTail  = (unsigned *)((char *)CqRing + p.cq_off.tail);
+        CqMask  = (unsigned *)((char *)CqRing + p.cq_off.ring_mask);
+        Cqes    = (io_uring_cqe *)((char *)CqRing + p.cq_off.cqes);
+        return true;
+    }
+
+    bool Queue(uint8_t Opcode, int fd, void *Buffer, unsigned Length, uint64_t Offset, uint64_t UserData)
+    {
+        unsigned tail = *SqTail;
+        if (tail - __atomic_load_n(SqHead, __ATOMIC_ACQUIRE) >= Entries)
+            return false;
+
+        unsigned index    = tail & *SqMask;
+        io_uring_sqe *sqe = &Sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode    = Opcode;
+        sqe->fd        = fd;
+        sqe->addr      = (uint64_t)(uintptr_t)Buffer;
+        sqe->len       = Length;
+        sqe->off       = Offset;
+        sqe->user_data = UserData;
+        SqArray[index] = index;
+        __atomic_store_n(SqTail, tail + 1, __ATOMIC_RELEASE);
+        Pending++;
+        return true;
+    }
+
+    // submits queued entries and waits for at least one completion
+    void SubmitAndWait()
+    {
+        int ret = syscall(__NR_io_uring_enter, Fd, Pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret > 0)
+            Pending -= ret;
+    }
+
+    bool Reap(io_uring_cqe &Cqe)
+    {
+        unsigned head = *CqHead;
+        if (head == __atomic_load_n(CqTail, __ATOMIC_ACQUIRE))
+            return false;
+        Cqe = Cqes[head & *CqMask];
+        __atomic_store_n(CqHead, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+};
+
+// Keeps up to InFlight reads and writes queued in the kernel at once
+class UringBatchIO : public BatchIO
+{
+    unsigned InFlight;
+    Uring ReadRing;
+    Uring WriteRing;
+
+    struct Transfer
+    {
+        BatchJob *Job;
+        int fd;
+        size_t Done;
+    };
+
+    // continues (or, if the kernel refused the opcode, finishes) a partial transfer synchronously
+    static bool FinishSync(Transfer &t, bool Write)
+    {
+        while (t.Done < t.Job->Data.size()) {
+            ssize_t ret = Write ? pwrite(t.fd, t.Job->Data.data() + t.Done, t.Job->Data.size() - t.Done, t.Done)
+                                : pread(t.fd, &t.Job->Data[t.Done], t.Job->Data.size() - t.Done, t.Done);
+            if (ret <= 0)
+                return false;
+            t.Done += ret;
+        }
+        return true;
+    }
+
+    static bool QueueTransfer(Uring &Ring, std::vector<Transfer> &Transfers, size_t Index, bool Write)
+    {
+        Transfer &t = Transfers[Index];
+        char *Buffer = &t.Job->Data[0] + t.Done;
+        unsigned Length = (unsigned)std::min<size_t>(t.Job->Data.size() - t.Done, 1u << 30);
+        return Ring.Queue(Write ? IORING_OP_WRITE : IORING_OP_READ, t.fd, Buffer, Length, t.Done, Index);
+    }
+
+    // advances a transfer by a completion, true once it is over
+    static bool Complete(Uring &Ring, std::vector<Transfer> &Transfers, const io_uring_cqe &Cqe, bool Write)
+    {
+        Transfer &t = Transfers[Cqe.user_data];
+        if (Cqe.res > 0)
+            t.Done += Cqe.res;
+
+        bool Failed = false;
+        if (Cqe.res == -EINVAL || Cqe.res == -EOPNOTSUPP)
+            Failed = !FinishSync(t, Write);
+        else if (Cqe.res < 0 || (Cqe.res == 0 && t.Done < t.Job->Data.size()))
+            Failed = true;
+        else if (t.Done < t.Job->Data.size() && QueueTransfer(Ring, Transfers, Cqe.user_data, Write))
+            return false;
+        else
+            Failed = !FinishSync(t, Write);
+
+        if (Failed)
+            t.Job->Result = Write ? BATCH_ERROR_WRITE_FAILED : BATCH_ERROR_READ_FAILED;
+        close(t.fd);
+        return true;
+    }
+
+public:
+    explicit UringBatchIO(unsigned inFlight)
+        : InFlight(inFlight)
+    {
+    }
+
+    bool Init()
+    {
+        return ReadRing.Init(InFlight) && WriteRing.Init(InFlight);
+    }
+
+    void ReadAll(std::vector<BatchJob> &Jobs, JobQueue &Ready) override
+    {
+        std::vector<Transfer> Transfers(Jobs.size());
+        size_t Next      = 0;
+        unsigned Running = 0;
+
+        while (Next < Jobs.size() || Running) {
+            while (Running < InFlight && Next < Jobs.size()) {
+                BatchJob &Job = Jobs[Next];
+                Transfer &t   = Transfers[Next];
+                t.Job         = &Job;
+                t.Done        = 0;
+                t.fd          = open(Job.Input.c_str(), O_RDONLY);
+
+                struct stat st;
+                if (t.fd < 0 || fstat(t.fd, &st) != 0) {
+                    fprintf(stderr, "Couldn't open %s: %s\n", Job.Input.c_str(), strerror(errno));
+                    if (t.fd >= 0)
+                        close(t.fd);
+                    Job.Result = BATCH_ERROR_READ_FAILED;
+                    Ready.Push(&Job);
+                } else if (st.st_size == 0) {
+                    close(t.fd);
+                    Ready.Push(&Job);
+                } else {
+                    Job.Data.resize(st.st_size);
+                    QueueTransfer(ReadRing, Transfers, Next, false);
+                    Running++;
+                }
+                Next++;
+            }
+            if (!Running)
+                continue;
+
+            ReadRing.SubmitAndWait();
+            io_uring_cqe Cqe;
+            while (ReadRing.Reap(Cqe)) {
+                if (Complete(ReadRing, Transfers, Cqe, false)) {
+                    Running--;
+                    Ready.Push(Transfers[Cqe.user_data].Job);
+                }
+            }
+        }
+    }
+
+    void WriteAll(JobQueue &Finished, const BatchCallback &Done) override
+    {
+        std::vector<Transfer> Transfers(InFlight);
+        std::vector<size_t> FreeSlots;
+        for (size_t i = 0; i < InFlight; i++)
+            FreeSlots.push_back(i);
+        unsigned Running = 0;
+        bool Open        = true;
+
+        while (Open || Running) {
+            BatchJob *Job = NULL;
+            if (Open && Running < InFlight) {
+                if (Running == 0)
+                    Open = Finished.Pop(Job);
+                else
+                    Finished.TryPop(Job);
+            }
+
+            if (Job != NULL) {
+                if (Job->Result != 0 || Job->Output.empty()) {
+                    ReleaseJob(*Job);
+                    Done(*Job);
+                    continue;
+                }
+                int fd = open(Job->Output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                if (fd < 0) {
+                    fprintf(stderr, "Couldn't open %s: %s\n", Job->Output.c_str(), strerror(errno));
+                    Job->Result = BATCH_ERROR_WRITE_FAILED;
+                    ReleaseJob(*Job);
+                    Done(*Job);
+                    continue;
+                }
+                if (Job->Data.empty()) {
+                    close(fd);
+                    ReleaseJob(*Job);
+                    Done(*Job);
+                    continue;
+                }
+                size_t Slot = FreeSlots.back();
+                FreeSlots.pop_back();
+                Transfers[Slot] = {Job, fd, 0};
+                QueueTransfer(WriteRing, Transfers, Slot, true);
+                Running++;
+                continue;
+            }
+            if (!Running)
+                continue;
+
+            WriteRing.SubmitAndWait();
+            io_uring_cqe Cqe;
+            while (WriteRing.Reap(Cqe)) {
+                if (Complete(WriteRing, Transfers, Cqe, true)) {
+                    Running--;
+                    FreeSlots.push_back(Cqe.user_data);
+                    ReleaseJob(*Transfers[Cqe.user_data].Job);
+                    Done(*Transfers[Cqe.user_data].Job);
+                }
+            }
+        }
+    }
+};
+#endif
+
+static std::unique_ptr<BatchIO> CreateBatchIO(const BatchOptions &Options)
+{
+#ifdef HAVE_IO_URING
+    if (Options.UseUring) {
+        std::unique_ptr<UringBatchIO> io(new UringBatchIO(Options.InFlight));
+        if (io->Init())
+            return io;
+    }
+#endif
+    return std::unique_ptr<BatchIO>(new SyncBatchIO());
+}
+
+int RunBatch(std::vector<BatchJob> &Jobs, const BatchProcessor &Process, const BatchCallback &Done, const BatchOptions &Options)
+{
+    unsigned Workers = Options.Jobs ? Options.Jobs : std::thread::hardware_concurrency();
+    if (Workers == 0)
+        Workers = 1;
+
+    std::unique_ptr<BatchIO> io = CreateBatchIO(Options);
+    JobQueue Ready(Options.InFlight);
+    JobQueue Finished(Options.InFlight);
+
+    int Failed = 0;
+    std::mutex FailedMutex;
+    BatchCallback Count = [&](BatchJob &Job) {
+        if (Job.Result != 0) {
+            std::lock_guard<std::mutex> lock(FailedMutex);
+            Failed++;
+        }
+        Done(Job);
+    };
+
+    std::thread Reader([&] {
+        io->ReadAll(Jobs, Ready);
+        Ready.Close();
+    });
+    std::thread Writer([&] { io->WriteAll(Finished, Count); });
+
+    std::vector<std::thread> Pool;
+    for (unsigned i = 0; i < Workers; i++) {
+        Pool.emplace_back([&] {
+            BatchJob *Job;
+            for (;;) {
+                {
+                    // time spent here is a worker starved by the reader
+                    TraceScope wait("WaitForJob");
+                    if (!Ready.Pop(Job))
+                        break;
+                }
+                if (Job->Result == 0) {
+                    TraceScope trace("ProcessJob", Job->Data.size());
+                    Job->Result = Process(*Job);
+                }
+                Finished.Push(Job);
+            }
+        });
+    }
+
+    Reader.join();
+    for (std::thread &t : Pool)
+        t.join();
+    Finished.Close();
+    Writer.join();
+
+    return Failed;
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define BATCH_ERROR_READ_FAILED  -100
+#define BATCH_ERROR_WRITE_FAILED -101
+
+struct BatchJob
+{
+    std::string Input;  // source path
+    std::string Output; // destination path, empty if nothing is written
+    std::string Data;   // input bytes, replaced with the output bytes by the processor
+    int Result = 0;
+};
+
+struct BatchOptions
+{
+    unsigned Jobs     = 0;    // crypto worker threads, 0 = one per cpu
+    unsigned InFlight = 16;   // reads/writes kept in flight and jobs buffered between stages
+    bool UseUring     = true; // io_uring backend where the kernel supports it
+};
+
+typedef std::function<int(BatchJob &)> BatchProcessor;
+typedef std::function<void(BatchJob &)> BatchCallback;
+
+// Blocking FIFO with a fixed capacity, used between the pipeline stages
+template <typename T>
+class BoundedQueue
+{
+    std::mutex Mutex;
+    std::condition_variable NotEmpty;
+    std::condition_variable NotFull;
+    std::deque<T> Items;
+    size_t Capacity;
+    bool Closed = false;
+
+public:
+    explicit BoundedQueue(size_t capacity)
+        : Capacity(capacity ? capacity : 1)
+    {
+    }
+
+    void Push(T item)
+    {
+        std::unique_lock<std::mutex> lock(Mutex);
+        NotFull.wait(lock, [this] { return Items.size() < Capacity; });
+        Items.push_back(std::move(item));
+        NotEmpty.notify_one();
+    }
+
+    // waits for an item, false once the queue is closed and drained
+    bool Pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(Mutex);
+        NotEmpty.wait(lock, [this] { return !Items.empty() || Closed; });
+        if (Items.empty())
+            return false;
+        item = std::move(Items.front());
+        Items.pop_front();
+        NotFull.notify_one();
+        return true;
+    }
+
+    bool TryPop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(Mutex);
+        if (Items.empty())
+            return false;
+        item = std::move(Items.front());
+        Items.pop_front();
+        NotFull.notify_one();
+        return true;
+    }
+
+    void Close()
+    {
+        std::unique_lock<std::mutex> lock(Mutex);
+        Closed = true;
+        NotEmpty.notify_all();
+    }
+};
+
+// Runs Process over every job as a read -> crypto -> write pipeline, so that
+// reading file N+1 and writing file N-1 overlap with the crypto on file N.
+// Done is called from the writer stage once a job is finished.
+// Returns the number of failed jobs.
+int RunBatch(std::vector<BatchJob> &Jobs, const BatchProcessor &Process, const BatchCallback &Done, const BatchOptions &Options);
+
+#endif
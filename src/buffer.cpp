@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <new>
+#include <utility>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#include "buffer.h"
+
+static char *AllocateAligned(size_t size)
+{
+    // aligned_alloc wants a multiple of the alignment
+    size = (size + AlignedBuffer::Alignment - 1) & ~(AlignedBuffer::Alignment - 1);
+#ifdef _WIN32
+    void *p = _aligned_malloc(size, AlignedBuffer::Alignment);
+#else
+    void *p = aligned_alloc(AlignedBuffer::Alignment, size);
+#endif
+    if (p == NULL)
+        throw std::bad_alloc();
+    return (char *)p;
+}
+
+static void FreeAligned(char *p)
+{
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+AlignedBuffer::AlignedBuffer()
+    : Data(NULL)
+    , Size(0)
+    , Capacity(0)
+{
+}
+
+AlignedBuffer::AlignedBuffer(const AlignedBuffer &other)
+    : AlignedBuffer()
+{
+    assign(other.Data, other.Size);
+}
+
+AlignedBuffer::AlignedBuffer(AlignedBuffer &&other) noexcept
+    : Data(other.Data)
+    , Size(other.Size)
+    , Capacity(other.Capacity)
+{
+    other.Data     = NULL;
+    other.Size     = 0;
+    other.Capacity = 0;
+}
+
+AlignedBuffer &AlignedBuffer::operator=(const AlignedBuffer &other)
+{
+    if (this != &other)
+        assign(other.Data, other.Size);
+    return *this;
+}
+
+AlignedBuffer &AlignedBuffer::operator=(AlignedBuffer &&other) noexcept
+{
+    std::swap(Data, other.Data);
+    std::swap(Size, other.Size);
+    std::swap(Capacity, other.Capacity);
+    return *this;
+}
+
+AlignedBuffer::~AlignedBuffer()
+{
+    FreeAligned(Data);
+}
+
+void AlignedBuffer::reserve(size_t size)
+{
+    if (size <= Capacity)
+        return;
+
+    // grow geometrically so appending files of slowly growing size does not reallocate each time
+    size_t NewCapacity = std::max(size, Capacity + Capacity / 2);
+    char *NewData      = AllocateAligned(NewCapacity);
+    if (Size)
+        memcpy(NewData, Data, Size);
+    FreeAligned(Data);
+    Data     = NewData;
+    Capacity = NewCapacity;
+}
+
+void AlignedBuffer::resize(size_t size)
+{
+    reserve(size);
+    Size = size;
+}
+
+void AlignedBuffer::assign(const char *data, size_t size)
+{
+    // drop the old contents first so growing does not copy them
+    Size = 0;
+    reserve(size);
+    if (size)
+        memcpy(Data, data, size);
+    Size = size;
+}
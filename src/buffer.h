@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __BUFFER_H__
+#define __BUFFER_H__
+
+#include <stddef.h>
+#include <string>
+
+// Byte buffer on 64-byte aligned storage that never gives memory back while it lives,
+// so a reused buffer stops allocating once it has seen the largest file
+class AlignedBuffer
+{
+    char *Data;
+    size_t Size;
+    size_t Capacity;
+
+public:
+    static const size_t Alignment = 64;
+
+    AlignedBuffer();
+    AlignedBuffer(const AlignedBuffer &other);
+    AlignedBuffer(AlignedBuffer &&other) noexcept;
+    AlignedBuffer &operator=(const AlignedBuffer &other);
+    AlignedBuffer &operator=(AlignedBuffer &&other) noexcept;
+    ~AlignedBuffer();
+
+    char *data() { return Data; }
+    const char *data() const { return Data; }
+    size_t size() const { return Size; }
+    size_t capacity() const { return Capacity; }
+
+    void reserve(size_t size);
+    // bytes past the old size are left uninitialized
+    void resize(size_t size);
+    void assign(const char *data, size_t size);
+    void clear() { Size = 0; }
+    std::string str() const { return std::string(Data, Size); }
+};
+
+#endif
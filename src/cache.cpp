@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <algorithm>
+#include <filesystem>
+#include <vector>
+
+#include "cache.h"
+#include "fileio.h"
+
+namespace fs = std::filesystem;
+
+ResultCache::ResultCache(const std::string &dir, uint64_t maxSize)
+    : Dir(dir)
+    , MaxSize(maxSize)
+{
+    std::error_code ec;
+    fs::create_directories(Dir, ec);
+}
+
+std::string ResultCache::GetEntryPath(const std::string &Key) const
+{
+    return (fs::path(Dir) / (Key + ".bin")).string();
+}
+
+bool ResultCache::Fetch(const std::string &Key, const std::string &filename)
+{
+    std::error_code ec;
+    fs::path entry = GetEntryPath(Key);
+    if (!fs::is_regular_file(entry, ec))
+        return false;
+
+    // mark as recently used
+    fs::last_write_time(entry, fs::file_time_type::clock::now(), ec);
+
+    // copied, never linked: the output is the user's file and must not share an inode with the
+    // entry, or the next write to it would change the cached result. The copy goes to a private
+    // name next to filename first, so filename only ever holds a complete result
+    std::string temp = filename + "." + std::to_string(fs::file_time_type::clock::now().time_since_epoch().count()) + ".tmp";
+    fs::copy_file(entry, temp, fs::copy_options::overwrite_existing, ec);
+    if (!ec)
+        fs::rename(temp, filename, ec);
+    if (ec) {
+        std::error_code ignored;
+        fs::remove(temp, ignored);
+        return false;
+    }
+
+    return true;
+}
+
+bool ResultCache::FetchData(const std::string &Key, std::string &Data)
+{
+    std::error_code ec;
+    fs::path entry = GetEntryPath(Key);
+    if (!fs::is_regular_file(entry, ec))
+        return false;
+
+    fs::last_write_time(entry, fs::file_time_type::clock::now(), ec);
+    return ReadWholeFile(entry.string(), Data) == 0;
+}
+
+void ResultCache::Store(const std::string &Key, const std::string &Data)
+{
+    if (Data.size() > MaxSize)
+        return;
+
+    // write under a private name first, so concurrent runs never see partial entries
+    std::string entry = GetEntryPath(Key);
+    std::string temp  = entry + "." + std::to_string(fs::file_time_type::clock::now().time_since_epoch().count()) + ".tmp";
+    if (WriteWholeFile(temp, Data) != 0)
+        return;
+
+    std::error_code ec;
+    fs::rename(temp, entry, ec);
+    if (ec) {
+        fs::remove(temp, ec);
+        return;
+    }
+
+    Evict();
+}
+
+void ResultCache::Evict()
+{
+    struct Entry
+    {
+        fs::path path;
+        fs::file_time_type time;
+        uint64_t size;
+    };
+
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+
+    std::error_code ec;
+    for (fs::directory_iterator it(Dir, ec), end; !ec && it != end; it.increment(ec)) {
+        if (it->path().extension() != ".bin" || !it->is_regular_file(ec))
+            continue;
+        Entry e;
+        e.path = it->path();
+        e.time = it->last_write_time(ec);
+        e.size = it->file_size(ec);
+        if (ec) {
+            ec.clear();
+            continue;
+        }
+        total += e.size;
+        entries.push_back(e);
+    }
+
+    if (total <= MaxSize)
+        return;
+
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.time < b.time; });
+    for (const Entry &e : entries) {
+        if (total <= MaxSize)
+            break;
+        if (fs::remove(e.path, ec))
+            total -= e.size;
+    }
+}
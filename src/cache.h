@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdint.h>
+#include <string>
+
+#define CACHE_DEFAULT_SIZE (512ull * 1024 * 1024)
+
+// On-disk content-addressed store of encrypt/decrypt results.
+// Entries are plain files named after their key, the modification time
+// of an entry is bumped on every hit and used for LRU eviction.
+class ResultCache
+{
+    std::string Dir;
+    uint64_t MaxSize;
+
+    std::string GetEntryPath(const std::string &Key) const;
+    void Evict();
+
+public:
+    ResultCache(const std::string &dir, uint64_t maxSize = CACHE_DEFAULT_SIZE);
+
+    // copies the cached result for Key to filename, false on a miss
+    bool Fetch(const std::string &Key, const std::string &filename);
+    // reads the cached result for Key into Data, false on a miss
+    bool FetchData(const std::string &Key, std::string &Data);
+    // stores Data under Key, then trims the cache down to MaxSize
+    void Store(const std::string &Key, const std::string &Data);
+};
+
+#endif
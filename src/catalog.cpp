@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <thread>
+
+#include "catalog.h"
+#include "fileio.h"
+
+static const char CatalogMagic[8] = {'K', 'E', 'L', 'F', 'C', 'A', 'T', '1'};
+
+static const char *FieldNames[] = {"size", "status", "keyset", "header", "contentsize", "headersize",
+                                   "systemtype", "apptype", "flags", "bitcount", "mgzones", "blocks"};
+
+int GetCatalogField(const std::string &name)
+{
+    for (int i = 0; i < CATALOG_FIELD_INVALID; i++) {
+        if (name == FieldNames[i])
+            return i;
+    }
+    return CATALOG_FIELD_INVALID;
+}
+
+static uint64_t GetFieldValue(const CatalogEntry &Entry, int Field)
+{
+    switch (Field) {
+        case CATALOG_FIELD_SIZE:
+            return Entry.FileSize;
+        case CATALOG_FIELD_STATUS:
+            return (uint64_t)(int64_t)Entry.Status;
+        case CATALOG_FIELD_HEADER:
+            return (uint64_t)(int64_t)GetHeaderId(Entry.Header.UserDefined);
+        case CATALOG_FIELD_CONTENTSIZE:
+            return Entry.Header.ContentSize;
+        case CATALOG_FIELD_HEADERSIZE:
+            return Entry.Header.HeaderSize;
+        case CATALOG_FIELD_SYSTEMTYPE:
+            return Entry.Header.SystemType;
+        case CATALOG_FIELD_APPTYPE:
+            return Entry.Header.ApplicationType;
+        case CATALOG_FIELD_FLAGS:
+            return Entry.Header.Flags;
+        case CATALOG_FIELD_BITCOUNT:
+            return Entry.Header.BitCount;
+        case CATALOG_FIELD_MGZONES:
+            return Entry.Header.MGZones;
+        case CATALOG_FIELD_BLOCKS:
+            return Entry.Blocks.size();
+    }
+    return 0;
+}
+
+static bool Match(const CatalogEntry &Entry, const CatalogTerm &Term)
+{
+    if (Term.Field == CATALOG_FIELD_KEYSET) {
+        bool equal = Entry.KeySet == Term.Text;
+        return Term.Op == CATALOG_OP_NE ? !equal : equal;
+    }
+
+    uint64_t Value = GetFieldValue(Entry, Term.Field);
+    switch (Term.Op) {
+        case CATALOG_OP_EQ:
+            return Value == Term.Value;
+        case CATALOG_OP_NE:
+            return Value != Term.Value;
+        case CATALOG_OP_LT:
+            return Value < Term.Value;
+        case CATALOG_OP_GT:
+            return Value > Term.Value;
+        case CATALOG_OP_ALL:
+            return (Value & Term.Value) == Term.Value;
+        case CATALOG_OP_NONE:
+            return (Value & Term.Value) == 0;
+    }
+    return false;
+}
+
+// layout: magic, entry count, then per entry
+// path length, path, size, mtime, status, keyset length, keyset, KELFHeader, block count, {size, flags} per block
+int Catalog::Save(const std::string &filename) const
+{
+    std::string Data(CatalogMagic, sizeof(CatalogMagic));
+    auto Put = [&Data](const void *Value, size_t Size) { Data.append((const char *)Value, Size); };
+
+    uint32_t Count = Entries.size();
+    Put(&Count, sizeof(Count));
+    for (const auto &it : Entries) {
+        const CatalogEntry &Entry = it.second;
+        uint16_t PathSize         = Entry.Path.size();
+        uint8_t KeySetSize        = Entry.KeySet.size();
+        uint8_t BlockCount        = Entry.Blocks.size();
+        int32_t Status            = Entry.Status;
+        Put(&PathSize, sizeof(PathSize));
+        Data += Entry.Path;
+        Put(&Entry.FileSize, sizeof(Entry.FileSize));
+        Put(&Entry.MTime, sizeof(Entry.MTime));
+        Put(&Status, sizeof(Status));
+        Put(&KeySetSize, sizeof(KeySetSize));
+        Data += Entry.KeySet;
+        Put(&Entry.Header, sizeof(Entry.Header));
+        Put(&BlockCount, sizeof(BlockCount));
+        for (const auto &Block : Entry.Blocks) {
+            Put(&Block.first, sizeof(Block.first));
+            Put(&Block.second, sizeof(Block.second));
+        }
+    }
+
+    if (WriteWholeFile(filename, Data) != 0)
+        return CATALOG_ERROR_OPEN_FAILED;
+    return 0;
+}
+
+int Catalog::Load(const std::string &filename)
+{
+    std::string Data;
+    if (ReadWholeFile(filename, Data) != 0)
+        return CATALOG_ERROR_OPEN_FAILED;
+
+    size_t Offset = 0;
+    auto Get      = [&Data, &Offset](void *Value, size_t Size) {
+        if (Data.size() - Offset < Size)
+            return false;
+        memcpy(Value, &Data[Offset], Size);
+        Offset += Size;
+        return true;
+    };
+    auto GetString = [&Data, &Offset](std::string &Value, size_t Size) {
+        if (Data.size() - Offset < Size)
+            return false;
+        Value = Data.substr(Offset, Size);
+        Offset += Size;
+        return true;
+    };
+
+    char Magic[sizeof(CatalogMagic)];
+    uint32_t Count;
+    if (!Get(Magic, sizeof(Magic)) || memcmp(Magic, CatalogMagic, sizeof(Magic)) || !Get(&Count, sizeof(Count)))
+        return CATALOG_ERROR_BAD_CATALOG;
+
+    Entries.clear();
+    for (uint32_t i = 0; i < Count; i++) {
+        CatalogEntry Entry;
+        uint16_t PathSize;
+        uint8_t KeySetSize, BlockCount;
+        int32_t Status;
+        if (!Get(&PathSize, sizeof(PathSize)) || !GetString(Entry.Path, PathSize) ||
+            !Get(&Entry.FileSize, sizeof(Entry.FileSize)) || !Get(&Entry.MTime, sizeof(Entry.MTime)) ||
+            !Get(&Status, sizeof(Status)) || !Get(&KeySetSize, sizeof(KeySetSize)) || !GetString(Entry.KeySet, KeySetSize) ||
+            !Get(&Entry.Header, sizeof(Entry.Header)) || !Get(&BlockCount, sizeof(BlockCount)))
+            return CATALOG_ERROR_BAD_CATALOG;
+        Entry.Status = Status;
+
+        Entry.Blocks.resize(BlockCount);
+        for (auto &Block : Entry.Blocks) {
+            if (!Get(&Block.first, sizeof(Block.first)) || !Get(&Block.second, sizeof(Block.second)))
+                return CATALOG_ERROR_BAD_CATALOG;
+        }
+        Entries[Entry.Path] = std::move(Entry);
+    }
+
+    return 0;
+}
+
+size_t Catalog::Update(const std::vector<std::string> &files, const std::function<void(CatalogEntry &)> &Parse, unsigned Threads)
+{
+    namespace fs = std::filesystem;
+
+    std::map<std::string, CatalogEntry> Current;
+    std::vector<CatalogEntry *> Stale;
+    for (const std::string &file : files) {
+        std::error_code ec;
+        CatalogEntry Entry;
+        Entry.Path     = file;
+        Entry.FileSize = fs::file_size(file, ec);
+        if (ec)
+            continue;
+        Entry.MTime = fs::last_write_time(file, ec).time_since_epoch().count();
+
+        auto it = Entries.find(file);
+        if (it != Entries.end() && it->second.FileSize == Entry.FileSize && it->second.MTime == Entry.MTime) {
+            Current[file] = std::move(it->second);
+            continue;
+        }
+        CatalogEntry &Slot = Current[file] = std::move(Entry);
+        Stale.push_back(&Slot);
+    }
+
+    if (Threads == 0)
+        Threads = std::max(1u, std::thread::hardware_concurrency());
+
+    std::atomic<size_t> Next(0);
+    std::vector<std::thread> Pool;
+    for (unsigned i = 0; i < std::min<size_t>(Threads, Stale.size()); i++) {
+        Pool.emplace_back([&] {
+            for (size_t n; (n = Next.fetch_add(1)) < Stale.size();)
+                Parse(*Stale[n]);
+        });
+    }
+    for (std::thread &t : Pool)
+        t.join();
+
+    Entries = std::move(Current);
+    return Stale.size();
+}
+
+std::vector<const CatalogEntry *> Catalog::Query(const std::vector<CatalogTerm> &Terms) const
+{
+    std::vector<const CatalogEntry *> Result;
+    for (const auto &it : Entries) {
+        bool match = true;
+        for (const CatalogTerm &Term : Terms)
+            match = match && Match(it.second, Term);
+        if (match)
+            Result.push_back(&it.second);
+    }
+    return Result;
+}
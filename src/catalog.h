@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __CATALOG_H__
+#define __CATALOG_H__
+
+#include <stdint.h>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "kelf.h"
+
+#define CATALOG_ERROR_OPEN_FAILED -1
+#define CATALOG_ERROR_BAD_CATALOG -2
+
+// metadata of one file, everything a query can look at
+struct CatalogEntry
+{
+    std::string Path;
+    uint64_t FileSize = 0;
+    int64_t MTime     = 0;
+    int Status        = 0;  // LoadKelf result with the detected keyset
+    std::string KeySet;     // empty if no keyset verifies the header
+    KELFHeader Header = {}; // zero unless a keyset verifies the header
+    std::vector<std::pair<uint32_t, uint32_t>> Blocks; // bit table Size, Flags
+};
+
+enum CATALOG_FIELD {
+    CATALOG_FIELD_SIZE = 0,
+    CATALOG_FIELD_STATUS,
+    CATALOG_FIELD_KEYSET,
+    CATALOG_FIELD_HEADER, // HEADER id of UserDefined
+    CATALOG_FIELD_CONTENTSIZE,
+    CATALOG_FIELD_HEADERSIZE,
+    CATALOG_FIELD_SYSTEMTYPE,
+    CATALOG_FIELD_APPTYPE,
+    CATALOG_FIELD_FLAGS,
+    CATALOG_FIELD_BITCOUNT,
+    CATALOG_FIELD_MGZONES,
+    CATALOG_FIELD_BLOCKS,
+    CATALOG_FIELD_INVALID,
+};
+
+enum CATALOG_OP {
+    CATALOG_OP_EQ = 0, // =
+    CATALOG_OP_NE,     // !=
+    CATALOG_OP_LT,     // <
+    CATALOG_OP_GT,     // >
+    CATALOG_OP_ALL,    // & all bits set
+    CATALOG_OP_NONE,   // !& no bit set
+};
+
+// one <field><op><value> condition, all terms of a query must match
+struct CatalogTerm
+{
+    int Field;
+    int Op;
+    uint64_t Value;
+    std::string Text; // value of string fields
+};
+
+int GetCatalogField(const std::string &name);
+
+class Catalog
+{
+    std::map<std::string, CatalogEntry> Entries; // by path
+
+public:
+    int Load(const std::string &filename);
+    int Save(const std::string &filename) const;
+
+    // brings the catalog in line with files: Parse runs only for files that are new or whose size
+    // or mtime changed, entries of files that are gone are dropped. returns the number of files parsed
+    size_t Update(const std::vector<std::string> &files, const std::function<void(CatalogEntry &)> &Parse, unsigned Threads);
+
+    std::vector<const CatalogEntry *> Query(const std::vector<CatalogTerm> &Terms) const;
+    size_t GetSize() const { return Entries.size(); }
+};
+
+#endif
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "deskey.h"
+#include "engine.h"
+
+struct CachedSchedule
+{
+    uint8_t Key[8];
+    bool Valid;
+    DES_key_schedule Schedule;
+};
+
+void GetDesKeySchedule(const void *Key, DES_key_schedule *Schedule)
+{
+    if (GEngine.Schedule == ENGINE_SCHEDULE_DIRECT) {
+        DES_set_key_unchecked((const_DES_cblock *)Key, Schedule);
+        return;
+    }
+
+    static const size_t Slots = 64;
+    thread_local CachedSchedule Cache[Slots];
+
+    uint64_t k;
+    memcpy(&k, Key, 8);
+    CachedSchedule &slot = Cache[(k * 0x9E3779B97F4A7C15ull) >> 58];
+    if (!slot.Valid || memcmp(slot.Key, Key, 8) != 0) {
+        DES_set_key((const_DES_cblock *)Key, &slot.Schedule);
+        memcpy(slot.Key, Key, 8);
+        slot.Valid = true;
+    }
+    *Schedule = slot.Schedule;
+}
@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __DESKEY_H__
+#define __DESKEY_H__
+
+#include <openssl/des.h>
+
+// key schedule of one 8 byte DES key, cached per thread since the same few master keys
+// are used over and over and setting up a schedule costs more than an 8 byte operation
+void GetDesKeySchedule(const void *Key, DES_key_schedule *Schedule);
+
+#endif
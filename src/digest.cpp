@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <openssl/evp.h>
+
+#include "digest.h"
+
+Sha256::Sha256()
+    : ctx(EVP_MD_CTX_new())
+{
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+}
+
+Sha256::~Sha256()
+{
+    EVP_MD_CTX_free(ctx);
+}
+
+void Sha256::Update(const void *data, size_t size)
+{
+    EVP_DigestUpdate(ctx, data, size);
+}
+
+std::string Sha256::FinalHex()
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    EVP_DigestFinal_ex(ctx, md, &len);
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+
+    std::string out;
+    for (unsigned int i = 0; i < len; i++) {
+        out += hex[md[i] >> 4];
+        out += hex[md[i] & 0xf];
+    }
+    return out;
+}
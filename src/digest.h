@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __DIGEST_H__
+#define __DIGEST_H__
+
+#include <string>
+
+struct evp_md_ctx_st;
+
+// Incremental SHA-256 on top of libcrypto
+class Sha256
+{
+    evp_md_ctx_st *ctx;
+
+public:
+    Sha256();
+    ~Sha256();
+    Sha256(const Sha256 &) = delete;
+    Sha256 &operator=(const Sha256 &) = delete;
+
+    void Update(const void *data, size_t size);
+    void Update(const std::string &data) { Update(data.data(), data.size()); }
+    // returns the digest as lowercase hex and resets the context
+    std::string FinalHex();
+};
+
+#endif
@@ -0,0 +1,305 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <openssl/des.h>
+#include <openssl/evp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define ENGINE_SSE2
+#endif
+
+#include "engine.h"
+#include "deskey.h"
+#include "inipp.h"
+
+EngineConfig GEngine;
+
+static const char *const CIPHER_NAMES[]   = {"des", "evp", NULL};
+static const char *const FOLD_NAMES[]     = {"bytes", "words", "sse2", NULL};
+static const char *const SCHEDULE_NAMES[] = {"cached", "direct", NULL};
+
+static void XorFoldBytes(const uint8_t *Data, size_t Size, uint8_t *Signature)
+{
+    for (size_t j = 0; j < Size; j += 8) {
+        for (size_t i = 0; i < 8; i++)
+            Signature[i] ^= Data[j + i];
+    }
+}
+
+static void XorFoldWords(const uint8_t *Data, size_t Size, uint8_t *Signature)
+{
+    uint64_t Fold, Word;
+    memcpy(&Fold, Signature, 8);
+    for (size_t j = 0; j < Size; j += 8) {
+        memcpy(&Word, Data + j, 8);
+        Fold ^= Word;
+    }
+    memcpy(Signature, &Fold, 8);
+}
+
+#ifdef ENGINE_SSE2
+// two units per register, the halves are folded at the end
+static void XorFoldSse2(const uint8_t *Data, size_t Size, uint8_t *Signature)
+{
+    __m128i Fold = _mm_loadl_epi64((const __m128i *)Signature);
+    size_t j     = 0;
+    for (; j + 16 <= Size; j += 16)
+        Fold = _mm_xor_si128(Fold, _mm_loadu_si128((const __m128i *)(Data + j)));
+    if (j < Size)
+        Fold = _mm_xor_si128(Fold, _mm_loadl_epi64((const __m128i *)(Data + j)));
+    Fold = _mm_xor_si128(Fold, _mm_srli_si128(Fold, 8));
+    _mm_storel_epi64((__m128i *)Signature, Fold);
+}
+#endif
+
+void XorFold(const uint8_t *Data, size_t Size, uint8_t *Signature)
+{
+    switch (GEngine.Fold) {
+        case ENGINE_FOLD_WORDS:
+            XorFoldWords(Data, Size, Signature);
+            return;
+#ifdef ENGINE_SSE2
+        case ENGINE_FOLD_SSE2:
+            XorFoldSse2(Data, Size, Signature);
+            return;
+#endif
+        default:
+            XorFoldBytes(Data, Size, Signature);
+    }
+}
+
+bool EvpCbc(void *Result, const void *Data, size_t Length, const void *Keys, int KeyCount, const void *IV, bool Decrypt)
+{
+    if (Length % 8 || Length > 0x7FFFFFF8 || KeyCount < 1 || KeyCount > 3)
+        return false;
+    const EVP_CIPHER *Cipher = KeyCount == 1 ? EVP_des_cbc() : KeyCount == 2 ? EVP_des_ede_cbc() : EVP_des_ede3_cbc();
+
+    // one context per thread, only re-keyed per call
+    thread_local std::unique_ptr<EVP_CIPHER_CTX, void (*)(EVP_CIPHER_CTX *)> Ctx(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free);
+    int Updated, Finished;
+    if (!Ctx || !EVP_CipherInit_ex(Ctx.get(), Cipher, NULL, (const uint8_t *)Keys, (const uint8_t *)IV, Decrypt ? 0 : 1))
+        return false;
+    EVP_CIPHER_CTX_set_padding(Ctx.get(), 0);
+    return EVP_CipherUpdate(Ctx.get(), (uint8_t *)Result, &Updated, (const uint8_t *)Data, (int)Length) &&
+           EVP_CipherFinal_ex(Ctx.get(), (uint8_t *)Result + Updated, &Finished);
+}
+
+// what TdesCbcCfb64Encrypt/Decrypt run for the content with the ENGINE_CIPHER_DES engine
+static void DesCbc(void *Result, const void *Data, size_t Length, const void *Keys, const void *IV, bool Decrypt)
+{
+    DES_key_schedule sc[2];
+    GetDesKeySchedule(Keys, &sc[0]);
+    GetDesKeySchedule((const uint8_t *)Keys + 8, &sc[1]);
+    DES_cblock iv;
+    memcpy(&iv, IV, 8);
+    DES_ede2_cbc_encrypt((const uint8_t *)Data, (uint8_t *)Result, Length, &sc[0], &sc[1], &iv, Decrypt ? DES_DECRYPT : DES_ENCRYPT);
+}
+
+std::string GetEngineConfigPath()
+{
+    if (getenv("KELFTOOL_ENGINE"))
+        return getenv("KELFTOOL_ENGINE");
+#if defined(__linux__) || defined(__APPLE__)
+    return std::string(getenv("HOME") ? getenv("HOME") : ".") + "/.kelftool-engine";
+#else
+    return std::string(getenv("USERPROFILE") ? getenv("USERPROFILE") : ".") + "\\.kelftool-engine";
+#endif
+}
+
+std::string GetCpuName()
+{
+#ifdef __linux__
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line)) {
+        if (line.compare(0, 10, "model name") == 0 && line.find(':') != std::string::npos) {
+            size_t start = line.find_first_not_of(" \t", line.find(':') + 1);
+            return start == std::string::npos ? "" : line.substr(start);
+        }
+    }
+#endif
+    return "";
+}
+
+static int FindName(const char *const *Names, const std::string &Name)
+{
+    for (int i = 0; Names[i] != NULL; i++) {
+        if (Name == Names[i])
+            return i;
+    }
+    return -1;
+}
+
+int LoadEngineConfig(const std::string &filename, EngineConfig &Config)
+{
+    inipp::Ini<char> ini;
+    std::ifstream infile(filename);
+    if (infile.fail())
+        return ENGINE_ERROR_OPEN_FAILED;
+    ini.parse(infile);
+
+    auto &section = ini.sections["engine"];
+    if (section["cpu"] != GetCpuName())
+        return ENGINE_ERROR_OTHER_HOST;
+
+    EngineConfig Loaded;
+    Loaded.Cipher   = FindName(CIPHER_NAMES, section["cipher"]);
+    Loaded.Fold     = FindName(FOLD_NAMES, section["fold"]);
+    Loaded.Schedule = FindName(SCHEDULE_NAMES, section["schedule"]);
+    if (Loaded.Cipher < 0 || Loaded.Fold < 0 || Loaded.Schedule < 0)
+        return ENGINE_ERROR_PARSE;
+#ifndef ENGINE_SSE2
+    if (Loaded.Fold == ENGINE_FOLD_SSE2)
+        return ENGINE_ERROR_PARSE;
+#endif
+    Config = Loaded;
+    return 0;
+}
+
+int SaveEngineConfig(const std::string &filename, const EngineConfig &Config)
+{
+    FILE *f = fopen(filename.c_str(), "w");
+    if (f == NULL)
+        return ENGINE_ERROR_OPEN_FAILED;
+    fprintf(f, "; written by kelftool tune, only used on this cpu\n[engine]\n");
+    fprintf(f, "cpu=%s\ncipher=%s\nfold=%s\nschedule=%s\n", GetCpuName().c_str(), CIPHER_NAMES[Config.Cipher], FOLD_NAMES[Config.Fold], SCHEDULE_NAMES[Config.Schedule]);
+    return fclose(f) == 0 ? 0 : ENGINE_ERROR_OPEN_FAILED;
+}
+
+std::string DescribeEngine(const EngineConfig &Config)
+{
+    return std::string("cipher=") + CIPHER_NAMES[Config.Cipher] + " fold=" + FOLD_NAMES[Config.Fold] + " schedule=" + SCHEDULE_NAMES[Config.Schedule];
+}
+
+// FIPS 81 CBC example, with K1 = K2 two key EDE gives the same ciphertext
+static const uint8_t KAT_KEY[16]   = {0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef, 0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef};
+static const uint8_t KAT_IV[8]     = {0x12, 0x34, 0x56, 0x78, 0x90, 0xab, 0xcd, 0xef};
+static const uint8_t KAT_PLAIN[24] = {'N', 'o', 'w', ' ', 'i', 's', ' ', 't', 'h', 'e', ' ', 't', 'i', 'm', 'e', ' ', 'f', 'o', 'r', ' ', 'a', 'l', 'l', ' '};
+static const uint8_t KAT_CIPHER[24] = {0xe5, 0xc7, 0xcd, 0xde, 0x87, 0x2b, 0xf2, 0x7c, 0x43, 0xe9, 0x34, 0x00,
+                                       0x8c, 0x38, 0x9c, 0x0f, 0x68, 0x37, 0x88, 0x49, 0x9a, 0x7c, 0x05, 0xf6};
+
+// MB/s of Run over Size bytes, repeated for about 50 ms
+template <typename F>
+static double Throughput(size_t Size, F Run)
+{
+    auto Start   = std::chrono::steady_clock::now();
+    double Bytes = 0, Seconds;
+    do {
+        Run();
+        Bytes += Size;
+        Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+    } while (Seconds < 0.05);
+    return Bytes / Seconds / 1e6;
+}
+
+static void PrintResult(const char *Kind, const char *Name, bool Verified, double Speed, const char *Unit)
+{
+    if (Verified)
+        printf("%-10s %-8s %10.1f %s\n", Kind, Name, Speed, Unit);
+    else
+        printf("%-10s %-8s %10s\n", Kind, Name, "failed KAT");
+}
+
+EngineConfig TuneEngine()
+{
+    EngineConfig Saved = GEngine;
+    EngineConfig Best;
+    std::vector<uint8_t> Buffer(256 * 1024), Copy(Buffer.size());
+    for (size_t i = 0; i < Buffer.size(); i++)
+        Buffer[i] = (uint8_t)(i * 131 + (i >> 8));
+    const uint8_t Keys[16] = {0x13, 0x34, 0x57, 0x79, 0x9b, 0xbc, 0xdf, 0xf1, 0x0e, 0x32, 0x9e, 0x86, 0x4a, 0x58, 0xc2, 0x1c};
+
+    double BestSpeed = 0;
+    for (int Cipher = 0; CIPHER_NAMES[Cipher] != NULL; Cipher++) {
+        auto Run = [&](void *Result, const void *Data, size_t Length, const void *Key, bool Decrypt) {
+            if (Cipher == ENGINE_CIPHER_EVP)
+                return EvpCbc(Result, Data, Length, Key, 2, KAT_IV, Decrypt);
+            DesCbc(Result, Data, Length, Key, KAT_IV, Decrypt);
+            return true;
+        };
+        // the vector, then agreement with the reference on two distinct keys and the way back
+        uint8_t Out[24];
+        bool Verified = Run(Out, KAT_PLAIN, sizeof(Out), KAT_KEY, false) && !memcmp(Out, KAT_CIPHER, sizeof(Out));
+        std::vector<uint8_t> Reference(Buffer.size());
+        DesCbc(Reference.data(), Buffer.data(), 4096, Keys, KAT_IV, false);
+        Verified = Verified && Run(Copy.data(), Buffer.data(), 4096, Keys, false) && !memcmp(Copy.data(), Reference.data(), 4096);
+        Verified = Verified && Run(Copy.data(), Copy.data(), 4096, Keys, true) && !memcmp(Copy.data(), Buffer.data(), 4096);
+
+        double Speed = Verified ? Throughput(Buffer.size(), [&] { Run(Copy.data(), Buffer.data(), Buffer.size(), Keys, false); }) : 0;
+        PrintResult("cipher", CIPHER_NAMES[Cipher], Verified, Speed, "MB/s");
+        if (Verified && Speed > BestSpeed) {
+            BestSpeed   = Speed;
+            Best.Cipher = Cipher;
+        }
+    }
+
+    BestSpeed = 0;
+    for (int Fold = 0; FOLD_NAMES[Fold] != NULL; Fold++) {
+#ifndef ENGINE_SSE2
+        if (Fold == ENGINE_FOLD_SSE2)
+            continue;
+#endif
+        GEngine.Fold = Fold;
+        bool Verified = true;
+        for (size_t Size : {8, 16, 24, 4096 + 8}) {
+            uint8_t Expected[8] = {1, 2, 3, 4, 5, 6, 7, 8}, Got[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+            XorFoldBytes(Buffer.data() + 8, Size, Expected);
+            XorFold(Buffer.data() + 8, Size, Got);
+            Verified = Verified && !memcmp(Expected, Got, 8);
+        }
+
+        uint8_t Signature[8] = {};
+        double Speed         = Verified ? Throughput(Buffer.size(), [&] { XorFold(Buffer.data(), Buffer.size(), Signature); }) : 0;
+        PrintResult("fold", FOLD_NAMES[Fold], Verified, Speed, "MB/s");
+        if (Verified && Speed > BestSpeed) {
+            BestSpeed = Speed;
+            Best.Fold = Fold;
+        }
+    }
+
+    BestSpeed = 0;
+    for (int Schedule = 0; SCHEDULE_NAMES[Schedule] != NULL; Schedule++) {
+        GEngine.Schedule = Schedule;
+        uint8_t Out[24];
+        DesCbc(Out, KAT_PLAIN, sizeof(Out), KAT_KEY, KAT_IV, false);
+        bool Verified = !memcmp(Out, KAT_CIPHER, sizeof(Out));
+
+        // headers use a handful of master keys for 8 byte operations, so this counts operations
+        double Speed = 0;
+        if (Verified) {
+            Speed = Throughput(64, [&] {
+                for (int i = 0; i < 64; i++)
+                    DesCbc(Out, KAT_PLAIN, 8, i & 1 ? Keys : KAT_KEY, KAT_IV, false);
+            });
+        }
+        PrintResult("schedule", SCHEDULE_NAMES[Schedule], Verified, Speed, "M ops/s");
+        if (Verified && Speed > BestSpeed) {
+            BestSpeed     = Speed;
+            Best.Schedule = Schedule;
+        }
+    }
+
+    GEngine = Saved;
+    return Best;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __ENGINE_H__
+#define __ENGINE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#define ENGINE_ERROR_OPEN_FAILED -600
+#define ENGINE_ERROR_PARSE       -601
+#define ENGINE_ERROR_OTHER_HOST  -602
+
+// content cipher
+#define ENGINE_CIPHER_DES 0 // DES_*_cbc_encrypt on our own key schedules
+#define ENGINE_CIPHER_EVP 1 // OpenSSL EVP, which may use a provider specific implementation
+// XOR fold of the signed blocks
+#define ENGINE_FOLD_BYTES 0
+#define ENGINE_FOLD_WORDS 1
+#define ENGINE_FOLD_SSE2  2
+// DES key schedule
+#define ENGINE_SCHEDULE_CACHED 0 // thread local cache of recent keys
+#define ENGINE_SCHEDULE_DIRECT 1 // set up on every call
+
+struct EngineConfig
+{
+    int Cipher   = ENGINE_CIPHER_DES;
+    int Fold     = ENGINE_FOLD_BYTES;
+    int Schedule = ENGINE_SCHEDULE_CACHED;
+};
+
+// selected at startup from the config written by tune, read only afterwards
+extern EngineConfig GEngine;
+
+// XORs the 8 byte units of Data (Size a multiple of 8) into Signature
+void XorFold(const uint8_t *Data, size_t Size, uint8_t *Signature);
+// CBC through EVP, false if EVP has no such cipher or Length is not a multiple of 8
+bool EvpCbc(void *Result, const void *Data, size_t Length, const void *Keys, int KeyCount, const void *IV, bool Decrypt);
+
+// $KELFTOOL_ENGINE, or .kelftool-engine in the home directory
+std::string GetEngineConfigPath();
+// "model name" of the cpu, a config is only used on the cpu it was tuned on
+std::string GetCpuName();
+// ENGINE_ERROR_OTHER_HOST leaves Config untouched
+int LoadEngineConfig(const std::string &filename, EngineConfig &Config);
+int SaveEngineConfig(const std::string &filename, const EngineConfig &Config);
+// "cipher=... fold=... schedule=..."
+std::string DescribeEngine(const EngineConfig &Config);
+
+// runs the known-answer test and a throughput probe of every implementation on this cpu,
+// prints the results and returns the fastest verified one of each kind
+EngineConfig TuneEngine();
+
+#endif
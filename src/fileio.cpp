@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "fileio.h"
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// stream that "-" writes to, see ReserveStdoutForData
+static FILE *StdoutData = NULL;
+
+void ReserveStdoutForData()
+{
+    if (StdoutData != NULL)
+        return;
+    fflush(stdout);
+#ifdef _WIN32
+    _setmode(_fileno(stdout), _O_BINARY);
+    int fd = _dup(_fileno(stdout));
+    if (fd >= 0 && (StdoutData = _fdopen(fd, "wb")) != NULL)
+        _dup2(_fileno(stderr), _fileno(stdout));
+#else
+    int fd = dup(fileno(stdout));
+    if (fd >= 0 && (StdoutData = fdopen(fd, "wb")) != NULL)
+        dup2(fileno(stderr), fileno(stdout));
+#endif
+}
+
+static int ReadStdin(std::string &data)
+{
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    char buffer[0x10000];
+    size_t size;
+    data.clear();
+    while ((size = fread(buffer, 1, sizeof(buffer), stdin)) > 0)
+        data.append(buffer, size);
+    if (ferror(stdin)) {
+        fprintf(stderr, "Couldn't read stdin: %s\n", strerror(errno));
+        return FILEIO_ERROR_READ_FAILED;
+    }
+
+    return 0;
+}
+
+static int WriteStdout(const char *data, size_t size)
+{
+    FILE *f = StdoutData != NULL ? StdoutData : stdout;
+    if (fwrite(data, 1, size, f) != size || fflush(f) != 0) {
+        fprintf(stderr, "Couldn't write stdout: %s\n", strerror(errno));
+        return FILEIO_ERROR_WRITE_FAILED;
+    }
+
+    return 0;
+}
+
+int ReadWholeFile(const std::string &filename, std::string &data)
+{
+    if (filename == "-")
+        return ReadStdin(data);
+
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (f == NULL) {
+        fprintf(stderr, "Couldn't open %s: %s\n", filename.c_str(), strerror(errno));
+        return FILEIO_ERROR_OPEN_FAILED;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (size < 0) {
+        fclose(f);
+        return FILEIO_ERROR_READ_FAILED;
+    }
+    data.resize(size);
+    if (fread(data.data(), 1, data.size(), f) != data.size()) {
+        fprintf(stderr, "Couldn't read %s: %s\n", filename.c_str(), strerror(errno));
+        fclose(f);
+        return FILEIO_ERROR_READ_FAILED;
+    }
+    fclose(f);
+
+    return 0;
+}
+
+int WriteWholeFile(const std::string &filename, const std::string &data)
+{
+    return WriteWholeFile(filename, data.data(), data.size());
+}
+
+int WriteWholeFile(const std::string &filename, const char *data, size_t size)
+{
+    if (filename == "-")
+        return WriteStdout(data, size);
+
+    FILE *f = fopen(filename.c_str(), "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Couldn't open %s: %s\n", filename.c_str(), strerror(errno));
+        return FILEIO_ERROR_OPEN_FAILED;
+    }
+    if (fwrite(data, 1, size, f) != size) {
+        fprintf(stderr, "Couldn't write %s: %s\n", filename.c_str(), strerror(errno));
+        fclose(f);
+        return FILEIO_ERROR_WRITE_FAILED;
+    }
+    if (fclose(f) != 0)
+        return FILEIO_ERROR_WRITE_FAILED;
+
+    return 0;
+}
+
+int ReadFileRange(const std::string &filename, uint64_t offset, uint64_t length, std::string &data)
+{
+    data.resize(length);
+    size_t done = 0;
+#ifdef _WIN32
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (f == NULL) {
+        fprintf(stderr, "Couldn't open %s: %s\n", filename.c_str(), strerror(errno));
+        return FILEIO_ERROR_OPEN_FAILED;
+    }
+    if (_fseeki64(f, offset, SEEK_SET) == 0)
+        done = fread(&data[0], 1, data.size(), f);
+    fclose(f);
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Couldn't open %s: %s\n", filename.c_str(), strerror(errno));
+        return FILEIO_ERROR_OPEN_FAILED;
+    }
+    while (done < data.size()) {
+        ssize_t ret = pread(fd, &data[done], data.size() - done, offset + done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0) {
+            fprintf(stderr, "Couldn't read %s: %s\n", filename.c_str(), strerror(errno));
+            close(fd);
+            return FILEIO_ERROR_READ_FAILED;
+        }
+        if (ret == 0)
+            break;
+        done += ret;
+    }
+    close(fd);
+#endif
+    data.resize(done);
+
+    return 0;
+}
+
+int WriteFileRange(const std::string &filename, uint64_t offset, const std::string &data)
+{
+    size_t done = 0;
+#ifdef _WIN32
+    FILE *f = fopen(filename.c_str(), "r+b");
+    if (f == NULL) {
+        fprintf(stderr, "Couldn't open %s: %s\n", filename.c_str(), strerror(errno));
+        return FILEIO_ERROR_OPEN_FAILED;
+    }
+    if (_fseeki64(f, offset, SEEK_SET) == 0)
+        done = fwrite(data.data(), 1, data.size(), f);
+    if (fclose(f) != 0)
+        done = 0;
+#else
+    int fd = open(filename.c_str(), O_WRONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Couldn't open %s: %s\n", filename.c_str(), strerror(errno));
+        return FILEIO_ERROR_OPEN_FAILED;
+    }
+    while (done < data.size()) {
+        ssize_t ret = pwrite(fd, &data[done], data.size() - done, offset + done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        done += ret;
+    }
+    if (close(fd) != 0)
+        done = 0;
+#endif
+    if (done != data.size()) {
+        fprintf(stderr, "Couldn't write %s: %s\n", filename.c_str(), strerror(errno));
+        return FILEIO_ERROR_WRITE_FAILED;
+    }
+
+    return 0;
+}
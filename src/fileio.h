@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __FILEIO_H__
+#define __FILEIO_H__
+
+#include <stdint.h>
+#include <string>
+
+#define FILEIO_ERROR_OPEN_FAILED  -1
+#define FILEIO_ERROR_READ_FAILED  -2
+#define FILEIO_ERROR_WRITE_FAILED -3
+
+// filename "-" reads stdin until EOF / writes stdout
+int ReadWholeFile(const std::string &filename, std::string &data);
+int WriteWholeFile(const std::string &filename, const std::string &data);
+int WriteWholeFile(const std::string &filename, const char *data, size_t size);
+// keeps the real stdout for "-" and sends all console messages to stderr instead
+void ReserveStdoutForData();
+// positional read of up to length bytes, data is shorter if the file ends first
+int ReadFileRange(const std::string &filename, uint64_t offset, uint64_t length, std::string &data);
+// positional write into an existing file, the rest of the file is left as it is
+int WriteFileRange(const std::string &filename, uint64_t offset, const std::string &data);
+
+#endif
@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unordered_set>
+
+#include "idlist.h"
+#include "fileio.h"
+
+static const char IndexMagic[8] = {'K', 'E', 'L', 'F', 'I', 'D', 'X', '1'};
+
+static uint64_t ToKey(const uint8_t *ID)
+{
+    uint64_t Key;
+    memcpy(&Key, ID, sizeof(Key));
+    return Key;
+}
+
+bool ParseConsoleID(const char *hex, uint8_t *ID)
+{
+    for (int i = 0; i < 8; i++) {
+        unsigned int byte;
+        if (sscanf(&hex[i * 2], "%2x", &byte) != 1)
+            return false;
+        ID[i] = (uint8_t)byte;
+    }
+    return strlen(hex) == 16;
+}
+
+int LoadIDList(const std::string &filename, std::vector<KELFConsoleID> &List)
+{
+    std::string Data;
+    if (ReadWholeFile(filename, Data) != 0)
+        return IDLIST_ERROR_OPEN_FAILED;
+
+    List.clear();
+    size_t Pos = 0;
+    while (Pos < Data.size()) {
+        size_t End = Data.find('\n', Pos);
+        if (End == std::string::npos)
+            End = Data.size();
+        std::string Line = Data.substr(Pos, End - Pos);
+        Pos              = End + 1;
+
+        Line = Line.substr(0, Line.find('#'));
+        char iLinkID[32], ConsoleID[32];
+        int fields = sscanf(Line.c_str(), "%31s %31s", iLinkID, ConsoleID);
+        if (fields <= 0)
+            continue;
+
+        KELFConsoleID Entry;
+        if (fields != 2 || !ParseConsoleID(iLinkID, Entry.iLinkID) || !ParseConsoleID(ConsoleID, Entry.ConsoleID))
+            return IDLIST_ERROR_PARSE_FAILED;
+        List.push_back(Entry);
+    }
+
+    if (List.size() > UINT16_MAX)
+        return IDLIST_ERROR_PARSE_FAILED;
+    return 0;
+}
+
+void ConsoleIndex::Add(const std::string &filename, uint16_t Flags, const std::vector<KELFConsoleID> &List)
+{
+    uint32_t Number = Files.size();
+    Files.push_back({filename, Flags});
+    for (const KELFConsoleID &Entry : List) {
+        Index.emplace(ToKey(Entry.iLinkID), Number);
+        Index.emplace(ToKey(Entry.ConsoleID), Number);
+    }
+}
+
+// layout: magic, file count, {flags, name length, name} per file, entry count, {ID, file} per entry
+int ConsoleIndex::Save(const std::string &filename) const
+{
+    std::string Data(IndexMagic, sizeof(IndexMagic));
+    auto Put = [&Data](const void *Value, size_t Size) { Data.append((const char *)Value, Size); };
+
+    uint32_t FileCount = Files.size();
+    Put(&FileCount, sizeof(FileCount));
+    for (const File &file : Files) {
+        uint32_t NameSize = file.Name.size();
+        Put(&file.Flags, sizeof(file.Flags));
+        Put(&NameSize, sizeof(NameSize));
+        Data += file.Name;
+    }
+
+    uint32_t EntryCount = Index.size();
+    Put(&EntryCount, sizeof(EntryCount));
+    for (const auto &Entry : Index) {
+        Put(&Entry.first, sizeof(Entry.first));
+        Put(&Entry.second, sizeof(Entry.second));
+    }
+
+    if (WriteWholeFile(filename, Data) != 0)
+        return IDLIST_ERROR_OPEN_FAILED;
+    return 0;
+}
+
+int ConsoleIndex::Load(const std::string &filename)
+{
+    std::string Data;
+    if (ReadWholeFile(filename, Data) != 0)
+        return IDLIST_ERROR_OPEN_FAILED;
+
+    size_t Offset = 0;
+    auto Get      = [&Data, &Offset](void *Value, size_t Size) {
+        if (Data.size() - Offset < Size)
+            return false;
+        memcpy(Value, &Data[Offset], Size);
+        Offset += Size;
+        return true;
+    };
+
+    char Magic[sizeof(IndexMagic)];
+    uint32_t FileCount;
+    if (!Get(Magic, sizeof(Magic)) || memcmp(Magic, IndexMagic, sizeof(Magic)) || !Get(&FileCount, sizeof(FileCount)))
+        return IDLIST_ERROR_BAD_INDEX;
+
+    Files.clear();
+    Index.clear();
+    for (uint32_t i = 0; i < FileCount; i++) {
+        File file;
+        uint32_t NameSize;
+        if (!Get(&file.Flags, sizeof(file.Flags)) || !Get(&NameSize, sizeof(NameSize)) || Data.size() - Offset < NameSize)
+            return IDLIST_ERROR_BAD_INDEX;
+        file.Name = Data.substr(Offset, NameSize);
+        Offset += NameSize;
+        Files.push_back(file);
+    }
+
+    uint32_t EntryCount;
+    if (!Get(&EntryCount, sizeof(EntryCount)))
+        return IDLIST_ERROR_BAD_INDEX;
+    Index.reserve(EntryCount);
+    for (uint32_t i = 0; i < EntryCount; i++) {
+        uint64_t Key;
+        uint32_t Number;
+        if (!Get(&Key, sizeof(Key)) || !Get(&Number, sizeof(Number)) || Number >= Files.size())
+            return IDLIST_ERROR_BAD_INDEX;
+        Index.emplace(Key, Number);
+    }
+
+    return 0;
+}
+
+std::vector<std::string> ConsoleIndex::Query(const uint8_t *ID) const
+{
+    std::unordered_set<uint32_t> Listed;
+    auto Range = Index.equal_range(ToKey(ID));
+    for (auto it = Range.first; it != Range.second; ++it)
+        Listed.insert(it->second);
+
+    // a whitelist has to name the console, a blacklist must not, files without a list boot anywhere
+    std::vector<std::string> Result;
+    for (uint32_t i = 0; i < Files.size(); i++) {
+        bool listed = Listed.count(i) != 0;
+        if (Files[i].Flags & HDR_FLAG1_WHITELIST) {
+            if (!listed)
+                continue;
+        } else if (Files[i].Flags & HDR_FLAG0_BLACKLIST) {
+            if (listed)
+                continue;
+        }
+        Result.push_back(Files[i].Name);
+    }
+    return Result;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __IDLIST_H__
+#define __IDLIST_H__
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "kelf.h"
+
+#define IDLIST_ERROR_OPEN_FAILED  -1
+#define IDLIST_ERROR_PARSE_FAILED -2
+#define IDLIST_ERROR_BAD_INDEX    -3
+
+// parses 16 hex digits into an 8 byte ID
+bool ParseConsoleID(const char *hex, uint8_t *ID);
+// reads "<iLinkID> <ConsoleID>" pairs, one per line, # starts a comment
+int LoadIDList(const std::string &filename, std::vector<KELFConsoleID> &List);
+
+// Maps every iLinkID/ConsoleID of a set of KELFs to the files listing it,
+// so asking which files boot on a console does not need to reload any of them
+class ConsoleIndex
+{
+    struct File
+    {
+        std::string Name;
+        uint16_t Flags; // KELFHeader.Flags, only the list bits matter
+    };
+
+    std::vector<File> Files;
+    std::unordered_multimap<uint64_t, uint32_t> Index; // ID -> position in Files
+
+public:
+    void Add(const std::string &filename, uint16_t Flags, const std::vector<KELFConsoleID> &List);
+    int Load(const std::string &filename);
+    int Save(const std::string &filename) const;
+
+    // files that would boot on a console with this iLinkID or ConsoleID
+    std::vector<std::string> Query(const uint8_t *ID) const;
+    size_t GetFileCount() const { return Files.size(); }
+};
+
+#endif
@@ -15,65 +15,92 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <openssl/des.h>
+#include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
-#include <errno.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 
 #include "kelf.h"
+#include "deskey.h"
+#include "engine.h"
+#include "fileio.h"
+#include "trace.h"
 
 uint8_t MG_IV_NULL[8] = {0};
 
-int TdesCbcCfb64Encrypt(void *Result, const void *Data, size_t Length, const void *Keys, int KeyCount, const void *IV)
+// CBC over one key count and direction, resolved at compile time so the
+// per call work is only the schedule lookup and the cipher itself
+template <int KeyCount, int Direction>
+static void TdesCbc(void *Result, const void *Data, size_t Length, const void *Keys, const void *IV)
 {
-    DES_key_schedule sc1;
-    DES_key_schedule sc2;
-    DES_key_schedule sc3;
+    static_assert(KeyCount >= 1 && KeyCount <= 3, "DES key count must be 1, 2 or 3");
 
-    DES_set_key((const_DES_cblock *)Keys, &sc1);
-    if (KeyCount >= 2)
-        DES_set_key((const_DES_cblock *)((uint8_t *)Keys + 8), &sc2);
-    if (KeyCount >= 3)
-        DES_set_key((const_DES_cblock *)((uint8_t *)Keys + 16), &sc3);
+    DES_key_schedule sc[KeyCount];
+    for (int i = 0; i < KeyCount; i++)
+        GetDesKeySchedule((const uint8_t *)Keys + i * 8, &sc[i]);
 
     DES_cblock iv;
     memcpy(&iv, IV, 8);
 
-    if (KeyCount == 1)
-        DES_cbc_encrypt((uint8_t *)Data, (uint8_t *)Result, Length, &sc1, &iv, DES_ENCRYPT);
-    if (KeyCount == 2)
-        DES_ede2_cbc_encrypt((uint8_t *)Data, (uint8_t *)Result, Length, &sc1, &sc2, &iv, DES_ENCRYPT);
-    if (KeyCount == 3)
-        DES_ede3_cbc_encrypt((uint8_t *)Data, (uint8_t *)Result, Length, &sc1, &sc2, &sc3, &iv, DES_ENCRYPT);
+    if constexpr (KeyCount == 1)
+        DES_cbc_encrypt((const uint8_t *)Data, (uint8_t *)Result, Length, &sc[0], &iv, Direction);
+    else if constexpr (KeyCount == 2)
+        DES_ede2_cbc_encrypt((const uint8_t *)Data, (uint8_t *)Result, Length, &sc[0], &sc[1], &iv, Direction);
     else
-        return KELF_ERROR_INVALID_DES_KEY_COUNT;
+        DES_ede3_cbc_encrypt((const uint8_t *)Data, (uint8_t *)Result, Length, &sc[0], &sc[1], &sc[2], &iv, Direction);
+}
 
-    return 0;
+// runtime key count, for the content whose key count comes from the header flags; the
+// implementation is the one tune selected for this host
+int TdesCbcCfb64Encrypt(void *Result, const void *Data, size_t Length, const void *Keys, int KeyCount, const void *IV)
+{
+    if (GEngine.Cipher == ENGINE_CIPHER_EVP && EvpCbc(Result, Data, Length, Keys, KeyCount, IV, false))
+        return 0;
+    switch (KeyCount) {
+        case 1:
+            TdesCbc<1, DES_ENCRYPT>(Result, Data, Length, Keys, IV);
+            return 0;
+        case 2:
+            TdesCbc<2, DES_ENCRYPT>(Result, Data, Length, Keys, IV);
+            return 0;
+        case 3:
+            TdesCbc<3, DES_ENCRYPT>(Result, Data, Length, Keys, IV);
+            return 0;
+        default:
+            return KELF_ERROR_INVALID_DES_KEY_COUNT;
+    }
 }
 
 int TdesCbcCfb64Decrypt(void *Result, const void *Data, size_t Length, const void *Keys, int KeyCount, const void *IV)
 {
-    DES_key_schedule sc1;
-    DES_key_schedule sc2;
-    DES_key_schedule sc3;
-
-    DES_set_key((const_DES_cblock *)Keys, &sc1);
-    if (KeyCount >= 2)
-        DES_set_key((const_DES_cblock *)((uint8_t *)Keys + 8), &sc2);
-    if (KeyCount >= 3)
-        DES_set_key((const_DES_cblock *)((uint8_t *)Keys + 16), &sc3);
-
-    DES_cblock iv;
-    memcpy(&iv, IV, 8);
-
-    if (KeyCount == 1)
-        DES_cbc_encrypt((uint8_t *)Data, (uint8_t *)Result, Length, &sc1, &iv, DES_DECRYPT);
-    if (KeyCount == 2)
-        DES_ede2_cbc_encrypt((uint8_t *)Data, (uint8_t *)Result, Length, &sc1, &sc2, &iv, DES_DECRYPT);
-    if (KeyCount == 3)
-        DES_ede3_cbc_encrypt((uint8_t *)Data, (uint8_t *)Result, Length, &sc1, &sc2, &sc3, &iv, DES_DECRYPT);
-    else
-        return KELF_ERROR_INVALID_DES_KEY_COUNT;
+    if (GEngine.Cipher == ENGINE_CIPHER_EVP && EvpCbc(Result, Data, Length, Keys, KeyCount, IV, true))
+        return 0;
+    switch (KeyCount) {
+        case 1:
+            TdesCbc<1, DES_DECRYPT>(Result, Data, Length, Keys, IV);
+            return 0;
+        case 2:
+            TdesCbc<2, DES_DECRYPT>(Result, Data, Length, Keys, IV);
+            return 0;
+        case 3:
+            TdesCbc<3, DES_DECRYPT>(Result, Data, Length, Keys, IV);
+            return 0;
+        default:
+            return KELF_ERROR_INVALID_DES_KEY_COUNT;
+    }
+}
 
-    return 0;
+// content key count selected by HDR_FLAG4_1DES/HDR_FLAG4_3DES. Kc holds two keys,
+// so anything but a plain 1DES flag means two key EDE
+static int GetContentKeyCount(uint16_t Flags)
+{
+    return (Flags & (HDR_FLAG4_1DES | HDR_FLAG4_3DES)) == HDR_FLAG4_1DES ? 1 : 2;
 }
 
 void xor_bit(const void *a, const void *b, void *Result, size_t Length)
@@ -84,423 +111,705 @@ void xor_bit(const void *a, const void *b, void *Result, size_t Length)
     }
 }
 
+// Thread safe memo table for the per-header key derivation.
+// Files in a corpus share a handful of headers, so it is simply
+// dropped whenever it grows past MaxEntries.
+template <size_t KeySize, size_t ValueSize>
+class MemoTable
+{
+    static const size_t MaxEntries = 4096;
+
+    typedef std::array<uint8_t, KeySize> Key;
+    typedef std::array<uint8_t, ValueSize> Value;
+
+    struct KeyHash
+    {
+        size_t operator()(const Key &key) const { return std::hash<std::string_view>()(std::string_view((const char *)key.data(), key.size())); }
+    };
+
+    std::shared_mutex Mutex;
+    std::unordered_map<Key, Value, KeyHash> Map;
+
+public:
+    bool Find(const Key &key, Value &value)
+    {
+        std::shared_lock<std::shared_mutex> lock(Mutex);
+        auto it = Map.find(key);
+        if (it == Map.end())
+            return false;
+        value = it->second;
+        return true;
+    }
+
+    void Insert(const Key &key, const Value &value)
+    {
+        std::unique_lock<std::shared_mutex> lock(Mutex);
+        if (Map.size() >= MaxEntries)
+            Map.clear();
+        Map[key] = value;
+    }
+};
+
+static MemoTable<32 + 16, 16> KEKMemo;       // keyset + header prefix -> KEK
+static MemoTable<16 + 32, 32> UnwrappedMemo; // KEK + encrypted Kbit/Kc -> Kbit/Kc
+static MemoTable<16 + 32, 32> WrappedMemo;   // KEK + Kbit/Kc -> encrypted Kbit/Kc
+
+// CBC-MAC: the last block of the CBC encryption of Data, computed through a small
+// stack buffer instead of materializing the whole ciphertext. Mac holds the IV on entry.
+template <int KeyCount>
+static void CbcMac(const void *Data, size_t Length, const void *Key, uint8_t *Mac)
+{
+    uint8_t Chunk[512];
+    for (size_t done = 0; done < Length; done += sizeof(Chunk)) {
+        size_t n = std::min(sizeof(Chunk), Length - done);
+        TdesCbc<KeyCount, DES_ENCRYPT>(Chunk, (const uint8_t *)Data + done, n, Key, Mac);
+        memcpy(Mac, Chunk + n - 8, 8);
+    }
+}
+
 extern uint8_t GSystemtype;
 extern uint8_t GMGZones;
 extern uint16_t GFlags;
 extern uint8_t GApplicationType;
+extern FILE *GLog;
+extern std::vector<KELFConsoleID> GIDList;
+
+// informational output, silenced when GLog is NULL
+static void Log(const char *format, ...)
+{
+    if (GLog == NULL)
+        return;
+    va_list args;
+    va_start(args, format);
+    vfprintf(GLog, format, args);
+    va_end(args);
+}
+
+int GetHeaderId(const uint8_t *UserDefined)
+{
+    if (!memcmp(UserDefined, USER_HEADER_FMCB, 16))
+        return HEADER::FMCB;
+    if (!memcmp(UserDefined, USER_HEADER_FHDB, 16))
+        return HEADER::FHDB;
+    if (!memcmp(UserDefined, USER_HEADER_MBR, 16))
+        return HEADER::MBR;
+    if (!memcmp(UserDefined, USER_HEADER_DNASLOAD, 16))
+        return HEADER::DNASLOAD;
+    if (!memcmp(UserDefined, USER_HEADER_NAMCO_SECURITY_DONGLE_BOOTFILE, 16))
+        return HEADER::ARCADE_BOOTFILE;
+    return HEADER::INVALID;
+}
+
+// copies the next Size bytes of Data into Result, fails if Data is too short
+static bool ReadData(const std::string &Data, size_t &Offset, void *Result, size_t Size)
+{
+    if (Offset > Data.size() || Data.size() - Offset < Size)
+        return false;
+    memcpy(Result, Data.data() + Offset, Size);
+    Offset += Size;
+    return true;
+}
+
+// KELFHeader.UserDefined written for a HEADER
+static const uint8_t *GetUserHeader(int headerid)
+{
+    switch (headerid) {
+        case HEADER::FMCB:
+            return USER_HEADER_FMCB;
+        case HEADER::FHDB:
+            return USER_HEADER_FHDB;
+        case HEADER::MBR:
+            return USER_HEADER_MBR;
+        case HEADER::DNASLOAD:
+            return USER_HEADER_DNASLOAD;
+        case HEADER::ARCADE_BOOTFILE:
+            return USER_HEADER_NAMCO_SECURITY_DONGLE_BOOTFILE;
+        default:
+            return USER_HEADER_FHDB;
+    }
+}
+
+// Kbit used for a HEADER unless the keystore overrides it
+static const uint8_t *GetUserKbit(int headerid)
+{
+    switch (headerid) {
+        case HEADER::FMCB:
+        case HEADER::DNASLOAD:
+            return USER_Kbit_FMCB;
+        case HEADER::FHDB:
+            return USER_Kbit_FHDB;
+        case HEADER::MBR:
+            return USER_Kbit_MBR;
+        default:
+            return USER_Kbit_FHDB;
+    }
+}
+
+void Kelf::Reset()
+{
+    Header = KELFHeader();
+    IDList.clear();
+    Kbit.fill(0);
+    Kc.fill(0);
+    // the block array is only read up to BlockCount, clearing it all would cost 4 KiB per file
+    bitTable.HeaderSize = 0;
+    bitTable.BlockCount = 0;
+    Content.clear();
+}
+
+KelfPool::Handle KelfPool::Acquire()
+{
+    std::unique_ptr<Kelf> kelf;
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        if (!Free.empty()) {
+            kelf = std::move(Free.back());
+            Free.pop_back();
+        }
+    }
+    if (!kelf)
+        kelf.reset(new Kelf(ks));
+
+    return Handle(kelf.release(), [this](Kelf *released) {
+        released->Reset();
+        std::lock_guard<std::mutex> lock(Mutex);
+        Free.emplace_back(released);
+    });
+}
+
+// the size is only known after reading, so it goes on the end event
+static int TracedReadWholeFile(const std::string &filename, std::string &Data)
+{
+    bool Active = GTraceEnabled.load(std::memory_order_relaxed);
+    if (Active)
+        TraceEvent("ReadFile", 'B', 0);
+    int ret = ReadWholeFile(filename, Data);
+    if (Active)
+        TraceEvent("ReadFile", 'E', Data.size());
+    return ret;
+}
 
 int Kelf::LoadKelf(const std::string &filename)
 {
-    FILE *f = fopen(filename.c_str(), "rb");
-    if (f == NULL) {
-        fprintf(stderr, "Couldn't open %s: %s\n", filename.c_str(), strerror(errno));
+    TraceScope trace("LoadKelf");
+    std::string Data;
+    if (TracedReadWholeFile(filename, Data) != 0)
         return KELF_ERROR_UNSUPPORTED_FILE;
+
+    return LoadKelfData(Data);
+}
+
+int Kelf::LoadKelf(const std::string &filename, uint64_t offset, uint64_t length, bool HeaderOnly)
+{
+    TraceScope trace("LoadKelf", length);
+    std::string Data;
+    if (length != 0 && !HeaderOnly) {
+        if (ReadFileRange(filename, offset, length, Data) != 0)
+            return KELF_ERROR_UNSUPPORTED_FILE;
+        return LoadKelfData(Data);
     }
 
-    KELFHeader header;
-    fread(&header, sizeof(header), 1, f);
+    // size unknown: fetch the fixed header for HeaderSize, then the rest of the header, then the content
+    if (ReadFileRange(filename, offset, sizeof(KELFHeader), Data) != 0)
+        return KELF_ERROR_UNSUPPORTED_FILE;
+    if (Data.size() < sizeof(KELFHeader))
+        return KELF_ERROR_TRUNCATED_FILE;
+    uint16_t HeaderSize = ((KELFHeader *)Data.data())->HeaderSize;
+
+    if (ReadFileRange(filename, offset, HeaderSize, Data) != 0)
+        return KELF_ERROR_UNSUPPORTED_FILE;
+    int ret = LoadKelfHeader(Data);
+    if (ret != 0 || HeaderOnly)
+        return ret;
+
+    if (ReadFileRange(filename, offset + HeaderSize, GetContentSize(), Data) != 0)
+        return KELF_ERROR_UNSUPPORTED_FILE;
+    return LoadKelfContent(Data, 0);
+}
+
+int Kelf::LoadKelfData(const std::string &Data)
+{
+    TraceScope trace("LoadKelfData", Data.size());
+    int ret = LoadKelfHeader(Data);
+    if (ret != 0)
+        return ret;
+
+    return LoadKelfContent(Data, Header.HeaderSize);
+}
+
+uint64_t Kelf::GetContentSize() const
+{
+    uint64_t ContentSize = 0;
+    for (int i = 0; i < bitTable.BlockCount; i++)
+        ContentSize += bitTable.Blocks[i].Size;
+    return ContentSize;
+}
+
+int Kelf::LoadContentBlock(const std::string &Data, int Block, std::string &Plain)
+{
+    size_t Offset = Header.HeaderSize;
+    for (int i = 0; i < Block; i++)
+        Offset += bitTable.Blocks[i].Size;
+
+    const BitTable::BitBlock &block = bitTable.Blocks[Block];
+    TraceScope trace("LoadContentBlock", block.Size);
+    Plain.resize(block.Size);
+    if (!ReadData(Data, Offset, &Plain[0], block.Size))
+        return KELF_ERROR_TRUNCATED_FILE;
+    if (block.Flags & BIT_BLOCK_ENCRYPTED)
+        TdesCbcCfb64Decrypt(&Plain[0], &Plain[0], block.Size, Kc.data(), GetContentKeyCount(Header.Flags), ks->GetContentIV().data());
+    return 0;
+}
+
+int Kelf::ReadPlaintext(const std::string &filename, uint64_t offset, uint64_t Offset, uint64_t Length, std::string &Plain)
+{
+    TraceScope trace("ReadPlaintext", Length);
+    Plain.clear();
+
+    uint64_t End        = Offset + Length;
+    uint64_t BlockStart = 0;                         // plaintext offset of the block
+    uint64_t FilePos    = offset + Header.HeaderSize; // file offset of the block
+    std::string Cipher, Units;
+    for (int i = 0; i < bitTable.BlockCount && BlockStart < End; i++) {
+        const BitTable::BitBlock &block = bitTable.Blocks[i];
+        uint64_t BlockEnd               = BlockStart + block.Size;
+        if (Offset < BlockEnd) {
+            uint64_t From = std::max(Offset, BlockStart) - BlockStart;
+            uint64_t To   = std::min(End, BlockEnd) - BlockStart;
+            if (!(block.Flags & BIT_BLOCK_ENCRYPTED)) {
+                if (ReadFileRange(filename, FilePos + From, To - From, Units) != 0)
+                    return KELF_ERROR_UNSUPPORTED_FILE;
+                Plain += Units;
+                if (Units.size() < To - From)
+                    return 0;
+            } else {
+                // CBC restarts at every block, so a unit needs only the ciphertext unit before it
+                uint64_t First    = From / 8 * 8;
+                uint64_t Last     = std::min<uint64_t>((To + 7) / 8 * 8, block.Size);
+                uint64_t ReadFrom = First ? First - 8 : 0;
+                if (ReadFileRange(filename, FilePos + ReadFrom, Last - ReadFrom, Cipher) != 0)
+                    return KELF_ERROR_UNSUPPORTED_FILE;
+                if (Cipher.size() < Last - ReadFrom)
+                    return KELF_ERROR_TRUNCATED_FILE;
+                // a trailing partial unit is still read as a whole one by the cipher
+                Cipher.resize((Cipher.size() + 7) / 8 * 8);
+
+                Units.resize(Last - First);
+                const void *IV = First ? (const void *)Cipher.data() : ks->GetContentIV().data();
+                TdesCbcCfb64Decrypt(&Units[0], Cipher.data() + (First - ReadFrom), Last - First, Kc.data(), GetContentKeyCount(Header.Flags), IV);
+                Plain.append(Units, From - First, To - From);
+            }
+        }
+        BlockStart = BlockEnd;
+        FilePos += block.Size;
+    }
+    return 0;
+}
+
+int Kelf::LoadKelfHeader(const std::string &Data)
+{
+    TraceScope trace("LoadKelfHeader", Data.size());
+    size_t Offset = 0;
+
+    KELFHeader &header = Header;
+    if (!ReadData(Data, Offset, &header, sizeof(header)))
+        return KELF_ERROR_TRUNCATED_FILE;
 
-    if (header.Flags & 1 || header.Flags & 0xf0000 || header.BitCount != 0) {
+    if (header.Flags & 0xf0000) {
         // TODO: check more unknown bit flags
-        printf("This file is not supported yet and looked after.\n");
-        printf("Please upload it and post it under that issue:\n");
-        printf("https://github.com/xfwcfw/kelftool/issues/1\n");
-        // fclose(f);
+        Log("This file is not supported yet and looked after.\n");
+        Log("Please upload it and post it under that issue:\n");
+        Log("https://github.com/xfwcfw/kelftool/issues/1\n");
         // return KELF_ERROR_UNSUPPORTED_FILE;
     }
-    printf("header.UserDefined     =");
+    Log("header.UserDefined     =");
     for (size_t i = 0; i < sizeof(header.UserDefined); ++i)
-        printf(" %02X", header.UserDefined[i]);
+        Log(" %02X", header.UserDefined[i]);
     if (!memcmp(header.UserDefined, USER_HEADER_FMCB, 16))
-        printf(" (FMCB)\n");
+        Log(" (FMCB)\n");
     else if (!memcmp(header.UserDefined, USER_HEADER_DNASLOAD, 16))
-        printf(" (DNASLOAD)\n");
+        Log(" (DNASLOAD)\n");
     else if (!memcmp(header.UserDefined, USER_HEADER_NAMCO_SECURITY_DONGLE_BOOTFILE, 16))
-        printf(" (System 2x6 Dongle BootFile)\n");
+        Log(" (System 2x6 Dongle BootFile)\n");
     else if (!memcmp(header.UserDefined, USER_HEADER_FHDB, 16))
-        printf(" (FHDB)\n");
+        Log(" (FHDB)\n");
     else if (!memcmp(header.UserDefined, USER_HEADER_MBR, 16))
-        printf(" (MBR)\n");
+        Log(" (MBR)\n");
     else
-        printf("\n");
+        Log("\n");
 
-    printf("header.ContentSize     = %#X\n", header.ContentSize);
-    printf("header.HeaderSize      = %#X\n", header.HeaderSize);
+    Log("header.ContentSize     = %#X\n", header.ContentSize);
+    Log("header.HeaderSize      = %#X\n", header.HeaderSize);
     switch (header.SystemType) {
         case 0:
-            printf("header.SystemType      = 0 (SYSTEM_TYPE_PS2)\n");
+            Log("header.SystemType      = 0 (SYSTEM_TYPE_PS2)\n");
             break;
         case 1:
-            printf("header.SystemType      = 1 (SYSTEM_TYPE_PSX)\n");
+            Log("header.SystemType      = 1 (SYSTEM_TYPE_PSX)\n");
             break;
         default:
-            printf("header.SystemType      = %#X\n", header.SystemType);
-            printf("    This value is unknown.\n");
-            printf("    Please upload file and post under that issue:\n");
-            printf("    https://github.com/xfwcfw/kelftool/issues/1\n");
+            Log("header.SystemType      = %#X\n", header.SystemType);
+            Log("    This value is unknown.\n");
+            Log("    Please upload file and post under that issue:\n");
+            Log("    https://github.com/xfwcfw/kelftool/issues/1\n");
             break;
     }
     switch (header.ApplicationType) {
         case KELFTYPE_DISC_WOOBLE:
-            printf("header.ApplicationType = 0 (disc wobble \?)\n");
+            Log("header.ApplicationType = 0 (disc wobble \?)\n");
             break;
         case KELFTYPE_XOSDMAIN:
-            printf("header.ApplicationType = 1 (xosdmain)\n");
+            Log("header.ApplicationType = 1 (xosdmain)\n");
             break;
         case KELFTYPE_DVDPLAYER_KIRX:
-            printf("header.ApplicationType = 5 (dvdplayer kirx)\n");
+            Log("header.ApplicationType = 5 (dvdplayer kirx)\n");
             break;
         case KELFTYPE_DVDPLAYER_KELF:
-            printf("header.ApplicationType = 7 (dvdplayer kelf)\n");
+            Log("header.ApplicationType = 7 (dvdplayer kelf)\n");
             break;
         case KELFTYPE_EARLY_MBR:
-            printf("header.ApplicationType = 11 (early mbr \?)\n");
+            Log("header.ApplicationType = 11 (early mbr \?)\n");
             break;
         default:
-            printf("header.ApplicationType = %#X\n", header.ApplicationType);
-            printf("    This value is unknown.\n");
-            printf("    Please upload file and post under that issue:\n");
-            printf("    https://github.com/xfwcfw/kelftool/issues/1\n");
+            Log("header.ApplicationType = %#X\n", header.ApplicationType);
+            Log("    This value is unknown.\n");
+            Log("    Please upload file and post under that issue:\n");
+            Log("    https://github.com/xfwcfw/kelftool/issues/1\n");
             break;
     }
-    printf("header.Flags           = %#X", header.Flags);
+    Log("header.Flags           = %#X", header.Flags);
     if (header.Flags == HDR_PREDEF_KELF)
-        printf(" - kelf:");
+        Log(" - kelf:");
     else if (header.Flags == HDR_PREDEF_KIRX)
-        printf(" - kirx:");
+        Log(" - kirx:");
     else
-        printf(" - unknown:");
+        Log(" - unknown:");
     if (header.Flags & HDR_FLAG0_BLACKLIST)
-        printf("HDR_FLAG0_BLACKLIST|");
+        Log("HDR_FLAG0_BLACKLIST|");
     if (header.Flags & HDR_FLAG1_WHITELIST)
-        printf("HDR_FLAG1_WHITELIST|");
+        Log("HDR_FLAG1_WHITELIST|");
     if (header.Flags & HDR_FLAG2)
-        printf("HDR_FLAG2|");
+        Log("HDR_FLAG2|");
     if (header.Flags & HDR_FLAG3)
-        printf("HDR_FLAG3|");
+        Log("HDR_FLAG3|");
     if (header.Flags & HDR_FLAG4_1DES)
-        printf("HDR_FLAG4_1DES|");
+        Log("HDR_FLAG4_1DES|");
     if (header.Flags & HDR_FLAG4_3DES)
-        printf("HDR_FLAG4_3DES|");
+        Log("HDR_FLAG4_3DES|");
     if (header.Flags & HDR_FLAG6)
-        printf("HDR_FLAG6|");
+        Log("HDR_FLAG6|");
     if (header.Flags & HDR_FLAG7)
-        printf("HDR_FLAG7|");
+        Log("HDR_FLAG7|");
     if (header.Flags & HDR_FLAG8)
-        printf("HDR_FLAG8|");
+        Log("HDR_FLAG8|");
     if (header.Flags & HDR_FLAG9)
-        printf("HDR_FLAG9|");
+        Log("HDR_FLAG9|");
     if (header.Flags & HDR_FLAG10)
-        printf("HDR_FLAG10|");
+        Log("HDR_FLAG10|");
     if (header.Flags & HDR_FLAG11)
-        printf("HDR_FLAG11|");
+        Log("HDR_FLAG11|");
     if (header.Flags & HDR_FLAG12)
-        printf("HDR_FLAG12|");
+        Log("HDR_FLAG12|");
     if (header.Flags & HDR_FLAG13)
-        printf("HDR_FLAG13|");
+        Log("HDR_FLAG13|");
     if (header.Flags & HDR_FLAG14)
-        printf("HDR_FLAG14|");
+        Log("HDR_FLAG14|");
     if (header.Flags & HDR_FLAG15)
-        printf("HDR_FLAG15|");
-    printf("\n");
+        Log("HDR_FLAG15|");
+    Log("\n");
 
-    printf("header.BitCount        = %#X\n", header.BitCount);
-    printf("header.MGZones         = %#X |", header.MGZones);
+    Log("header.BitCount        = %#X\n", header.BitCount);
+    Log("header.MGZones         = %#X |", header.MGZones);
     if (header.MGZones == 0)
-        printf("All regions blocked (useless)|");
+        Log("All regions blocked (useless)|");
     else if (header.MGZones == REGION_ALL_ALLOWED)
-        printf("All regions allowed|");
+        Log("All regions allowed|");
     else {
         if (header.MGZones & REGION_JP)
-            printf("Japan|");
+            Log("Japan|");
         if (header.MGZones & REGION_NA)
-            printf("North America|");
+            Log("North America|");
         if (header.MGZones & REGION_EU)
-            printf("Europe|");
+            Log("Europe|");
         if (header.MGZones & REGION_AU)
-            printf("Australia|");
+            Log("Australia|");
         if (header.MGZones & REGION_ASIA)
-            printf("Asia|");
+            Log("Asia|");
         if (header.MGZones & REGION_RU)
-            printf("Russia|");
+            Log("Russia|");
         if (header.MGZones & REGION_CH)
-            printf("China|");
+            Log("China|");
         if (header.MGZones & REGION_MX)
-            printf("Mexico|");
+            Log("Mexico|");
     }
-    printf("\n");
+    Log("\n");
 
-    printf("header.gap             =");
+    Log("header.gap             =");
     for (unsigned int i = 0; i < 3; ++i)
-        printf(" %02X", (unsigned char)header.gap[i]);
-    printf("\n");
+        Log(" %02X", (unsigned char)header.gap[i]);
+    Log("\n");
+
+    IDList.resize(header.BitCount);
+    if (!ReadData(Data, Offset, IDList.data(), IDList.size() * sizeof(KELFConsoleID)))
+        return KELF_ERROR_TRUNCATED_FILE;
+    for (size_t i = 0; i < IDList.size(); ++i) {
+        Log("    IDList[%d] = iLinkID ", (int)i);
+        for (size_t j = 0; j < 8; ++j)
+            Log("%02X", IDList[i].iLinkID[j]);
+        Log(" ConsoleID ");
+        for (size_t j = 0; j < 8; ++j)
+            Log("%02X", IDList[i].ConsoleID[j]);
+        Log("\n");
+    }
 
-    std::string HeaderSignature;
-    HeaderSignature.resize(8);
-    fread(HeaderSignature.data(), 1, HeaderSignature.size(), f);
-    printf("HeaderSignature        =");
+    Block8 HeaderSignature;
+    if (!ReadData(Data, Offset, HeaderSignature.data(), HeaderSignature.size()))
+        return KELF_ERROR_TRUNCATED_FILE;
+    Log("HeaderSignature        =");
     for (size_t i = 0; i < 8; ++i)
-        printf(" %02X", (unsigned char)HeaderSignature[i]);
-    printf("\n");
+        Log(" %02X", (unsigned char)HeaderSignature[i]);
+    Log("\n");
 
-    if (HeaderSignature != GetHeaderSignature(header)) {
-        fclose(f);
+    if (HeaderSignature != GetHeaderSignature(header, IDList.data()))
         return KELF_ERROR_INVALID_HEADER_SIGNATURE;
-    }
 
-    std::string KEK = DeriveKeyEncryptionKey(header);
+    Block16 KEK = DeriveKeyEncryptionKey(header);
 
-    Kbit.resize(16);
-    fread(Kbit.data(), 1, Kbit.size(), f);
-
-    Kc.resize(16);
-    fread(Kc.data(), 1, Kc.size(), f);
+    if (!ReadData(Data, Offset, Kbit.data(), Kbit.size()) || !ReadData(Data, Offset, Kc.data(), Kc.size()))
+        return KELF_ERROR_TRUNCATED_FILE;
     DecryptKeys(KEK);
 
-    printf("Kbit                   =");
+    Log("Kbit                   =");
     for (size_t i = 0; i < 16; ++i)
-        printf(" %02X", (unsigned char)Kbit[i]);
+        Log(" %02X", (unsigned char)Kbit[i]);
 
-    printf("\nKc                     =");
+    Log("\nKc                     =");
     for (size_t i = 0; i < 16; ++i)
-        printf(" %02X", (unsigned char)Kc[i]);
+        Log(" %02X", (unsigned char)Kc[i]);
 
     // arcade
-    if (ks.GetOverrideKbit().size() && ks.GetOverrideKc().size()) {
-        memcpy(Kbit.data(), ks.GetOverrideKbit().data(), 16);
-        memcpy(Kc.data(), ks.GetOverrideKc().data(), 16);
+    if (ks->HasOverride()) {
+        Kbit = ks->GetOverrideKbit();
+        Kc   = ks->GetOverrideKc();
     }
 
-    int BitTableSize = header.HeaderSize - ftell(f) - 8 - 8;
-    printf("\nBitTableSize           = %#X\n", BitTableSize);
-    if (BitTableSize > sizeof(BitTable)) {
-        fclose(f);
+    int BitTableSize = header.HeaderSize - Offset - 8 - 8;
+    Log("\nBitTableSize           = %#X\n", BitTableSize);
+    if (BitTableSize < 0 || BitTableSize > sizeof(BitTable))
         return KELF_ERROR_INVALID_BIT_TABLE_SIZE;
-    }
 
-    fread(&bitTable, 1, BitTableSize, f);
+    if (!ReadData(Data, Offset, &bitTable, BitTableSize))
+        return KELF_ERROR_TRUNCATED_FILE;
 
-    TdesCbcCfb64Decrypt((uint8_t *)&bitTable, (uint8_t *)&bitTable, BitTableSize, (uint8_t *)Kbit.data(), 2, ks.GetContentTableIV().data());
-    printf("bitTable.HeaderSize    = %#X\n", bitTable.HeaderSize);
-    printf("bitTable.BlockCount    = %d\n", bitTable.BlockCount);
-    printf("bitTable.gap           =");
+    TdesCbc<2, DES_DECRYPT>((uint8_t *)&bitTable, (uint8_t *)&bitTable, BitTableSize, (uint8_t *)Kbit.data(), ks->GetContentTableIV().data());
+    Log("bitTable.HeaderSize    = %#X\n", bitTable.HeaderSize);
+    Log("bitTable.BlockCount    = %d\n", bitTable.BlockCount);
+    Log("bitTable.gap           =");
     for (unsigned int i = 0; i < 3; ++i)
-        printf(" %02X", (unsigned char)bitTable.gap[i]);
-    printf("\n                         Size        Signature           Flags\n");
+        Log(" %02X", (unsigned char)bitTable.gap[i]);
+    Log("\n                         Size        Signature           Flags\n");
     for (unsigned int i = 0; i < bitTable.BlockCount; ++i) {
-        printf("    bitTable.Blocks[%d] = %08X    ", (int)i, bitTable.Blocks[i].Size);
+        Log("    bitTable.Blocks[%d] = %08X    ", (int)i, bitTable.Blocks[i].Size);
         for (size_t j = 0; j < 8; ++j)
-            printf("%02X", (unsigned char)bitTable.Blocks[i].Signature[j]);
+            Log("%02X", (unsigned char)bitTable.Blocks[i].Signature[j]);
         switch (bitTable.Blocks[i].Flags) {
             case 0:
-                printf("    0 (not encrypted, not signed)\n");
+                Log("    0 (not encrypted, not signed)\n");
                 break;
             case 1:
-                printf("    1 (encrypted only)\n");
+                Log("    1 (encrypted only)\n");
                 break;
             case 2:
-                printf("    2 (signed only)\n");
+                Log("    2 (signed only)\n");
                 break;
             case 3:
-                printf("    3 (encrypted and signed)\n");
+                Log("    3 (encrypted and signed)\n");
                 break;
             default:
-                printf("    %08X (unknown set of flags\n)", bitTable.Blocks[i].Flags);
-                printf("This value is unknown.\n");
-                printf("Please upload file and post under that issue:\n");
-                printf("https://github.com/xfwcfw/kelftool/issues/1\n");
+                Log("    %08X (unknown set of flags\n)", bitTable.Blocks[i].Flags);
+                Log("This value is unknown.\n");
+                Log("Please upload file and post under that issue:\n");
+                Log("https://github.com/xfwcfw/kelftool/issues/1\n");
                 break;
         }
     }
 
 
-    std::string BitTableSignature;
-    BitTableSignature.resize(8);
-    fread(BitTableSignature.data(), 1, BitTableSignature.size(), f);
-    printf("BitTableSignature      =");
+    Block8 BitTableSignature;
+    if (!ReadData(Data, Offset, BitTableSignature.data(), BitTableSignature.size()))
+        return KELF_ERROR_TRUNCATED_FILE;
+    Log("BitTableSignature      =");
     for (size_t i = 0; i < 8; ++i)
-        printf(" %02X", (unsigned char)BitTableSignature[i]);
-    printf("\n");
+        Log(" %02X", (unsigned char)BitTableSignature[i]);
+    Log("\n");
 
-    if (BitTableSignature != GetBitTableSignature()) {
-        fclose(f);
+    if (BitTableSignature != GetBitTableSignature())
         return KELF_ERROR_INVALID_BIT_TABLE_SIGNATURE;
-    }
 
-    std::string RootSignature;
-    RootSignature.resize(8);
-    fread(RootSignature.data(), 1, RootSignature.size(), f);
+    Block8 RootSignature;
+    if (!ReadData(Data, Offset, RootSignature.data(), RootSignature.size()))
+        return KELF_ERROR_TRUNCATED_FILE;
     if (RootSignature != GetRootSignature(HeaderSignature, BitTableSignature)) {
-        printf("\nWARNING: RootSignature does not match         =");
+        Log("\nWARNING: RootSignature does not match         =");
         for (size_t i = 0; i < 8; ++i)
-            printf(" %02X", (unsigned char)RootSignature[i]);
-        printf("\n");
+            Log(" %02X", (unsigned char)RootSignature[i]);
+        Log("\n");
 
-        // fclose(f);
         // return KELF_ERROR_INVALID_ROOT_SIGNATURE;
     }
-    for (int i = 0; i < bitTable.BlockCount; i++) {
-        std::string Block;
-        Block.resize(bitTable.Blocks[i].Size);
-        fread(Block.data(), 1, Block.size(), f);
-        Content += Block;
-    }
 
-    DecryptContent(header.Flags >> 4 & 3);
+    return 0;
+}
+
+int Kelf::LoadKelfContent(const std::string &Data, size_t Offset)
+{
+    TraceScope trace("LoadKelfContent", GetContentSize());
+    Content.resize(GetContentSize());
+    if (!ReadData(Data, Offset, Content.data(), Content.size()))
+        return KELF_ERROR_TRUNCATED_FILE;
+
+    DecryptContent(GetContentKeyCount(Header.Flags));
 
     if (VerifyContentSignature() != 0) {
-        printf("WARNING: VerifyContentSignature does not match\n");
-        fclose(f);
+        Log("WARNING: VerifyContentSignature does not match\n");
         return KELF_ERROR_INVALID_CONTENT_SIGNATURE;
     }
 
-    fclose(f);
-
     return 0;
 }
 
 int Kelf::SaveKelf(const std::string &filename, int headerid)
 {
-    FILE *f = fopen(filename.c_str(), "wb");
-    if (f == NULL) {
-        fprintf(stderr, "Couldn't open %s: %s\n", filename.c_str(), strerror(errno));
+    TraceScope trace("SaveKelf");
+    std::string Data;
+    int ret = SaveKelfData(Data, headerid);
+    if (ret != 0)
+        return ret;
+
+    TraceScope write("WriteFile", Data.size());
+    if (WriteWholeFile(filename, Data) != 0)
         return KELF_ERROR_UNSUPPORTED_FILE;
-    }
-    KELFHeader header;
-
-    static uint8_t *USER_HEADER;
-
-    switch (headerid) {
-        case HEADER::FMCB:
-            USER_HEADER = USER_HEADER_FMCB;
-            break;
 
-        case HEADER::FHDB:
-            USER_HEADER = USER_HEADER_FHDB;
-            break;
-
-        case HEADER::MBR:
-            USER_HEADER = USER_HEADER_MBR;
-            break;
+    return 0;
+}
 
-        case HEADER::DNASLOAD:
-            USER_HEADER = USER_HEADER_DNASLOAD;
-            break;
+int Kelf::SaveKelfData(std::string &Data, int headerid)
+{
+    TraceScope trace("SaveKelfData", Content.size());
+    KELFHeader header;
 
-        case HEADER::ARCADE_BOOTFILE:
-            USER_HEADER = USER_HEADER_NAMCO_SECURITY_DONGLE_BOOTFILE;
-            break;
+    const uint8_t *USER_HEADER = GetUserHeader(headerid);
 
-        default:
-            USER_HEADER = USER_HEADER_FHDB;
-            break;
+    // the ID list is part of the header, so it grows HeaderSize and is covered by HeaderSignature
+    IDList              = GIDList;
+    bitTable.HeaderSize = sizeof(KELFHeader) + IDList.size() * sizeof(KELFConsoleID) + 8 + 16 + 16 + (bitTable.BlockCount * 2 + 1) * 8 + 8 + 8;
+    if (bitTable.HeaderSize > UINT16_MAX) {
+        Log("ID list of %zu entries does not fit in header.HeaderSize\n", IDList.size());
+        return KELF_ERROR_UNSUPPORTED_FILE;
     }
 
     memcpy(header.UserDefined, USER_HEADER, 16);
     header.ContentSize     = Content.size();      // sometimes zero
-    header.HeaderSize      = bitTable.HeaderSize; // header + header signature + kbit + kc + bittable + bittable signature + root signature
+    header.HeaderSize      = bitTable.HeaderSize; // header + ID list + header signature + kbit + kc + bittable + bittable signature + root signature
     header.SystemType      = GSystemtype;         // same for COH (arcade)
     header.ApplicationType = GApplicationType;    // 1 = xosdmain, 5 = dvdplayer kirx 7 = dvdplayer kelf 0xB - ?? 0x00 - ??
-    // TODO: implement and check 3DES/1DES difference based on header.Flags. In both - encryption and decryption.
-    header.Flags    = GFlags;   // ?? 00000010 00101100 binary, 0x021C for kirx
+    header.Flags    = GFlags;   // ?? 00000010 00101100 binary, 0x021C for kirx, HDR_FLAG4_1DES/3DES picks the content cipher
     header.MGZones  = GMGZones; // region bit, 1 - allowed
-    header.BitCount = 0;
-    // ?? balika, wisi: strange value, represents number of blacklisted iLinkID, ConsoleID
-    // iLinkID (8 bytes), consoleID (8 bytes) placed between header.MGZones and HeaderSignature
-    // it is part of header, so HeaderSignature and header.HeaderSize should be recalculated
+    header.BitCount = IDList.size(); // number of iLinkID, ConsoleID pairs placed between the header and HeaderSignature
+    if (IDList.size() && !(header.Flags & (HDR_FLAG0_BLACKLIST | HDR_FLAG1_WHITELIST)))
+        Log("WARNING: ID list given without HDR_FLAG0_BLACKLIST or HDR_FLAG1_WHITELIST\n");
 
     std::fill(header.gap, header.gap + 3, 0);
 
-    std::string HeaderSignature   = GetHeaderSignature(header);
-    std::string BitTableSignature = GetBitTableSignature();
-    std::string RootSignature     = GetRootSignature(HeaderSignature, BitTableSignature);
+    SerializeKelf(header, Data);
+    return 0;
+}
+
+// signs header and bit table with ks, wraps the keys and writes the whole file, Content must be encrypted already
+void Kelf::SerializeKelf(const KELFHeader &header, std::string &Data)
+{
+    Block8 HeaderSignature   = GetHeaderSignature(header, IDList.data());
+    Block8 BitTableSignature = GetBitTableSignature();
+    Block8 RootSignature     = GetRootSignature(HeaderSignature, BitTableSignature);
 
     int BitTableSize = (bitTable.BlockCount * 2 + 1) * 8;
-    TdesCbcCfb64Encrypt((uint8_t *)&bitTable, (uint8_t *)&bitTable, BitTableSize, (uint8_t *)Kbit.data(), 2, ks.GetContentTableIV().data());
+    TdesCbc<2, DES_ENCRYPT>((uint8_t *)&bitTable, (uint8_t *)&bitTable, BitTableSize, (uint8_t *)Kbit.data(), ks->GetContentTableIV().data());
 
-    std::string KEK = DeriveKeyEncryptionKey(header);
+    Block16 KEK = DeriveKeyEncryptionKey(header);
     EncryptKeys(KEK);
 
-    fwrite(&header, sizeof(header), 1, f);
-    fwrite(HeaderSignature.data(), 1, HeaderSignature.size(), f);
-    fwrite(Kbit.data(), 1, Kbit.size(), f);
-    fwrite(Kc.data(), 1, Kc.size(), f);
-    fwrite(&bitTable, 1, BitTableSize, f);
-    fwrite(BitTableSignature.data(), 1, BitTableSignature.size(), f);
-    fwrite(RootSignature.data(), 1, RootSignature.size(), f);
-
-    fwrite(Content.data(), 1, Content.size(), f);
-    fclose(f);
-
-    return 0;
+    Data.clear();
+    Data.reserve(bitTable.HeaderSize + Content.size());
+    Data.append((char *)&header, sizeof(header));
+    Data.append((char *)IDList.data(), IDList.size() * sizeof(KELFConsoleID));
+    Data.append((char *)HeaderSignature.data(), HeaderSignature.size());
+    Data.append((char *)Kbit.data(), Kbit.size());
+    Data.append((char *)Kc.data(), Kc.size());
+    Data.append((char *)&bitTable, BitTableSize);
+    Data.append((char *)BitTableSignature.data(), BitTableSignature.size());
+    Data.append((char *)RootSignature.data(), RootSignature.size());
+
+    Data.append(Content.data(), Content.size());
 }
 
 int Kelf::LoadContent(const std::string &filename, int headerid)
 {
-    FILE *f = fopen(filename.c_str(), "rb");
-    if (f == NULL) {
-        fprintf(stderr, "Couldn't open %s: %s\n", filename.c_str(), strerror(errno));
+    TraceScope trace("LoadContent");
+    std::string Data;
+    if (TracedReadWholeFile(filename, Data) != 0)
         return KELF_ERROR_UNSUPPORTED_FILE;
-    }
-    fseek(f, 0, SEEK_END);
-    Content.resize(ftell(f));
-    fseek(f, 0, SEEK_SET);
-    fread(Content.data(), 1, Content.size(), f);
-    fclose(f);
 
+    return LoadContentData(Data, headerid);
+}
+
+int Kelf::LoadContentData(const std::string &Data, int headerid)
+{
+    return LoadPaddedContent(PadContent(Data), headerid);
+}
+
+std::string Kelf::PadContent(const std::string &Data)
+{
     // Count trailing zeroes in Content
     size_t trailingZeroes = 0;
-    for (size_t i = Content.size(); (i > (Content.size()) - 0x18) && Content[i - 1] == 0; --i) {
+    for (size_t i = Data.size(); (i > (Data.size()) - 0x18) && Data[i - 1] == 0; --i) {
         ++trailingZeroes;
     }
 
     // remove at least 0x18 trailing zeroes
     // Add padding so file size is divided by 8.
     // After that add 0x10 zero bytes at the end, so encrypted block does not contain elf data
-    size_t origSize = Content.size();
+    size_t origSize = Data.size();
     size_t newSize  = ((origSize - trailingZeroes) / 8 + 3) * 8; // Divide by 8, add 3 blocks, and multiply by 8
-    Content.resize(newSize, 0);
-
-    // TODO: encrypted Kbit hold some useful data
-    static uint8_t *USER_Kbit;
-    switch (headerid) {
-        case HEADER::FMCB:
-        case HEADER::DNASLOAD:
-            USER_Kbit = USER_Kbit_FMCB;
-            break;
-
-        case HEADER::FHDB:
-            USER_Kbit = USER_Kbit_FHDB;
-            break;
+    std::string Padded(Data, 0, std::min(origSize, newSize));
+    Padded.resize(newSize, 0);
+    return Padded;
+}
 
-        case HEADER::MBR:
-            USER_Kbit = USER_Kbit_MBR;
-            break;
+int Kelf::LoadPaddedContent(const std::string &Padded, int headerid)
+{
+    TraceScope trace("LoadPaddedContent", Padded.size());
+    Content.assign(Padded.data(), Padded.size());
 
-        default:
-            USER_Kbit = USER_Kbit_FHDB;
-            break;
-    }
+    // TODO: encrypted Kbit hold some useful data
+    const uint8_t *USER_Kbit = GetUserKbit(headerid);
 
-    Kbit.resize(16);
     memcpy(Kbit.data(), USER_Kbit, 16);
     // std::fill(Kbit.data(), Kbit.data() + 16, 0x00);
 
     // TODO: encrypted Kc hold some useful data
-    Kc.resize(16);
     // memcpy(Kbit.data(), USER_Kc_MBR, 16);
     std::fill(Kc.data(), Kc.data() + 16, 0x00);
 
     // arcade
-    if (ks.GetOverrideKbit().size() && ks.GetOverrideKc().size()) {
-        printf("Overriding Kbit and Kc\n");
-        memcpy(Kbit.data(), ks.GetOverrideKbit().data(), 16);
-        memcpy(Kc.data(), ks.GetOverrideKc().data(), 16);
+    if (ks->HasOverride()) {
+        Log("Overriding Kbit and Kc\n");
+        Kbit = ks->GetOverrideKbit();
+        Kc   = ks->GetOverrideKc();
     }
-    printf("Kbit: %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x\n",
-           (uint8_t)Kbit[0], (uint8_t)Kbit[1], (uint8_t)Kbit[2], (uint8_t)Kbit[3], (uint8_t)Kbit[4], (uint8_t)Kbit[5], (uint8_t)Kbit[6], (uint8_t)Kbit[7], (uint8_t)Kbit[8], (uint8_t)Kbit[9], (uint8_t)Kbit[10], (uint8_t)Kbit[11], (uint8_t)Kbit[12], (uint8_t)Kbit[13], (uint8_t)Kbit[14], (uint8_t)Kbit[15]);
-    printf("Kc: %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x\n",
-           (uint8_t)Kc[0], (uint8_t)Kc[1], (uint8_t)Kc[2], (uint8_t)Kc[3], (uint8_t)Kc[4], (uint8_t)Kc[5], (uint8_t)Kc[6], (uint8_t)Kc[7], (uint8_t)Kc[8], (uint8_t)Kc[9], (uint8_t)Kc[10], (uint8_t)Kc[11], (uint8_t)Kc[12], (uint8_t)Kc[13], (uint8_t)Kc[14], (uint8_t)Kc[15]);
+    Log("Kbit: %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x\n",
+        (uint8_t)Kbit[0], (uint8_t)Kbit[1], (uint8_t)Kbit[2], (uint8_t)Kbit[3], (uint8_t)Kbit[4], (uint8_t)Kbit[5], (uint8_t)Kbit[6], (uint8_t)Kbit[7], (uint8_t)Kbit[8], (uint8_t)Kbit[9], (uint8_t)Kbit[10], (uint8_t)Kbit[11], (uint8_t)Kbit[12], (uint8_t)Kbit[13], (uint8_t)Kbit[14], (uint8_t)Kbit[15]);
+    Log("Kc: %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x\n",
+        (uint8_t)Kc[0], (uint8_t)Kc[1], (uint8_t)Kc[2], (uint8_t)Kc[3], (uint8_t)Kc[4], (uint8_t)Kc[5], (uint8_t)Kc[6], (uint8_t)Kc[7], (uint8_t)Kc[8], (uint8_t)Kc[9], (uint8_t)Kc[10], (uint8_t)Kc[11], (uint8_t)Kc[12], (uint8_t)Kc[13], (uint8_t)Kc[14], (uint8_t)Kc[15]);
 
     std::fill(bitTable.gap, bitTable.gap + 3, 0);
 
@@ -545,6 +854,9 @@ int Kelf::LoadContent(const std::string &filename, int headerid)
     // bitTable.Blocks[5].Size  = 0x100;
     // bitTable.Blocks[5].Flags = BIT_BLOCK_ENCRYPTED;
 
+    // SaveKelf writes GFlags into the header, so the content is encrypted to match it
+    int KeyCount = GetContentKeyCount(GFlags);
+
     uint32_t offset = 0;
     for (int i = 0; i < bitTable.BlockCount; ++i) {
         // ignore last block defined size, and just use the rest of elf
@@ -555,6 +867,7 @@ int Kelf::LoadContent(const std::string &filename, int headerid)
             // TODO: zero padding last block, 0x8 bytes if signed, 0x10 bytes if encrypted
         }
 
+        TraceScope block("EncryptBlock", bitTable.Blocks[i].Size);
         memset(bitTable.Blocks[i].Signature, 0, 8);
 
         // Sign
@@ -562,33 +875,29 @@ int Kelf::LoadContent(const std::string &filename, int headerid)
             if (!(bitTable.Blocks[i].Flags & BIT_BLOCK_ENCRYPTED)) {
                 // TODO: fix BIT_BLOCK_SIGNED alone support
                 // TODO: implement 1DES/3DES difference
-                printf("bitTable.Blocks[%d].Flags = BIT_BLOCK_SIGNED is not implemented during encryption. Encryption aborted.\n", i);
-                fclose(f);
+                Log("bitTable.Blocks[%d].Flags = BIT_BLOCK_SIGNED is not implemented during encryption. Encryption aborted.\n", i);
                 return KELF_ERROR_UNSUPPORTED_FILE;
             }
             if (bitTable.Blocks[i].Size % 0x8) {
-                printf("bitTable.Blocks[%d].Size = %08X is not bounded to 0x8 (BIT_BLOCK_SIGNED). Encryption aborted.\n", i, bitTable.Blocks[i].Size);
-                fclose(f);
+                Log("bitTable.Blocks[%d].Size = %08X is not bounded to 0x8 (BIT_BLOCK_SIGNED). Encryption aborted.\n", i, bitTable.Blocks[i].Size);
                 return KELF_ERROR_UNSUPPORTED_FILE;
             }
-            for (unsigned int j = 0; j < bitTable.Blocks[i].Size; j += 8)
-                xor_bit(&Content.data()[offset + j], bitTable.Blocks[i].Signature, bitTable.Blocks[i].Signature, 8);
+            XorFold((const uint8_t *)&Content.data()[offset], bitTable.Blocks[i].Size, bitTable.Blocks[i].Signature);
 
             uint8_t MG_SIG_MASTER_AND_HASH_KEY[16];
-            memcpy(MG_SIG_MASTER_AND_HASH_KEY, ks.GetSignatureMasterKey().data(), 8);
-            memcpy(MG_SIG_MASTER_AND_HASH_KEY + 8, ks.GetSignatureHashKey().data(), 8);
+            memcpy(MG_SIG_MASTER_AND_HASH_KEY, ks->GetSignatureMasterKey().data(), 8);
+            memcpy(MG_SIG_MASTER_AND_HASH_KEY + 8, ks->GetSignatureHashKey().data(), 8);
 
-            TdesCbcCfb64Encrypt(bitTable.Blocks[i].Signature, bitTable.Blocks[i].Signature, 8, MG_SIG_MASTER_AND_HASH_KEY, 2, MG_IV_NULL);
+            TdesCbc<2, DES_ENCRYPT>(bitTable.Blocks[i].Signature, bitTable.Blocks[i].Signature, 8, MG_SIG_MASTER_AND_HASH_KEY, MG_IV_NULL);
         }
 
         // Encrypt
         if (bitTable.Blocks[i].Flags & BIT_BLOCK_ENCRYPTED) {
             if (bitTable.Blocks[i].Size % 0x10) {
-                printf("bitTable.Blocks[%d].Size = %08X is not bounded to 0x10 (BIT_BLOCK_ENCRYPTED). Encryption aborted.\n", i, bitTable.Blocks[i].Size);
-                fclose(f);
+                Log("bitTable.Blocks[%d].Size = %08X is not bounded to 0x10 (BIT_BLOCK_ENCRYPTED). Encryption aborted.\n", i, bitTable.Blocks[i].Size);
                 return KELF_ERROR_UNSUPPORTED_FILE;
             }
-            TdesCbcCfb64Encrypt(&Content.data()[offset], &Content.data()[offset], bitTable.Blocks[i].Size, Kc.data(), 2, ks.GetContentIV().data());
+            TdesCbcCfb64Encrypt(&Content.data()[offset], &Content.data()[offset], bitTable.Blocks[i].Size, Kc.data(), KeyCount, ks->GetContentIV().data());
         }
 
         // if we reach the end of file
@@ -599,68 +908,426 @@ int Kelf::LoadContent(const std::string &filename, int headerid)
     return 0;
 }
 
+int KelfTemplate::Init(std::shared_ptr<const KeyStore> _ks, int headerid)
+{
+    TraceScope trace("KelfTemplateInit");
+    ks = std::move(_ks);
+
+    // the regular path on empty content, PadContent turns it into one plain unit and the zero block
+    Kelf kelf(ks);
+    int ret = kelf.LoadPaddedContent(Kelf::PadContent(std::string()), headerid);
+    if (ret != 0)
+        return ret;
+    if (kelf.bitTable.BlockCount != 2 || kelf.bitTable.Blocks[0].Flags != 0 || kelf.bitTable.Blocks[1].Size != sizeof(Tail))
+        return KELF_ERROR_UNSUPPORTED_FILE;
+
+    Kbit     = kelf.Kbit;
+    Kc       = kelf.Kc;
+    bitTable = kelf.bitTable;
+    memcpy(Tail, kelf.Content.data() + kelf.Content.size() - sizeof(Tail), sizeof(Tail));
+
+    std::string Data;
+    ret = kelf.SaveKelfData(Data, headerid);
+    if (ret != 0)
+        return ret;
+
+    memcpy(&Header, Data.data(), sizeof(Header));
+    IDList              = kelf.IDList;
+    bitTable.HeaderSize = Header.HeaderSize;
+    WrappedKbit         = kelf.Kbit;
+    WrappedKc           = kelf.Kc;
+    return 0;
+}
+
+int KelfTemplate::Build(const std::string &Padded, std::string &Data) const
+{
+    TraceScope trace("KelfTemplateBuild", Padded.size());
+    // the cached tail is only right for the zero block PadContent appends
+    static const uint8_t Zero[sizeof(Tail)] = {0};
+    if (Padded.size() < sizeof(Tail) + 8 || Padded.size() % 8 || memcmp(Padded.data() + Padded.size() - sizeof(Tail), Zero, sizeof(Tail)) != 0)
+        return KELF_ERROR_UNSUPPORTED_FILE;
+
+    KELFHeader header  = Header;
+    header.ContentSize = Padded.size();
+
+    // signed with the plain keys, the same way SerializeKelf does it
+    Kelf Signer(ks);
+    Signer.Kbit = Kbit;
+    Signer.Kc   = Kc;
+    int BitTableSize = (bitTable.BlockCount * 2 + 1) * 8;
+    memcpy(&Signer.bitTable, &bitTable, BitTableSize);
+    Signer.bitTable.Blocks[0].Size = Padded.size() - sizeof(Tail);
+
+    Block8 HeaderSignature   = Signer.GetHeaderSignature(header, IDList.data());
+    Block8 BitTableSignature = Signer.GetBitTableSignature();
+    Block8 RootSignature     = Signer.GetRootSignature(HeaderSignature, BitTableSignature);
+
+    TdesCbc<2, DES_ENCRYPT>((uint8_t *)&Signer.bitTable, (uint8_t *)&Signer.bitTable, BitTableSize, (uint8_t *)Kbit.data(), ks->GetContentTableIV().data());
+
+    Data.clear();
+    Data.reserve(bitTable.HeaderSize + Padded.size());
+    Data.append((char *)&header, sizeof(header));
+    Data.append((char *)IDList.data(), IDList.size() * sizeof(KELFConsoleID));
+    Data.append((char *)HeaderSignature.data(), HeaderSignature.size());
+    Data.append((char *)WrappedKbit.data(), WrappedKbit.size());
+    Data.append((char *)WrappedKc.data(), WrappedKc.size());
+    Data.append((char *)&Signer.bitTable, BitTableSize);
+    Data.append((char *)BitTableSignature.data(), BitTableSignature.size());
+    Data.append((char *)RootSignature.data(), RootSignature.size());
+
+    Data.append(Padded.data(), Padded.size() - sizeof(Tail));
+    Data.append((char *)Tail, sizeof(Tail));
+    return 0;
+}
+
+std::shared_ptr<const KelfTemplate> KelfTemplate::Get(std::shared_ptr<const KeyStore> ks, int headerid)
+{
+    static std::mutex Mutex;
+    static std::unordered_map<std::string, std::shared_ptr<const KelfTemplate>> Templates;
+
+    // every template holds on to its keystore, so the address is not reused while the entry exists
+    std::string Key;
+    const KeyStore *Keys = ks.get();
+    Key.append((const char *)&Keys, sizeof(Keys));
+    Key.append((const char *)&headerid, sizeof(headerid));
+    Key.append((const char *)&GFlags, sizeof(GFlags));
+    Key.append((const char *)&GSystemtype, sizeof(GSystemtype));
+    Key.append((const char *)&GApplicationType, sizeof(GApplicationType));
+    Key.append((const char *)&GMGZones, sizeof(GMGZones));
+    Key.append((const char *)GIDList.data(), GIDList.size() * sizeof(KELFConsoleID));
+
+    std::lock_guard<std::mutex> lock(Mutex);
+    auto it = Templates.find(Key);
+    if (it != Templates.end())
+        return it->second;
+
+    std::shared_ptr<KelfTemplate> Template(new KelfTemplate());
+    if (Template->Init(std::move(ks), headerid) != 0)
+        return NULL;
+    Templates[Key] = Template;
+    return Template;
+}
+
 int Kelf::SaveContent(const std::string &filename)
 {
-    FILE *f = fopen(filename.c_str(), "wb");
-    if (f == NULL) {
-        fprintf(stderr, "Couldn't open %s: %s\n", filename.c_str(), strerror(errno));
+    TraceScope trace("SaveContent", Content.size());
+    if (WriteWholeFile(filename, Content.data(), Content.size()) != 0)
         return KELF_ERROR_UNSUPPORTED_FILE;
+
+    return 0;
+}
+
+// signature of one plaintext content block, by the rules of its BIT_BLOCK_ENCRYPTED flag
+static Block8 GetBlockSignature(const KeyStore &keys, const uint8_t *Data, uint32_t Size, uint32_t Flags)
+{
+    Block8 Signature = {};
+    uint8_t *signature = Signature.data();
+
+    if (Flags & BIT_BLOCK_ENCRYPTED) {
+        XorFold(Data, Size, signature);
+
+        uint8_t MG_SIG_MASTER_AND_HASH_KEY[16];
+        memcpy(MG_SIG_MASTER_AND_HASH_KEY, keys.GetSignatureMasterKey().data(), 8);
+        memcpy(MG_SIG_MASTER_AND_HASH_KEY + 8, keys.GetSignatureHashKey().data(), 8);
+
+        TdesCbc<2, DES_ENCRYPT>(signature, signature, 8, MG_SIG_MASTER_AND_HASH_KEY, MG_IV_NULL);
+    } else {
+        CbcMac<1>(Data, Size, keys.GetSignatureMasterKey().data(), signature);
+        TdesCbc<1, DES_DECRYPT>(signature, signature, 8, keys.GetSignatureHashKey().data(), MG_IV_NULL);
+        TdesCbc<1, DES_ENCRYPT>(signature, signature, 8, keys.GetSignatureMasterKey().data(), MG_IV_NULL);
+    }
+    return Signature;
+}
+
+int Kelf::RekeyData(std::string &Data, std::shared_ptr<const KeyStore> To, int headerid)
+{
+    TraceScope trace("RekeyData", Data.size());
+    int ret = LoadKelfHeader(Data);
+    if (ret != 0)
+        return ret;
+
+    Content.resize(GetContentSize());
+    size_t Offset = Header.HeaderSize;
+    if (!ReadData(Data, Offset, Content.data(), Content.size()))
+        return KELF_ERROR_TRUNCATED_FILE;
+
+    std::shared_ptr<const KeyStore> From = ks;
+    Block16 FromKc                       = Kc;
+    int KeyCount                         = GetContentKeyCount(Header.Flags);
+
+    // same Kbit/Kc choice as LoadPaddedContent when the header changes, otherwise the keys are carried over
+    if (headerid != HEADER::INVALID) {
+        memcpy(Header.UserDefined, GetUserHeader(headerid), 16);
+        memcpy(Kbit.data(), GetUserKbit(headerid), 16);
+        std::fill(Kc.begin(), Kc.end(), 0x00);
+    }
+    if (To->HasOverride()) {
+        Log("Overriding Kbit and Kc\n");
+        Kbit = To->GetOverrideKbit();
+        Kc   = To->GetOverrideKc();
+    }
+
+    // every block goes plaintext -> verified -> re-signed -> encrypted while it is still in cache
+    uint32_t offset = 0;
+    for (int i = 0; i < bitTable.BlockCount; i++) {
+        BitTable::BitBlock &block = bitTable.Blocks[i];
+        uint8_t *p                = (uint8_t *)&Content.data()[offset];
+        TraceScope trace("RekeyBlock", block.Size);
+
+        if (block.Flags & BIT_BLOCK_ENCRYPTED)
+            TdesCbcCfb64Decrypt(p, p, block.Size, FromKc.data(), KeyCount, From->GetContentIV().data());
+        if (block.Flags & BIT_BLOCK_SIGNED) {
+            if (memcmp(GetBlockSignature(*From, p, block.Size, block.Flags).data(), block.Signature, 8) != 0) {
+                Log("bitTable.Blocks[%d].Signature does not match\n", i);
+                return KELF_ERROR_INVALID_CONTENT_SIGNATURE;
+            }
+            Block8 Signature = GetBlockSignature(*To, p, block.Size, block.Flags);
+            memcpy(block.Signature, Signature.data(), 8);
+        }
+        if (block.Flags & BIT_BLOCK_ENCRYPTED)
+            TdesCbcCfb64Encrypt(p, p, block.Size, Kc.data(), KeyCount, To->GetContentIV().data());
+
+        offset += block.Size;
     }
-    fwrite(Content.data(), 1, Content.size(), f);
-    fclose(f);
 
+    ks = std::move(To);
+    KELFHeader header = Header;
+    SerializeKelf(header, Data);
     return 0;
 }
 
-std::string Kelf::GetHeaderSignature(KELFHeader &header)
+// runs Task(0) .. Task(Count - 1) on one thread per cpu
+static void RunParallel(size_t Count, const std::function<void(size_t)> &Task)
+{
+    unsigned Threads = std::max(1u, std::thread::hardware_concurrency());
+    std::atomic<size_t> Next(0);
+    std::vector<std::thread> Pool;
+    for (unsigned i = 0; i < std::min<size_t>(Threads, Count); i++) {
+        Pool.emplace_back([&] {
+            for (size_t n; (n = Next.fetch_add(1)) < Count;)
+                Task(n);
+        });
+    }
+    for (std::thread &t : Pool)
+        t.join();
+}
+
+int Kelf::ReuseData(const std::string &Previous, const std::string &Padded, std::string &Data, int headerid, int &Reused, int &Blocks)
 {
-    uint8_t HMasterEnc[sizeof(KELFHeader)];
-    TdesCbcCfb64Encrypt(HMasterEnc, (uint8_t *)&header, sizeof(KELFHeader), ks.GetSignatureMasterKey().data(), 1, MG_IV_NULL);
+    TraceScope trace("ReuseData", Padded.size());
+    Reused  = 0;
+    Blocks  = 0;
+    int ret = LoadKelfHeader(Previous);
+    if (ret != 0)
+        return ret;
+
+    uint64_t OldSize = GetContentSize();
+    if (Previous.size() < Header.HeaderSize + OldSize)
+        return KELF_ERROR_TRUNCATED_FILE;
+    const char *OldContent = Previous.data() + Header.HeaderSize;
+    // the ciphertext can only be copied if the content cipher stays the same
+    int KeyCount    = GetContentKeyCount(GFlags);
+    bool SameCipher = GetContentKeyCount(Header.Flags) == KeyCount;
+
+    // a grown or shrunk input moves the size difference into the last unencrypted block, encrypted
+    // blocks keep their size so the zero tail PadContent appends stays the encrypted one
+    int Resized   = -1;
+    int64_t Delta = (int64_t)Padded.size() - (int64_t)OldSize;
+    for (int i = bitTable.BlockCount - 1; Delta != 0 && i >= 0; i--) {
+        if (bitTable.Blocks[i].Flags & BIT_BLOCK_ENCRYPTED)
+            continue;
+        int64_t Size   = (int64_t)bitTable.Blocks[i].Size + Delta;
+        uint32_t Align = (bitTable.Blocks[i].Flags & BIT_BLOCK_SIGNED) ? 0x8 : 1;
+        if (Size >= 0 && Size <= UINT32_MAX && Size % Align == 0) {
+            bitTable.Blocks[i].Size = Size;
+            Resized                 = i;
+            break;
+        }
+    }
+    if (Delta != 0 && Resized < 0) {
+        Log("%zu bytes of content do not fit the block layout of the previous KELF, encrypting it from scratch\n", Padded.size());
+        ret = LoadPaddedContent(Padded, headerid);
+        if (ret != 0)
+            return ret;
+        Blocks = bitTable.BlockCount;
+        return SaveKelfData(Data, headerid);
+    }
+
+    struct Chunk
+    {
+        int Block;
+        uint32_t From;
+        uint32_t Size;
+    };
+    const uint32_t ChunkSize = 0x40000;
+    std::vector<uint64_t> NewOffsets(bitTable.BlockCount), OldOffsets(bitTable.BlockCount);
+    std::vector<uint8_t> Changed(bitTable.BlockCount, 0);
+    std::vector<Chunk> Chunks;
+    uint64_t NewOffset = 0, OldOffset = 0;
+    for (int i = 0; i < bitTable.BlockCount; i++) {
+        const BitTable::BitBlock &block = bitTable.Blocks[i];
+        NewOffsets[i]                   = NewOffset;
+        OldOffsets[i]                   = OldOffset;
+        if (i == Resized || ((block.Flags & BIT_BLOCK_ENCRYPTED) && !SameCipher))
+            Changed[i] = 1;
+        else if (!(block.Flags & BIT_BLOCK_ENCRYPTED))
+            Changed[i] = memcmp(Padded.data() + NewOffset, OldContent + OldOffset, block.Size) != 0;
+        else
+            for (uint32_t From = 0; From < block.Size; From += ChunkSize)
+                Chunks.push_back({i, From, std::min(ChunkSize, block.Size - From)});
+        NewOffset += block.Size;
+        OldOffset += i == Resized ? block.Size - Delta : block.Size;
+    }
 
-    uint8_t Hsign[8];
-    memcpy(Hsign, HMasterEnc + sizeof(HMasterEnc) - 8, 8);
-    TdesCbcCfb64Decrypt(Hsign, Hsign, 8, ks.GetSignatureHashKey().data(), 1, MG_IV_NULL);
-    TdesCbcCfb64Encrypt(Hsign, Hsign, 8, ks.GetSignatureMasterKey().data(), 1, MG_IV_NULL);
+    // CBC restarts at every block and a unit only needs the ciphertext unit before it, so the old
+    // ciphertext is compared chunk by chunk on every cpu; a block is skipped after its first difference
+    std::unique_ptr<std::atomic<bool>[]> Differs(new std::atomic<bool>[bitTable.BlockCount]());
+    RunParallel(Chunks.size(), [&](size_t n) {
+        const Chunk &chunk = Chunks[n];
+        if (Differs[chunk.Block].load(std::memory_order_relaxed))
+            return;
+        TraceScope compare("CompareChunk", chunk.Size);
+        const char *Cipher = OldContent + OldOffsets[chunk.Block] + chunk.From;
+        const void *IV     = chunk.From ? (const void *)(Cipher - 8) : ks->GetContentIV().data();
+        std::string Plain(chunk.Size, '\0');
+        TdesCbcCfb64Decrypt(&Plain[0], Cipher, chunk.Size, Kc.data(), KeyCount, IV);
+        if (memcmp(Plain.data(), Padded.data() + NewOffsets[chunk.Block] + chunk.From, chunk.Size) != 0)
+            Differs[chunk.Block].store(true, std::memory_order_relaxed);
+    });
+
+    Content.assign(Padded.data(), Padded.size());
+    std::vector<int> Work;
+    for (int i = 0; i < bitTable.BlockCount; i++) {
+        if (Differs[i].load())
+            Changed[i] = 1;
+        if (Changed[i]) {
+            Work.push_back(i);
+        } else {
+            // same plaintext, so the same ciphertext and the signature the bit table already holds
+            if (bitTable.Blocks[i].Flags & BIT_BLOCK_ENCRYPTED)
+                memcpy(&Content.data()[NewOffsets[i]], OldContent + OldOffsets[i], bitTable.Blocks[i].Size);
+            Reused++;
+        }
+    }
+
+    // only the changed blocks are signed and encrypted again, each on its own cpu
+    RunParallel(Work.size(), [&](size_t n) {
+        BitTable::BitBlock &block = bitTable.Blocks[Work[n]];
+        uint8_t *p                = (uint8_t *)&Content.data()[NewOffsets[Work[n]]];
+        TraceScope encrypt("EncryptBlock", block.Size);
+        if (block.Flags & BIT_BLOCK_SIGNED) {
+            Block8 Signature = GetBlockSignature(*ks, p, block.Size, block.Flags);
+            memcpy(block.Signature, Signature.data(), 8);
+        }
+        if (block.Flags & BIT_BLOCK_ENCRYPTED)
+            TdesCbcCfb64Encrypt(p, p, block.Size, Kc.data(), KeyCount, ks->GetContentIV().data());
+    });
+
+    Blocks = bitTable.BlockCount;
+    // Kbit and Kc are carried over, the header is built from the current flags like any other encrypt
+    return SaveKelfData(Data, headerid);
+}
 
-    return std::string((char *)Hsign, 8);
+Block8 Kelf::GetHeaderSignature(const KELFHeader &header, const void *IDList)
+{
+    TraceScope trace("HeaderSignature", sizeof(KELFHeader) + header.BitCount * sizeof(KELFConsoleID));
+    // the ID list continues the CBC chain of the header
+    uint8_t Hsign[8] = {0};
+    CbcMac<1>(&header, sizeof(KELFHeader), ks->GetSignatureMasterKey().data(), Hsign);
+    if (header.BitCount)
+        CbcMac<1>(IDList, header.BitCount * sizeof(KELFConsoleID), ks->GetSignatureMasterKey().data(), Hsign);
+
+    TdesCbc<1, DES_DECRYPT>(Hsign, Hsign, 8, ks->GetSignatureHashKey().data(), MG_IV_NULL);
+    TdesCbc<1, DES_ENCRYPT>(Hsign, Hsign, 8, ks->GetSignatureMasterKey().data(), MG_IV_NULL);
+
+    Block8 Signature;
+    memcpy(Signature.data(), Hsign, 8);
+    return Signature;
 }
 
-std::string Kelf::DeriveKeyEncryptionKey(KELFHeader &header)
+Block16 Kelf::DeriveKeyEncryptionKey(const KELFHeader &header)
 {
-    uint8_t *KelfHeader = (uint8_t *)&header;
+    TraceScope trace("DeriveKeyEncryptionKey");
+    const uint8_t *KelfHeader = (const uint8_t *)&header;
+
+    // only the first 16 header bytes take part in the derivation
+    std::array<uint8_t, 32 + 16> MemoKey;
+    memcpy(MemoKey.data(), ks->GetFingerprintDigest().data(), 32);
+    memcpy(MemoKey.data() + 32, KelfHeader, 16);
+    Block16 KEK;
+    if (KEKMemo.Find(MemoKey, KEK))
+        return KEK;
+
     uint8_t HeaderData[8];
     xor_bit(KelfHeader, &KelfHeader[8], HeaderData, 8);
 
-    uint8_t KEK[16];
-    xor_bit(ks.GetKbitIV().data(), HeaderData, KEK, 8);
-    xor_bit(ks.GetKcIV().data(), HeaderData, &KEK[8], 8);
+    xor_bit(ks->GetKbitIV().data(), HeaderData, KEK.data(), 8);
+    xor_bit(ks->GetKcIV().data(), HeaderData, &KEK[8], 8);
 
-    TdesCbcCfb64Encrypt(KEK, KEK, 8, ks.GetKbitMasterKey().data(), 2, MG_IV_NULL);
-    TdesCbcCfb64Encrypt(&KEK[8], &KEK[8], 8, ks.GetKcMasterKey().data(), 2, MG_IV_NULL);
+    TdesCbc<2, DES_ENCRYPT>(KEK.data(), KEK.data(), 8, ks->GetKbitMasterKey().data(), MG_IV_NULL);
+    TdesCbc<2, DES_ENCRYPT>(&KEK[8], &KEK[8], 8, ks->GetKcMasterKey().data(), MG_IV_NULL);
+
+    KEKMemo.Insert(MemoKey, KEK);
+    return KEK;
+}
 
-    return std::string((char *)KEK, 16);
+// KEK + Kbit + Kc, the key of the Kbit/Kc memo tables
+static std::array<uint8_t, 48> KeyWrapMemoKey(const Block16 &KEK, const Block16 &Kbit, const Block16 &Kc)
+{
+    std::array<uint8_t, 48> MemoKey;
+    memcpy(MemoKey.data(), KEK.data(), 16);
+    memcpy(MemoKey.data() + 16, Kbit.data(), 16);
+    memcpy(MemoKey.data() + 32, Kc.data(), 16);
+    return MemoKey;
 }
 
-void Kelf::DecryptKeys(const std::string &KEK)
+void Kelf::DecryptKeys(const Block16 &KEK)
 {
-    TdesCbcCfb64Decrypt((uint8_t *)Kbit.data(), (uint8_t *)Kbit.data(), 8, (uint8_t *)KEK.data(), 2, MG_IV_NULL);
-    TdesCbcCfb64Decrypt((uint8_t *)Kbit.data() + 8, (uint8_t *)Kbit.data() + 8, 8, (uint8_t *)KEK.data(), 2, MG_IV_NULL);
+    TraceScope trace("DecryptKeys");
+    std::array<uint8_t, 48> MemoKey = KeyWrapMemoKey(KEK, Kbit, Kc);
+    Block32 Memo;
+    if (UnwrappedMemo.Find(MemoKey, Memo)) {
+        memcpy(Kbit.data(), Memo.data(), 16);
+        memcpy(Kc.data(), Memo.data() + 16, 16);
+        return;
+    }
+
+    TdesCbc<2, DES_DECRYPT>(Kbit.data(), Kbit.data(), 8, KEK.data(), MG_IV_NULL);
+    TdesCbc<2, DES_DECRYPT>(Kbit.data() + 8, Kbit.data() + 8, 8, KEK.data(), MG_IV_NULL);
+
+    TdesCbc<2, DES_DECRYPT>(Kc.data(), Kc.data(), 8, KEK.data(), MG_IV_NULL);
+    TdesCbc<2, DES_DECRYPT>(Kc.data() + 8, Kc.data() + 8, 8, KEK.data(), MG_IV_NULL);
 
-    TdesCbcCfb64Decrypt((uint8_t *)Kc.data(), (uint8_t *)Kc.data(), 8, (uint8_t *)KEK.data(), 2, MG_IV_NULL);
-    TdesCbcCfb64Decrypt((uint8_t *)Kc.data() + 8, (uint8_t *)Kc.data() + 8, 8, (uint8_t *)KEK.data(), 2, MG_IV_NULL);
+    memcpy(Memo.data(), Kbit.data(), 16);
+    memcpy(Memo.data() + 16, Kc.data(), 16);
+    UnwrappedMemo.Insert(MemoKey, Memo);
 }
 
-void Kelf::EncryptKeys(const std::string &KEK)
+void Kelf::EncryptKeys(const Block16 &KEK)
 {
-    TdesCbcCfb64Encrypt((uint8_t *)Kbit.data(), (uint8_t *)Kbit.data(), 8, (uint8_t *)KEK.data(), 2, MG_IV_NULL);
-    TdesCbcCfb64Encrypt((uint8_t *)Kbit.data() + 8, (uint8_t *)Kbit.data() + 8, 8, (uint8_t *)KEK.data(), 2, MG_IV_NULL);
+    TraceScope trace("EncryptKeys");
+    std::array<uint8_t, 48> MemoKey = KeyWrapMemoKey(KEK, Kbit, Kc);
+    Block32 Memo;
+    if (WrappedMemo.Find(MemoKey, Memo)) {
+        memcpy(Kbit.data(), Memo.data(), 16);
+        memcpy(Kc.data(), Memo.data() + 16, 16);
+        return;
+    }
+
+    TdesCbc<2, DES_ENCRYPT>(Kbit.data(), Kbit.data(), 8, KEK.data(), MG_IV_NULL);
+    TdesCbc<2, DES_ENCRYPT>(Kbit.data() + 8, Kbit.data() + 8, 8, KEK.data(), MG_IV_NULL);
 
-    TdesCbcCfb64Encrypt((uint8_t *)Kc.data(), (uint8_t *)Kc.data(), 8, (uint8_t *)KEK.data(), 2, MG_IV_NULL);
-    TdesCbcCfb64Encrypt((uint8_t *)Kc.data() + 8, (uint8_t *)Kc.data() + 8, 8, (uint8_t *)KEK.data(), 2, MG_IV_NULL);
+    TdesCbc<2, DES_ENCRYPT>(Kc.data(), Kc.data(), 8, KEK.data(), MG_IV_NULL);
+    TdesCbc<2, DES_ENCRYPT>(Kc.data() + 8, Kc.data() + 8, 8, KEK.data(), MG_IV_NULL);
+
+    memcpy(Memo.data(), Kbit.data(), 16);
+    memcpy(Memo.data() + 16, Kc.data(), 16);
+    WrappedMemo.Insert(MemoKey, Memo);
 }
 
-std::string Kelf::GetBitTableSignature()
+Block8 Kelf::GetBitTableSignature()
 {
+    TraceScope trace("BitTableSignature");
     uint8_t hash[8];
     memcpy(hash, &Kbit[0], 8);
     if (memcmp(&Kbit[0], &Kbit[8], 8) != 0)
@@ -674,97 +1341,77 @@ std::string Kelf::GetBitTableSignature()
         xor_bit(&((uint8_t *)&bitTable)[i * 8], hash, hash, 8);
 
     uint8_t MG_SIG_MASTER_AND_HASH_KEY[16];
-    memcpy(MG_SIG_MASTER_AND_HASH_KEY, ks.GetSignatureMasterKey().data(), 8);
-    memcpy(MG_SIG_MASTER_AND_HASH_KEY + 8, ks.GetSignatureHashKey().data(), 8);
+    memcpy(MG_SIG_MASTER_AND_HASH_KEY, ks->GetSignatureMasterKey().data(), 8);
+    memcpy(MG_SIG_MASTER_AND_HASH_KEY + 8, ks->GetSignatureHashKey().data(), 8);
 
-    uint8_t signature[8];
-    TdesCbcCfb64Encrypt(signature, hash, 8, MG_SIG_MASTER_AND_HASH_KEY, 2, MG_IV_NULL);
+    Block8 signature;
+    TdesCbc<2, DES_ENCRYPT>(signature.data(), hash, 8, MG_SIG_MASTER_AND_HASH_KEY, MG_IV_NULL);
 
-    return std::string((char *)signature, 8);
+    return signature;
 }
 
-std::string Kelf::GetRootSignature(const std::string &HeaderSignature, const std::string &BitTableSignature)
+Block8 Kelf::GetRootSignature(const Block8 &HeaderSignature, const Block8 &BitTableSignature)
 {
-    std::string Signatures;
-    Signatures += HeaderSignature;
-    Signatures += BitTableSignature;
+    TraceScope trace("RootSignature");
+    // header and bit table signature, then the signature of every signed block
+    uint8_t Signatures[(2 + 256) * 8];
+    size_t Length = 0;
+    memcpy(&Signatures[Length], HeaderSignature.data(), 8);
+    Length += 8;
+    memcpy(&Signatures[Length], BitTableSignature.data(), 8);
+    Length += 8;
 
-    for (int i = 0; i < bitTable.BlockCount; i++)
-        if (bitTable.Blocks[i].Flags & BIT_BLOCK_SIGNED)
-            Signatures += std::string((char *)bitTable.Blocks[i].Signature, 8);
+    for (int i = 0; i < bitTable.BlockCount; i++) {
+        if (bitTable.Blocks[i].Flags & BIT_BLOCK_SIGNED) {
+            memcpy(&Signatures[Length], bitTable.Blocks[i].Signature, 8);
+            Length += 8;
+        }
+    }
 
-    TdesCbcCfb64Encrypt((uint8_t *)Signatures.data(), (uint8_t *)Signatures.data(), Signatures.size(), ks.GetRootSignatureMasterKey().data(), 1, MG_IV_NULL);
-    std::string Root;
-    Root.resize(8);
-    TdesCbcCfb64Decrypt((uint8_t *)Root.data(), (uint8_t *)Signatures.substr(Signatures.size() - 8).data(), 8, ks.GetRootSignatureHashKey().data(), 2, MG_IV_NULL);
+    uint8_t Mac[8] = {0};
+    CbcMac<1>(Signatures, Length, ks->GetRootSignatureMasterKey().data(), Mac);
+    Block8 Root;
+    TdesCbc<2, DES_DECRYPT>(Root.data(), Mac, 8, ks->GetRootSignatureHashKey().data(), MG_IV_NULL);
 
     return Root;
 }
 
 void Kelf::DecryptContent(int keycount)
 {
+    TraceScope trace("DecryptContent", Content.size());
     uint32_t offset = 0;
     for (int i = 0; i < bitTable.BlockCount; i++) {
-        if (bitTable.Blocks[i].Flags & BIT_BLOCK_ENCRYPTED)
-            TdesCbcCfb64Decrypt(&Content.data()[offset], &Content.data()[offset], bitTable.Blocks[i].Size, Kc.data(), keycount, ks.GetContentIV().data());
+        if (bitTable.Blocks[i].Flags & BIT_BLOCK_ENCRYPTED) {
+            TraceScope block("DecryptBlock", bitTable.Blocks[i].Size);
+            TdesCbcCfb64Decrypt(&Content.data()[offset], &Content.data()[offset], bitTable.Blocks[i].Size, Kc.data(), keycount, ks->GetContentIV().data());
+        }
         offset += bitTable.Blocks[i].Size;
     }
 }
 
 int Kelf::VerifyContentSignature()
 {
+    TraceScope trace("VerifyContentSignature", Content.size());
     uint32_t offset = 0;
     for (unsigned int i = 0; i < bitTable.BlockCount; i++) {
         if (bitTable.Blocks[i].Flags & BIT_BLOCK_SIGNED) {
-            uint8_t signature[8];
-            memset(signature, 0, 8);
-
-            if (bitTable.Blocks[i].Flags & BIT_BLOCK_ENCRYPTED) {
-                for (unsigned int j = 0; j < bitTable.Blocks[i].Size; j += 8)
-                    xor_bit(&Content.data()[offset + j], signature, signature, 8);
-
-                uint8_t MG_SIG_MASTER_AND_HASH_KEY[16];
-                memcpy(MG_SIG_MASTER_AND_HASH_KEY, ks.GetSignatureMasterKey().data(), 8);
-                memcpy(MG_SIG_MASTER_AND_HASH_KEY + 8, ks.GetSignatureHashKey().data(), 8);
-
-                TdesCbcCfb64Encrypt(signature, signature, 8, MG_SIG_MASTER_AND_HASH_KEY, 2, MG_IV_NULL);
-            } else {
-                std::string SigMasterEnc;
-                SigMasterEnc.resize(bitTable.Blocks[i].Size);
-                TdesCbcCfb64Encrypt(SigMasterEnc.data(), &Content.data()[offset], bitTable.Blocks[i].Size, ks.GetSignatureMasterKey().data(), 1, MG_IV_NULL);
-                // printf("SigMasterEnc.data() = ");
-                // for (unsigned int j = 0; j < 8; ++j)
-                //     printf(" %02X", (unsigned char)SigMasterEnc.data()[j]);
-                // printf("\n");
-
-                memcpy(signature, &SigMasterEnc.data()[bitTable.Blocks[i].Size - 8], 8);
-                // printf("signature = ");
-                // for (unsigned int j = 0; j < 8; ++j)
-                //     printf(" %02X", (unsigned char)signature[j]);
-                // printf("\n");
-
-                TdesCbcCfb64Decrypt(signature, signature, 8, ks.GetSignatureHashKey().data(), 1, MG_IV_NULL);
-                // printf("signature = ");
-                // for (unsigned int j = 0; j < 8; ++j)
-                //     printf(" %02X", (unsigned char)signature[j]);
-                // printf("\n");
-
-                TdesCbcCfb64Encrypt(signature, signature, 8, ks.GetSignatureMasterKey().data(), 1, MG_IV_NULL);
-            }
-            printf("signature = ");
+            TraceScope block("VerifyBlock", bitTable.Blocks[i].Size);
+            Block8 Signature = GetBlockSignature(*ks, (const uint8_t *)&Content.data()[offset], bitTable.Blocks[i].Size, bitTable.Blocks[i].Flags);
+            const uint8_t *signature = Signature.data();
+            Log("signature = ");
             for (unsigned int j = 0; j < 8; ++j)
-                printf(" %02X", (unsigned char)signature[j]);
-            printf("\n");
+                Log(" %02X", (unsigned char)signature[j]);
+            Log("\n");
 
             if (memcmp(bitTable.Blocks[i].Signature, signature, 8) != 0) {
-                printf("bitTable.Blocks[%u].Signature = ", i);
+                Log("bitTable.Blocks[%u].Signature = ", i);
                 for (unsigned int j = 0; j < 8; ++j)
-                    printf(" %02X", (unsigned char)bitTable.Blocks[i].Signature[j]);
-                printf("\n");
-                printf("Signature calculated         = ");
+                    Log(" %02X", (unsigned char)bitTable.Blocks[i].Signature[j]);
+                Log("\n");
+                Log("Signature calculated         = ");
                 for (unsigned int j = 0; j < 8; ++j)
-                    printf(" %02X", (unsigned char)signature[j]);
-                printf("\n");
+                    Log(" %02X", (unsigned char)signature[j]);
+                Log("\n");
                 return KELF_ERROR_INVALID_CONTENT_SIGNATURE;
             }
         }
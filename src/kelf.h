@@ -17,6 +17,12 @@
 #ifndef __KELF_H__
 #define __KELF_H__
 
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "buffer.h"
 #include "keystore.h"
 
 #define KELF_ERROR_INVALID_DES_KEY_COUNT       -1
@@ -26,6 +32,7 @@
 #define KELF_ERROR_INVALID_ROOT_SIGNATURE      -5
 #define KELF_ERROR_INVALID_CONTENT_SIGNATURE   -6
 #define KELF_ERROR_UNSUPPORTED_FILE            -6
+#define KELF_ERROR_TRUNCATED_FILE              -7
 
 #define SYSTEM_TYPE_PS2 0 // same for COH (arcade)
 #define SYSTEM_TYPE_PSX 1
@@ -46,6 +53,9 @@ static uint8_t USER_HEADER_DNASLOAD[16] = {0x01, 0x00, 0x00, 0x04, 0x00, 0x06, 0
 
 static uint8_t USER_HEADER_NAMCO_SECURITY_DONGLE_BOOTFILE[16] = {0x01, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00};
 
+// maps a KELFHeader.UserDefined to the HEADER it was built from
+int GetHeaderId(const uint8_t *UserDefined);
+
 static uint8_t USER_Kbit_MBR[16]  = {0x6f, 0x6f, 0x40, 0x07, 0x59, 0x23, 0x2a, 0x48, 0x03, 0x45, 0xf6, 0xee, 0x9f, 0x24, 0xfe, 0xf1};
 static uint8_t USER_Kbit_FHDB[16] = {0xcc, 0x3a, 0x5a, 0x4e, 0x5c, 0x7f, 0x7c, 0x23, 0xb7, 0x5e, 0x9b, 0xf6, 0xa0, 0x44, 0x4e, 0x05};
 static uint8_t USER_Kbit_FMCB[16] = {0x24, 0x25, 0x1D, 0x05, 0xd1, 0x5e, 0x2d, 0x7d, 0x94, 0x3f, 0x4a, 0x30, 0x3f, 0x28, 0x24, 0xdb};
@@ -62,11 +72,15 @@ struct KELFHeader
     uint16_t BitCount;
     uint8_t MGZones;
     uint8_t gap[3]; // always zero
-    // struct IDList
-    // {
-    //     uint64_t iLinkID;
-    //     uint64_t consoleID;
-    // } Blocks[16];
+    // followed by BitCount KELFConsoleID entries whenever BitCount is non-zero,
+    // HDR_FLAG0_BLACKLIST or HDR_FLAG1_WHITELIST only tell how the console uses them
+};
+
+// one entry of the ID list, the list is part of the header and covered by HeaderSignature
+struct KELFConsoleID
+{
+    uint8_t iLinkID[8];
+    uint8_t ConsoleID[8];
 };
 
 // possible BitBlock.Flags. Other bit flags should be unset
@@ -128,32 +142,131 @@ struct BitTable
 
 class Kelf
 {
-    KeyStore ks;
-    std::string Kbit;
-    std::string Kc;
+    friend class KelfTemplate;
+
+    std::shared_ptr<const KeyStore> ks;
+    KELFHeader Header;
+    std::vector<KELFConsoleID> IDList;
+    Block16 Kbit;
+    Block16 Kc;
     BitTable bitTable;
-    std::string Content;
+    AlignedBuffer Content;
 
 public:
-    explicit Kelf(KeyStore &_ks)
-        : ks(_ks)
+    explicit Kelf(std::shared_ptr<const KeyStore> _ks)
+        : ks(std::move(_ks))
+        , Header()
+        , Kbit()
+        , Kc()
         , bitTable()
     {
     }
 
+    // forgets the current file but keeps the buffers, so the next file reuses their memory
+    void Reset();
+
     int LoadKelf(const std::string &filename);
     int SaveKelf(const std::string &filename, int header);
     int LoadContent(const std::string &filename, int header);
     int SaveContent(const std::string &filename);
 
-    std::string GetHeaderSignature(KELFHeader &header);
-    std::string DeriveKeyEncryptionKey(KELFHeader &header);
-    void DecryptKeys(const std::string &KEK);
-    void EncryptKeys(const std::string &KEK);
-    std::string GetBitTableSignature();
-    std::string GetRootSignature(const std::string &HeaderSignature, const std::string &BitTableSignature);
+    // in-memory variants of the above, Data holds the whole file
+    int LoadKelfData(const std::string &Data);
+    int SaveKelfData(std::string &Data, int header);
+    int LoadContentData(const std::string &Data, int header);
+    // LoadContentData split in two, so one padded input can be shared by several targets
+    static std::string PadContent(const std::string &Data);
+    int LoadPaddedContent(const std::string &Padded, int header);
+    const AlignedBuffer &GetContent() const { return Content; }
+
+    // moves a KELF in Data from the current keystore to To in one pass over the content, keeping
+    // its block layout and header fields. headerid replaces the header type unless HEADER::INVALID.
+    // Data is replaced with the result and the object is left on To.
+    int RekeyData(std::string &Data, std::shared_ptr<const KeyStore> To, int headerid);
+
+    // encrypts Padded with the block layout and keys of the KELF in Previous (same keystore), copying
+    // the ciphertext and signature of every block whose plaintext did not change; Reused of Blocks were kept.
+    // A size difference goes to the last unencrypted block it keeps aligned; without one the content
+    // is encrypted from scratch in the LoadPaddedContent layout and nothing is reused
+    int ReuseData(const std::string &Previous, const std::string &Padded, std::string &Data, int header, int &Reused, int &Blocks);
+
+    // reads only the KELF embedded at offset inside a larger image, length 0 = take it from the header
+    int LoadKelf(const std::string &filename, uint64_t offset, uint64_t length, bool HeaderOnly = false);
+    // parses and verifies everything up to the content, Data must hold at least HeaderSize bytes
+    int LoadKelfHeader(const std::string &Data);
+    // decrypts and verifies the content that starts at Offset in Data
+    int LoadKelfContent(const std::string &Data, size_t Offset);
+    // decrypts a single content block, after LoadKelfHeader on the same Data; the signature is not checked
+    int LoadContentBlock(const std::string &Data, int Block, std::string &Plain);
+    // random access to the plaintext of the KELF at offset in filename, after a header only LoadKelf;
+    // reads and decrypts only the 8 byte CBC units covering [Offset, Offset + Length), plus the unit
+    // before the first one as its IV. Plain is shorter if the content ends first, signatures are not checked
+    int ReadPlaintext(const std::string &filename, uint64_t offset, uint64_t Offset, uint64_t Length, std::string &Plain);
+    const KELFHeader &GetHeader() const { return Header; }
+    const std::vector<KELFConsoleID> &GetIDList() const { return IDList; }
+    const BitTable &GetBitTable() const { return bitTable; }
+    const Block16 &GetKbit() const { return Kbit; }
+    const Block16 &GetKc() const { return Kc; }
+    uint64_t GetContentSize() const;
+
+    // IDList points to header.BitCount entries, NULL only if there are none
+    Block8 GetHeaderSignature(const KELFHeader &header, const void *IDList = NULL);
+    Block16 DeriveKeyEncryptionKey(const KELFHeader &header);
+    void DecryptKeys(const Block16 &KEK);
+    void EncryptKeys(const Block16 &KEK);
+    Block8 GetBitTableSignature();
+    Block8 GetRootSignature(const Block8 &HeaderSignature, const Block8 &BitTableSignature);
     void DecryptContent(int keycount);
+    void SerializeKelf(const KELFHeader &header, std::string &Data);
     int VerifyContentSignature();
 };
 
+// The input independent part of a KELF in the LoadPaddedContent layout, for one keyset, header id and
+// the global header fields. Its only encrypted and signed block is the 16 zero bytes PadContent appends,
+// so the wrapped keys and that block's ciphertext and signature are the same for every input; Build only
+// patches ContentSize, the size of block 0 and the signatures covering them around the plaintext
+class KelfTemplate
+{
+    std::shared_ptr<const KeyStore> ks;
+    KELFHeader Header;
+    std::vector<KELFConsoleID> IDList;
+    Block16 Kbit; // plain, for the bit table
+    Block16 Kc;
+    Block16 WrappedKbit;
+    Block16 WrappedKc;
+    BitTable bitTable; // plain, Blocks[0].Size is set per input
+    uint8_t Tail[16];  // ciphertext of the last block
+
+    int Init(std::shared_ptr<const KeyStore> _ks, int headerid);
+
+public:
+    // Padded as returned by Kelf::PadContent, Data receives the same bytes LoadPaddedContent and
+    // SaveKelfData would produce; safe to call from several threads
+    int Build(const std::string &Padded, std::string &Data) const;
+
+    // built on first use and kept for the rest of the run, keyed by keystore, header id and the
+    // global header fields
+    static std::shared_ptr<const KelfTemplate> Get(std::shared_ptr<const KeyStore> ks, int headerid);
+};
+
+// Hands out reset Kelf objects and takes them back when the handle goes away,
+// so workers processing file after file keep reusing the same buffers
+class KelfPool
+{
+    std::shared_ptr<const KeyStore> ks;
+    std::mutex Mutex;
+    std::vector<std::unique_ptr<Kelf>> Free;
+
+public:
+    typedef std::unique_ptr<Kelf, std::function<void(Kelf *)>> Handle;
+
+    explicit KelfPool(std::shared_ptr<const KeyStore> _ks)
+        : ks(std::move(_ks))
+    {
+    }
+
+    // the pool must outlive every handle
+    Handle Acquire();
+};
+
 #endif
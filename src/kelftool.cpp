@@ -16,174 +16,1804 @@
  */
 #include <stdio.h>
 #include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
 #include <limits>
+#include <set>
+#include <thread>
 
 #include "keystore.h"
 #include "kelf.h"
+#include "manifest.h"
+#include "apa.h"
+#include "batch.h"
+#include "cache.h"
+#include "catalog.h"
+#include "digest.h"
+#include "engine.h"
+#include "fileio.h"
+#include "idlist.h"
+#include "memcard.h"
+#include "report.h"
+#include "scan.h"
+#include "trace.h"
+#include "watch.h"
 
 uint8_t GSystemtype      = SYSTEM_TYPE_PS2;
 uint8_t GMGZones         = REGION_ALL_ALLOWED;
 uint16_t GFlags          = HDR_PREDEF_KELF;
 uint8_t GApplicationType = KELFTYPE_XOSDMAIN;
+FILE *GLog               = stdout;
+
+std::vector<KELFConsoleID> GIDList;
+
+std::string GCacheDir = getenv("KELFTOOL_CACHE_DIR") ? getenv("KELFTOOL_CACHE_DIR") : "";
+uint64_t GCacheSize   = CACHE_DEFAULT_SIZE;
+
+Manifest GManifest;
+std::string GManifestFile;
+bool GManifestInputs = false;
 
 // TODO: implement load/save kelf header configuration for byte-perfect encryption, decryption
 
-std::string getKeyStorePath()
+std::string getKeyStorePath()
+{
+#if defined(__linux__) || defined(__APPLE__)
+    return std::string(getenv("HOME")) + "/PS2KEYS.dat";
+#else
+    return std::string(getenv("USERPROFILE")) + "\\PS2KEYS.dat";
+#endif
+}
+
+int loadKeyStore(KeyStore &ks, const std::string &KeyStoreEntry)
+{
+    int ret = ks.Load("./PS2KEYS.dat", KeyStoreEntry);
+    if (ret != 0) {
+        // try to load keys from working directory
+        ret = ks.Load(getKeyStorePath(), KeyStoreEntry);
+        if (ret != 0) {
+            printf("Failed to load keystore: %d - %s\n", ret, KeyStore::getErrorString(ret).c_str());
+            return ret;
+        }
+    }
+    return 0;
+}
+
+int getHeaderId(const char *name)
+{
+    if (strcmp("fmcb", name) == 0)
+        return HEADER::FMCB;
+
+    if (strcmp("fhdb", name) == 0)
+        return HEADER::FHDB;
+
+    if (strcmp("mbr", name) == 0)
+        return HEADER::MBR;
+
+    if (strcmp("dnasload", name) == 0)
+        return HEADER::DNASLOAD;
+
+    if (strcmp("dongle", name) == 0)
+        return HEADER::ARCADE_BOOTFILE;
+
+    return HEADER::INVALID;
+}
+
+// loads every keyset of the keystore, a "default" that only repeats another keyset is skipped
+int loadAllKeyStores(std::vector<std::pair<std::string, std::shared_ptr<const KeyStore>>> &KeySets)
+{
+    std::string path = "./PS2KEYS.dat";
+    std::vector<std::string> Sections;
+    if (KeyStore::ListSections(path, Sections) != 0) {
+        path    = getKeyStorePath();
+        int ret = KeyStore::ListSections(path, Sections);
+        if (ret != 0) {
+            printf("Failed to load keystore: %d - %s\n", ret, KeyStore::getErrorString(ret).c_str());
+            return ret;
+        }
+    }
+
+    KeySets.clear();
+    std::shared_ptr<KeyStore> Default;
+    for (const std::string &Section : Sections) {
+        auto ks = std::make_shared<KeyStore>();
+        if (ks->Load(path, Section) != 0)
+            continue;
+        if (Section == "default")
+            Default = ks;
+        else
+            KeySets.emplace_back(Section, ks);
+    }
+
+    if (Default) {
+        bool Repeated = false;
+        for (auto &KeySet : KeySets)
+            Repeated = Repeated || KeySet.second->GetFingerprint() == Default->GetFingerprint();
+        if (!Repeated)
+            KeySets.emplace_back("default", Default);
+    }
+    return 0;
+}
+
+// inverse of getHeaderId
+const char *getHeaderName(int headerid)
+{
+    switch (headerid) {
+        case HEADER::FMCB:
+            return "fmcb";
+        case HEADER::FHDB:
+            return "fhdb";
+        case HEADER::MBR:
+            return "mbr";
+        case HEADER::DNASLOAD:
+            return "dnasload";
+        case HEADER::ARCADE_BOOTFILE:
+            return "dongle";
+    }
+    return "unknown";
+}
+
+// handles the KELF header flags of encrypt, returns false for other args;
+// ret is set if a handled arg could not be applied
+bool parseHeaderArg(const char *arg, int &ret)
+{
+    if (!strncmp("--systemtype=", arg, strlen("--systemtype="))) {
+        const char *a = &arg[13];
+        long t;
+        if (!strcmp(a, "PS2")) {
+            GSystemtype = SYSTEM_TYPE_PS2;
+        } else if (!strcmp(a, "PSX")) {
+            GSystemtype = SYSTEM_TYPE_PSX;
+        } else if ((t = strtoul(a, NULL, 10)) <= std::numeric_limits<std::uint8_t>::max()) {
+            GSystemtype = (uint8_t)t;
+        }
+    } else if (!strncmp("--kflags=", arg, strlen("--kflags="))) {
+        const char *a = &arg[9];
+        unsigned long t;
+        if (!strcmp(a, "KELF")) {
+            GFlags = HDR_PREDEF_KELF;
+        } else if (!strcmp(a, "KIRX")) {
+            GFlags = HDR_PREDEF_KIRX;
+        } else if ((t = strtoul(a, NULL, 16)) <= std::numeric_limits<std::uint16_t>::max()) {
+            GFlags = (uint16_t)t;
+            if ((GFlags & HDR_FLAG4_1DES) && (GFlags & HDR_FLAG4_3DES)) {
+                printf("WARNING: 0x%x specifies both Single and Triple DES. only one should be defined\n", GFlags);
+            }
+        }
+    } else if (!strncmp("--mgzone=", arg, strlen("--mgzone="))) {
+        const char *a = &arg[9];
+        long t;
+        if ((t = strtoul(a, NULL, 16)) < std::numeric_limits<std::uint8_t>::max()) {
+            GMGZones = (uint8_t)t;
+        }
+    } else if (!strncmp("--apptype=", arg, strlen("--apptype="))) {
+        const char *a = &arg[10];
+        long t;
+        if ((t = strtoul(a, NULL, 16)) <= std::numeric_limits<std::uint8_t>::max()) {
+            GApplicationType = (uint8_t)t;
+        }
+    } else if (!strncmp("--blacklist=", arg, strlen("--blacklist=")) || !strncmp("--whitelist=", arg, strlen("--whitelist="))) {
+        const char *a = strchr(arg, '=') + 1;
+        int err       = LoadIDList(a, GIDList);
+        if (err != 0) {
+            printf("Failed to load ID list %s: %d\n", a, err);
+            ret = err;
+            return true;
+        }
+        GFlags &= ~(HDR_FLAG0_BLACKLIST | HDR_FLAG1_WHITELIST);
+        GFlags |= arg[2] == 'b' ? HDR_FLAG0_BLACKLIST : HDR_FLAG1_WHITELIST;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// handles --cache-dir, --cache-size and --no-cache, returns false for other args
+bool parseCacheArg(const char *arg)
+{
+    if (!strncmp("--cache-dir=", arg, strlen("--cache-dir="))) {
+        GCacheDir = &arg[12];
+    } else if (!strncmp("--cache-size=", arg, strlen("--cache-size="))) {
+        GCacheSize = strtoull(&arg[13], NULL, 10) * 1024 * 1024;
+    } else if (!strcmp("--no-cache", arg)) {
+        GCacheDir.clear();
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// handles --manifest and --manifest-inputs, returns false for other args
+bool parseManifestArg(const char *arg)
+{
+    if (!strncmp("--manifest=", arg, strlen("--manifest="))) {
+        GManifestFile = &arg[11];
+    } else if (!strcmp("--manifest-inputs", arg)) {
+        GManifestInputs = true;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// input column of the manifest, only hashed when asked for
+std::string getManifestInputDigest(const std::string &Input)
+{
+    if (GManifestFile.empty() || !GManifestInputs)
+        return "";
+    Sha256 sha;
+    sha.Update(Input);
+    return sha.FinalHex();
+}
+
+// the output of encrypt/decrypt is fully determined by the input, the keys and the header parameters
+std::string getCacheKey(const char *op, const std::string &input, const std::string &KeyStoreEntry, const KeyStore &ks, int headerid)
+{
+    Sha256 sha;
+    sha.Update(std::string("kelftool-cache-v2:") + op + ":" + KeyStoreEntry + ":" + ks.GetFingerprint() + ":");
+    int32_t params[] = {headerid, GSystemtype, GMGZones, GFlags, GApplicationType};
+    sha.Update(params, sizeof(params));
+    sha.Update(GIDList.data(), GIDList.size() * sizeof(KELFConsoleID));
+    sha.Update(input);
+    return sha.FinalHex();
+}
+
+// copies a cached result to output, which may be "-". With Data the result also stays in memory
+bool fetchCachedResult(const std::string &CacheKey, const std::string &output, std::string *Data = NULL)
+{
+    ResultCache cache(GCacheDir, GCacheSize);
+    if (output != "-" && Data == NULL)
+        return cache.Fetch(CacheKey, output);
+
+    std::string Result;
+    if (Data == NULL)
+        Data = &Result;
+    return cache.FetchData(CacheKey, *Data) && WriteWholeFile(output, *Data) == 0;
+}
+
+// KELF embedded in a larger image, from --offset=/--length= or <input>@<offset>
+struct KelfRange
+{
+    bool Ranged     = false;
+    uint64_t Offset = 0;
+    uint64_t Length = 0;
+};
+
+// handles --offset and --length, returns false for other args
+bool parseRangeArg(const char *arg, KelfRange &range)
+{
+    if (!strncmp("--offset=", arg, strlen("--offset="))) {
+        range.Offset = strtoull(&arg[9], NULL, 0);
+    } else if (!strncmp("--length=", arg, strlen("--length="))) {
+        range.Length = strtoull(&arg[9], NULL, 0);
+    } else {
+        return false;
+    }
+    range.Ranged = true;
+    return true;
+}
+
+// strips a trailing @<offset> from path, but only if it parses as a number
+std::string parseRangeInput(const char *input, KelfRange &range)
+{
+    std::string path = input;
+    size_t at        = path.rfind('@');
+    if (at == std::string::npos || at + 1 == path.size())
+        return path;
+
+    char *end;
+    uint64_t offset = strtoull(&path[at + 1], &end, 0);
+    if (*end != '\0')
+        return path;
+
+    range.Ranged = true;
+    range.Offset = offset;
+    return path.substr(0, at);
+}
+
+// reads path inside the memory card image Card, only the clusters of the file and its directories
+int readCardFile(const std::string &Card, const std::string &path, std::string &Data)
+{
+    MemoryCard mc;
+    int ret = mc.Open(Card, false);
+    if (ret == 0)
+        ret = mc.ReadFile(path, Data);
+    if (ret != 0)
+        printf("Failed to read %s from memory card %s: %d\n", path.c_str(), Card.c_str(), ret);
+    return ret;
+}
+
+// creates or replaces path inside the memory card image Card, only the changed clusters are rewritten
+int writeCardFile(const std::string &Card, const std::string &path, const std::string &Data)
+{
+    MemoryCard mc;
+    int ret = mc.Open(Card, true);
+    if (ret == 0)
+        ret = mc.WriteFile(path, Data);
+    if (ret == 0)
+        ret = mc.Flush();
+    if (ret != 0)
+        printf("Failed to write %s to memory card %s: %d\n", path.c_str(), Card.c_str(), ret);
+    return ret;
+}
+
+int decrypt(int argc, char **argv)
+{
+    std::string KeyStoreEntry = "default";
+    std::string CardPath;
+    KelfRange Range;
+
+    if (argc < 3) {
+        printf("%s decrypt <input>[@offset] <output> [Flags]\n", argv[0]);
+        printf("<input>, <output>: - for stdin/stdout\n");
+        printf("\tFlags:\n");
+        printf("\t\t--keys        Specify keys to be used\n");
+        printf("\t\t--offset      Byte offset of the KELF inside <input> (pread, no extraction)\n");
+        printf("\t\t--length      Size of the KELF inside <input> (default: taken from its header)\n");
+        printf("\t\t--from-mc     Path of the KELF inside <input>, a PS2 memory card image, example: --from-mc=BOOT/BOOT.ELF\n");
+        printf("\t\t--cache-dir   Reuse results from a cache directory (or $KELFTOOL_CACHE_DIR)\n");
+        printf("\t\t--cache-size  Cache size limit in MiB (default 512)\n");
+        printf("\t\t--no-cache    Disable the result cache\n");
+        printf("\t\t--manifest    Write path, size, SHA-256, keyset and header id of the output to a file\n");
+        printf("\t\t--manifest-inputs  Also record the SHA-256 of the input\n");
+        return -1;
+    }
+
+    // keep the header dump and messages out of the data stream
+    if (!strcmp(argv[2], "-"))
+        ReserveStdoutForData();
+
+    for (int x = 3; x < argc; x++) {
+        if (!strncmp("--keys=", argv[x], strlen("--keys="))) {
+            KeyStoreEntry = &argv[x][7];
+        } else if (!strncmp("--from-mc=", argv[x], strlen("--from-mc="))) {
+            CardPath = &argv[x][10];
+        } else if (!parseRangeArg(argv[x], Range) && !parseManifestArg(argv[x])) {
+            parseCacheArg(argv[x]);
+        }
+    }
+    std::string InputPath = parseRangeInput(argv[1], Range);
+
+    auto ks = std::make_shared<KeyStore>();
+    int ret = loadKeyStore(*ks, KeyStoreEntry);
+    if (ret != 0)
+        return ret;
+
+    if (Range.Ranged) {
+        if (InputPath == "-" || !CardPath.empty()) {
+            printf("--offset/--length need a seekable input\n");
+            return -1;
+        }
+        Kelf kelf(ks);
+        ret = kelf.LoadKelf(InputPath, Range.Offset, Range.Length);
+        if (ret != 0) {
+            printf("Failed to LoadKelf %d!\n", ret);
+            return ret;
+        }
+        ret = kelf.SaveContent(argv[2]);
+        if (ret != 0)
+            printf("Failed to SaveContent!\n");
+        else if (!GManifestFile.empty())
+            GManifest.Add(argv[2], kelf.GetContent().data(), kelf.GetContent().size(), KeyStoreEntry, getHeaderName(GetHeaderId(kelf.GetHeader().UserDefined)));
+        return ret;
+    }
+
+    std::string Input;
+    if (!CardPath.empty()) {
+        ret = readCardFile(InputPath, CardPath, Input);
+        if (ret != 0)
+            return ret;
+    } else if (ReadWholeFile(InputPath, Input) != 0) {
+        printf("Failed to LoadKelf %d!\n", KELF_ERROR_UNSUPPORTED_FILE);
+        return KELF_ERROR_UNSUPPORTED_FILE;
+    }
+
+    // header type for the manifest, straight from the input so cached results have it too
+    const char *HeaderName = Input.size() >= sizeof(KELFHeader) ? getHeaderName(GetHeaderId((const uint8_t *)Input.data())) : "unknown";
+
+    std::string CacheKey;
+    if (!GCacheDir.empty()) {
+        CacheKey = getCacheKey("decrypt", Input, KeyStoreEntry, *ks, -1);
+        std::string Cached;
+        if (fetchCachedResult(CacheKey, argv[2], GManifestFile.empty() ? NULL : &Cached)) {
+            printf("Reused cached result %s\n", CacheKey.c_str());
+            if (!GManifestFile.empty())
+                GManifest.Add(argv[2], Cached.data(), Cached.size(), KeyStoreEntry, HeaderName, getManifestInputDigest(Input));
+            return 0;
+        }
+    }
+
+    Kelf kelf(ks);
+    ret = kelf.LoadKelfData(Input);
+    if (ret != 0) {
+        printf("Failed to LoadKelf %d!\n", ret);
+        return ret;
+    }
+    ret = kelf.SaveContent(argv[2]);
+    if (ret != 0) {
+        printf("Failed to SaveContent!\n");
+        return ret;
+    }
+    if (!GManifestFile.empty())
+        GManifest.Add(argv[2], kelf.GetContent().data(), kelf.GetContent().size(), KeyStoreEntry, HeaderName, getManifestInputDigest(Input));
+
+    if (!CacheKey.empty())
+        ResultCache(GCacheDir, GCacheSize).Store(CacheKey, kelf.GetContent().str());
+
+    return 0;
+}
+
+// verify: full signature check without output, info: header and bit table only
+int inspect(int argc, char **argv, bool HeaderOnly)
+{
+    std::string KeyStoreEntry = "default";
+    std::string CardPath;
+    KelfRange Range;
+
+    if (argc < 2) {
+        printf("%s %s <input>[@offset] [Flags]\n", argv[0], HeaderOnly ? "info" : "verify");
+        printf("\tFlags:\n");
+        printf("\t\t--keys        Specify keys to be used\n");
+        printf("\t\t--offset      Byte offset of the KELF inside <input> (pread, no extraction)\n");
+        printf("\t\t--length      Size of the KELF inside <input> (default: taken from its header)\n");
+        printf("\t\t--from-mc     Path of the KELF inside <input>, a PS2 memory card image\n");
+        return -1;
+    }
+
+    for (int x = 2; x < argc; x++) {
+        if (!strncmp("--keys=", argv[x], strlen("--keys="))) {
+            KeyStoreEntry = &argv[x][7];
+        } else if (!strncmp("--from-mc=", argv[x], strlen("--from-mc="))) {
+            CardPath = &argv[x][10];
+        } else {
+            parseRangeArg(argv[x], Range);
+        }
+    }
+    std::string InputPath = parseRangeInput(argv[1], Range);
+
+    auto ks = std::make_shared<KeyStore>();
+    int ret = loadKeyStore(*ks, KeyStoreEntry);
+    if (ret != 0)
+        return ret;
+
+    Kelf kelf(ks);
+    if (!CardPath.empty()) {
+        std::string Data;
+        ret = readCardFile(InputPath, CardPath, Data);
+        if (ret != 0)
+            return ret;
+        ret = HeaderOnly ? kelf.LoadKelfHeader(Data) : kelf.LoadKelfData(Data);
+    } else {
+        ret = kelf.LoadKelf(InputPath, Range.Offset, Range.Length, HeaderOnly);
+    }
+    if (ret != 0) {
+        printf("Failed to LoadKelf %d!\n", ret);
+        return ret;
+    }
+
+    printf("KELF size              = %#llX\n", (unsigned long long)(kelf.GetHeader().HeaderSize + kelf.GetContentSize()));
+    if (!HeaderOnly)
+        printf("All signatures verified\n");
+
+    return 0;
+}
+
+// moves a KELF to another keyset, optionally changing its header type
+int rekey(int argc, char **argv)
+{
+    std::string FromEntry = "default";
+    std::string ToEntry;
+    int headerid = HEADER::INVALID;
+
+    if (argc < 3) {
+        printf("%s rekey <input> <output> --to-keys=<keyset> [Flags]\n", argv[0]);
+        printf("moves a KELF to another keyset in one pass, the plaintext never leaves memory\n");
+        printf("<input>, <output>: - for stdin/stdout\n");
+        printf("\tFlags:\n");
+        printf("\t\t--from-keys   Keyset <input> is signed with (default: default)\n");
+        printf("\t\t--to-keys     Keyset to sign <output> with\n");
+        printf("\t\t--header      Also change the header type: fmcb, fhdb, mbr, dnasload, dongle\n");
+        return -1;
+    }
+
+    if (!strcmp(argv[2], "-"))
+        ReserveStdoutForData();
+
+    for (int x = 3; x < argc; x++) {
+        if (!strncmp("--from-keys=", argv[x], strlen("--from-keys="))) {
+            FromEntry = &argv[x][12];
+        } else if (!strncmp("--to-keys=", argv[x], strlen("--to-keys="))) {
+            ToEntry = &argv[x][10];
+        } else if (!strncmp("--header=", argv[x], strlen("--header="))) {
+            headerid = getHeaderId(&argv[x][9]);
+            if (headerid == HEADER::INVALID) {
+                printf("Invalid header: %s\n", &argv[x][9]);
+                return -1;
+            }
+        }
+    }
+    if (ToEntry.empty()) {
+        printf("rekey needs --to-keys\n");
+        return -1;
+    }
+
+    auto From = std::make_shared<KeyStore>();
+    int ret   = loadKeyStore(*From, FromEntry);
+    if (ret != 0)
+        return ret;
+    auto To = std::make_shared<KeyStore>();
+    ret     = loadKeyStore(*To, ToEntry);
+    if (ret != 0)
+        return ret;
+
+    std::string Data;
+    if (ReadWholeFile(argv[1], Data) != 0) {
+        printf("Failed to read %s\n", argv[1]);
+        return KELF_ERROR_UNSUPPORTED_FILE;
+    }
+
+    Kelf kelf(From);
+    ret = kelf.RekeyData(Data, To, headerid);
+    if (ret != 0) {
+        printf("Failed to rekey %d!\n", ret);
+        return ret;
+    }
+
+    if (WriteWholeFile(argv[2], Data) != 0) {
+        printf("Failed to write %s\n", argv[2]);
+        return KELF_ERROR_UNSUPPORTED_FILE;
+    }
+
+    printf("Rekeyed %s from %s to %s\n", argv[1], FromEntry.c_str(), ToEntry.c_str());
+    return 0;
+}
+
+#pragma pack(push, 1)
+struct Elf32Header
+{
+    uint8_t Ident[16];
+    uint16_t Type;
+    uint16_t Machine;
+    uint32_t Version;
+    uint32_t Entry;
+    uint32_t PhOff;
+    uint32_t ShOff;
+    uint32_t Flags;
+    uint16_t EhSize;
+    uint16_t PhEntSize;
+    uint16_t PhNum;
+    uint16_t ShEntSize;
+    uint16_t ShNum;
+    uint16_t ShStrNdx;
+};
+
+struct Elf32ProgramHeader
+{
+    uint32_t Type;
+    uint32_t Offset;
+    uint32_t VAddr;
+    uint32_t PAddr;
+    uint32_t FileSz;
+    uint32_t MemSz;
+    uint32_t Flags;
+    uint32_t Align;
+};
+#pragma pack(pop)
+
+const char *getSegmentTypeName(uint32_t Type)
+{
+    switch (Type) {
+        case 0:
+            return "NULL";
+        case 1:
+            return "LOAD";
+        case 2:
+            return "DYNAMIC";
+        case 3:
+            return "INTERP";
+        case 4:
+            return "NOTE";
+        case 6:
+            return "PHDR";
+        case 0x70000080:
+            return "IOPMOD";
+        case 0x70000090:
+            return "EEMOD";
+        default:
+            return "?";
+    }
+}
+
+// ELF header and segments of an encrypted KELF, decrypting only the units that hold them
+int elfinfo(int argc, char **argv)
+{
+    std::string KeyStoreEntry = "default";
+    KelfRange Range;
+
+    if (argc < 2) {
+        printf("%s elfinfo <input>[@offset] [Flags]\n", argv[0]);
+        printf("\tFlags:\n");
+        printf("\t\t--keys        Specify keys to be used\n");
+        printf("\t\t--offset      Byte offset of the KELF inside <input> (pread, no extraction)\n");
+        return -1;
+    }
+
+    for (int x = 2; x < argc; x++) {
+        if (!strncmp("--keys=", argv[x], strlen("--keys="))) {
+            KeyStoreEntry = &argv[x][7];
+        } else {
+            parseRangeArg(argv[x], Range);
+        }
+    }
+    std::string InputPath = parseRangeInput(argv[1], Range);
+
+    auto ks = std::make_shared<KeyStore>();
+    int ret = loadKeyStore(*ks, KeyStoreEntry);
+    if (ret != 0)
+        return ret;
+
+    // the header dump of LoadKelfHeader is what info is for
+    FILE *Log = GLog;
+    GLog      = NULL;
+    Kelf kelf(ks);
+    ret  = kelf.LoadKelf(InputPath, Range.Offset, 0, true);
+    GLog = Log;
+    if (ret != 0) {
+        printf("Failed to LoadKelf %d!\n", ret);
+        return ret;
+    }
+
+    std::string Data;
+    Elf32Header Elf;
+    ret = kelf.ReadPlaintext(InputPath, Range.Offset, 0, sizeof(Elf), Data);
+    if (ret != 0 || Data.size() < sizeof(Elf) || memcmp(Data.data(), "\x7F" "ELF", 4) != 0) {
+        printf("Content is not an ELF (headerless binary?)\n");
+        return ret ? ret : -1;
+    }
+    memcpy(&Elf, Data.data(), sizeof(Elf));
+    if (Elf.Ident[4] != 1 || Elf.Ident[5] != 1) {
+        printf("Only 32 bit little endian ELFs are supported\n");
+        return -1;
+    }
+    uint64_t Decrypted = Data.size();
+
+    printf("Type                   = %#x\n", Elf.Type);
+    printf("Machine                = %#x%s\n", Elf.Machine, Elf.Machine == 8 ? " (MIPS)" : "");
+    printf("Entry                  = 0x%08x\n", Elf.Entry);
+    printf("Flags                  = 0x%08x\n", Elf.Flags);
+    printf("Program headers        = %u at %#x\n", Elf.PhNum, Elf.PhOff);
+    printf("Section headers        = %u at %#x\n", Elf.ShNum, Elf.ShOff);
+
+    if (Elf.PhNum && Elf.PhEntSize >= sizeof(Elf32ProgramHeader)) {
+        ret = kelf.ReadPlaintext(InputPath, Range.Offset, Elf.PhOff, (uint64_t)Elf.PhNum * Elf.PhEntSize, Data);
+        if (ret != 0) {
+            printf("Failed to read the program headers %d!\n", ret);
+            return ret;
+        }
+        Decrypted += Data.size();
+
+        printf("  %-8s %-10s %-10s %-10s %-10s %-10s %-3s %s\n", "Type", "Offset", "VirtAddr", "PhysAddr", "FileSiz", "MemSiz", "Flg", "Align");
+        for (size_t i = 0; (i + 1) * Elf.PhEntSize <= Data.size(); i++) {
+            Elf32ProgramHeader Ph;
+            memcpy(&Ph, &Data[i * Elf.PhEntSize], sizeof(Ph));
+            printf("  %-8s 0x%08x 0x%08x 0x%08x 0x%08x 0x%08x %c%c%c %#x\n", getSegmentTypeName(Ph.Type), Ph.Offset, Ph.VAddr, Ph.PAddr, Ph.FileSz, Ph.MemSz,
+                   Ph.Flags & 4 ? 'R' : ' ', Ph.Flags & 2 ? 'W' : ' ', Ph.Flags & 1 ? 'E' : ' ', Ph.Align);
+        }
+    }
+    printf("Used %llu of %llu content bytes\n", (unsigned long long)Decrypted, (unsigned long long)kelf.GetContentSize());
+
+    return 0;
+}
+
+// splits a comma separated argument
+std::vector<std::string> splitArg(const std::string &arg)
+{
+    std::vector<std::string> items;
+    size_t pos = 0;
+    for (;;) {
+        size_t end = arg.find(',', pos);
+        items.push_back(arg.substr(pos, end - pos));
+        if (end == std::string::npos)
+            return items;
+        pos = end + 1;
+    }
+}
+
+// expands %h (header id) and %k (keyset) in an output pattern
+std::string getTargetOutput(const std::string &pattern, const char *header, const std::string &KeyStoreEntry)
+{
+    std::string output;
+    for (size_t i = 0; i < pattern.size(); i++) {
+        if (pattern[i] == '%' && i + 1 < pattern.size() && pattern[i + 1] == 'h') {
+            output += header;
+            i++;
+        } else if (pattern[i] == '%' && i + 1 < pattern.size() && pattern[i + 1] == 'k') {
+            output += KeyStoreEntry;
+            i++;
+        } else {
+            output += pattern[i];
+        }
+    }
+    return output;
+}
+
+struct EncryptTarget
+{
+    int headerid;
+    std::string KeyStoreEntry;
+    std::shared_ptr<const KeyStore> ks;
+    std::string Output;
+    int Result;
+    bool Cached;
+};
+
+// builds and writes one target from the shared padded input
+int encryptTarget(EncryptTarget &Target, const std::string &Input, const std::string &Padded, const std::string &InputDigest)
+{
+    std::string CacheKey;
+    if (!GCacheDir.empty()) {
+        CacheKey = getCacheKey("encrypt", Input, Target.KeyStoreEntry, *Target.ks, Target.headerid);
+        std::string Cached;
+        if (fetchCachedResult(CacheKey, Target.Output, GManifestFile.empty() ? NULL : &Cached)) {
+            Target.Cached = true;
+            if (!GManifestFile.empty())
+                GManifest.Add(Target.Output, Cached.data(), Cached.size(), Target.KeyStoreEntry, getHeaderName(Target.headerid), InputDigest);
+            return 0;
+        }
+    }
+
+    std::shared_ptr<const KelfTemplate> Template = KelfTemplate::Get(Target.ks, Target.headerid);
+    if (!Template) {
+        printf("Failed to LoadContent!\n");
+        return KELF_ERROR_UNSUPPORTED_FILE;
+    }
+
+    std::string Output;
+    int ret = Template->Build(Padded, Output);
+    if (ret == 0 && WriteWholeFile(Target.Output, Output) != 0)
+        ret = KELF_ERROR_UNSUPPORTED_FILE;
+    if (ret != 0) {
+        printf("Failed to SaveKelf!\n");
+        return ret;
+    }
+    if (!GManifestFile.empty())
+        GManifest.Add(Target.Output, Output.data(), Output.size(), Target.KeyStoreEntry, getHeaderName(Target.headerid), InputDigest);
+
+    if (!CacheKey.empty())
+        ResultCache(GCacheDir, GCacheSize).Store(CacheKey, Output);
+
+    return 0;
+}
+
+// signs the padded input for one target in memory, for outputs that are not plain files
+int buildTarget(const EncryptTarget &Target, const std::string &Padded, std::string &Output)
+{
+    std::shared_ptr<const KelfTemplate> Template = KelfTemplate::Get(Target.ks, Target.headerid);
+    int ret = Template ? Template->Build(Padded, Output) : KELF_ERROR_UNSUPPORTED_FILE;
+    if (ret != 0)
+        printf("Failed to SaveKelf!\n");
+    return ret;
+}
+
+// re-encrypts into the block layout of a previous KELF, only the blocks that changed cost any crypto
+int encryptReuse(const EncryptTarget &Target, const std::string &ReusePath, const std::string &Padded, const std::string &InputDigest)
+{
+    std::string Previous;
+    if (ReadWholeFile(ReusePath, Previous) != 0) {
+        printf("Failed to read %s\n", ReusePath.c_str());
+        return KELF_ERROR_UNSUPPORTED_FILE;
+    }
+
+    Kelf kelf(Target.ks);
+    std::string Output;
+    int Reused, Blocks;
+    int ret = kelf.ReuseData(Previous, Padded, Output, Target.headerid, Reused, Blocks);
+    if (ret != 0) {
+        printf("Failed to reuse %s: %d\n", ReusePath.c_str(), ret);
+        return ret;
+    }
+    if (WriteWholeFile(Target.Output, Output) != 0) {
+        printf("Failed to SaveKelf!\n");
+        return KELF_ERROR_UNSUPPORTED_FILE;
+    }
+    if (!GManifestFile.empty())
+        GManifest.Add(Target.Output, Output.data(), Output.size(), Target.KeyStoreEntry, getHeaderName(Target.headerid), InputDigest);
+
+    printf("Reused %d of %d blocks from %s\n", Reused, Blocks, ReusePath.c_str());
+    return 0;
+}
+
+int encrypt(int argc, char **argv)
+{
+    std::string KeyStoreEntry = "default";
+    std::string CardPath;
+    std::string HddImage;
+    std::string ReusePath;
+
+    // flags may also come before the positional arguments
+    std::vector<const char *> args;
+    for (int x = 1; x < argc; x++) {
+        if (!strncmp("--into-hdd=", argv[x], strlen("--into-hdd=")))
+            HddImage = &argv[x][11];
+        else if (strncmp("--", argv[x], 2))
+            args.push_back(argv[x]);
+    }
+    // the HDD image takes the place of <output>
+    if (!HddImage.empty() && args.size() == 2)
+        args.push_back(HddImage.c_str());
+
+    if (args.size() < 3) {
+        printf("%s encrypt <headerid> <input> <output> [Flags]\n", argv[0]);
+        printf("%s encrypt <headerid> <input> --into-mc=<path> <card> [<card>...] [Flags]\n", argv[0]);
+        printf("%s encrypt mbr <input> --into-hdd=<image> [Flags]\n", argv[0]);
+        printf("<headerid>: fmcb, fhdb, mbr, dnasload, dongle, or a comma separated list of them\n");
+        printf("<input>, <output>: - for stdin/stdout\n");
+        printf("<output>: %%h and %%k are replaced by header id and keyset, required when building several targets\n");
+        printf("\tFlags:\n");
+        printf("\t\t--keys        Specify keys to be used from PS2KEYS.dat (default, retail, dev, arcade, prototype), or a comma separated list\n");
+        printf("\t\t--mgzone      Specify custom region whitelist (default 0xFF: all allowed), example: --mgzone=0x03 (Japan+North America)\n");
+        printf("\t\t--apptype     Specify application type (default 1: XOSDMAIN), example --apptype=7\n");
+        printf("\t\t--kflags      Specify custom flags for KELF Header, default: --kflags=KELF\n");
+        printf("\t\t--systemtype  Specify sys type (PS2 or PSX)\n");
+        printf("\t\t--blacklist   Embed an ID list of consoles that must not boot the file, after --kflags\n");
+        printf("\t\t--whitelist   Embed an ID list of the only consoles that may boot the file, after --kflags\n");
+        printf("\t\t              ID list files hold one \"<iLinkID> <ConsoleID>\" pair of 16 hex digits per line\n");
+        printf("\t\t--cache-dir   Reuse results from a cache directory (or $KELFTOOL_CACHE_DIR)\n");
+        printf("\t\t--cache-size  Cache size limit in MiB (default 512)\n");
+        printf("\t\t--no-cache    Disable the result cache\n");
+        printf("\t\t--manifest    Write path, size, SHA-256, keyset and header id of every output to a file\n");
+        printf("\t\t--manifest-inputs  Also record the SHA-256 of the input\n");
+        printf("\t\t--into-mc     Write the KELF to this path inside PS2 memory card images instead, every <output> is a card\n");
+        printf("\t\t              image and only the clusters that change are rewritten, example: --into-mc=BOOT/BOOT.ELF\n");
+        printf("\t\t--into-hdd    Write the mbr KELF into the __mbr partition of an APA formatted PS2 HDD image,\n");
+        printf("\t\t              only the KELF sectors and the partition header are rewritten\n");
+        printf("\t\t--reuse       Keep the block layout and keys of a previous KELF of the same keyset and copy the\n");
+        printf("\t\t              ciphertext and signature of every block whose plaintext did not change\n");
+        printf("\texample: encrypt fmcb,fhdb,dongle --keys=retail,arcade boot.elf out/%%k/boot.%%h.kelf\n");
+        return -1;
+    }
+
+    // keep the header dump and messages out of the data stream
+    if (!strcmp(args[2], "-"))
+        ReserveStdoutForData();
+
+    int ArgError = 0;
+    for (int x = 1; x < argc; x++) {
+        if (!strncmp("--keys=", argv[x], strlen("--keys="))) {
+            printf("- Custom keyset %s\n", &argv[x][7]);
+            KeyStoreEntry = &argv[x][7];
+        } else if (!strncmp("--into-mc=", argv[x], strlen("--into-mc="))) {
+            CardPath = &argv[x][10];
+        } else if (!strncmp("--reuse=", argv[x], strlen("--reuse="))) {
+            ReusePath = &argv[x][8];
+        } else if (!parseHeaderArg(argv[x], ArgError) && !parseManifestArg(argv[x])) {
+            parseCacheArg(argv[x]);
+        }
+    }
+    if (ArgError != 0)
+        return ArgError;
+
+    std::vector<std::string> headers = splitArg(args[0]);
+    std::vector<std::string> entries = splitArg(KeyStoreEntry);
+    for (const std::string &header : headers) {
+        if (getHeaderId(header.c_str()) == HEADER::INVALID) {
+            printf("Invalid header: %s\n", header.c_str());
+            return -1;
+        }
+    }
+
+    std::vector<std::shared_ptr<const KeyStore>> KeyStores;
+    for (const std::string &entry : entries) {
+        auto ks = std::make_shared<KeyStore>();
+        int ret = loadKeyStore(*ks, entry);
+        if (ret != 0)
+            return ret;
+        KeyStores.push_back(ks);
+    }
+
+    std::vector<EncryptTarget> Targets;
+    std::set<std::string> Outputs;
+    for (size_t k = 0; k < entries.size(); k++) {
+        for (const std::string &header : headers) {
+            EncryptTarget Target = {getHeaderId(header.c_str()), entries[k], KeyStores[k], getTargetOutput(args[2], header.c_str(), entries[k]), 0, false};
+            if (!Outputs.insert(Target.Output).second) {
+                printf("Output %s would be written twice, use %%h and %%k in the output name\n", Target.Output.c_str());
+                return -1;
+            }
+            Targets.push_back(Target);
+        }
+    }
+
+    std::string Input;
+    if (ReadWholeFile(args[1], Input) != 0) {
+        printf("Failed to LoadContent!\n");
+        return KELF_ERROR_UNSUPPORTED_FILE;
+    }
+    // read and padded once, every target only copies it
+    const std::string Padded      = Kelf::PadContent(Input);
+    const std::string InputDigest = getManifestInputDigest(Input);
+
+    if (!ReusePath.empty()) {
+        if (Targets.size() != 1 || !CardPath.empty() || !HddImage.empty()) {
+            printf("--reuse takes a single header id and keyset and a plain <output>\n");
+            return -1;
+        }
+        return encryptReuse(Targets[0], ReusePath, Padded, InputDigest);
+    }
+
+    if (!HddImage.empty()) {
+        if (Targets.size() != 1 || Targets[0].headerid != HEADER::MBR) {
+            printf("--into-hdd takes the mbr header id and a single keyset\n");
+            return -1;
+        }
+        std::string Output;
+        int ret = buildTarget(Targets[0], Padded, Output);
+        if (ret != 0)
+            return ret;
+        ret = InjectMbrKelf(HddImage, Output);
+        if (ret != 0) {
+            printf("Failed to write the MBR KELF to %s: %d\n", HddImage.c_str(), ret);
+            return ret;
+        }
+        if (!GManifestFile.empty())
+            GManifest.Add(HddImage + ":__mbr", Output.data(), Output.size(), Targets[0].KeyStoreEntry, getHeaderName(Targets[0].headerid), InputDigest);
+        printf("Wrote the MBR KELF to %s\n", HddImage.c_str());
+        return 0;
+    }
+
+    if (!CardPath.empty()) {
+        if (Targets.size() != 1) {
+            printf("--into-mc takes a single header id and keyset\n");
+            return -1;
+        }
+        // signed once, then only written into every card
+        std::string Output;
+        int ret = buildTarget(Targets[0], Padded, Output);
+        if (ret != 0)
+            return ret;
+
+        int Failed = 0;
+        for (size_t i = 2; i < args.size(); i++) {
+            if (writeCardFile(args[i], CardPath, Output) != 0) {
+                Failed++;
+                continue;
+            }
+            if (!GManifestFile.empty())
+                GManifest.Add(std::string(args[i]) + ":" + CardPath, Output.data(), Output.size(), Targets[0].KeyStoreEntry, getHeaderName(Targets[0].headerid), InputDigest);
+        }
+        printf("Wrote %s to %d of %d memory card images\n", CardPath.c_str(), (int)(args.size() - 2 - Failed), (int)(args.size() - 2));
+        return Failed ? -1 : 0;
+    }
+
+    if (Targets.size() == 1) {
+        int ret = encryptTarget(Targets[0], Input, Padded, InputDigest);
+        if (ret == 0 && Targets[0].Cached)
+            printf("Reused cached result for %s\n", Targets[0].Output.c_str());
+        return ret;
+    }
+
+    // the header dumps of parallel targets would interleave
+    FILE *Log = GLog;
+    GLog      = NULL;
+    std::vector<std::thread> Pool;
+    for (EncryptTarget &Target : Targets) {
+        std::error_code ec;
+        std::filesystem::create_directories(std::filesystem::path(Target.Output).parent_path(), ec);
+        Pool.emplace_back([&Target, &Input, &Padded, &InputDigest] { Target.Result = encryptTarget(Target, Input, Padded, InputDigest); });
+    }
+    for (std::thread &t : Pool)
+        t.join();
+    GLog = Log;
+
+    int Failed = 0;
+    for (const EncryptTarget &Target : Targets) {
+        printf("%s %-8s %-8s %s\n", Target.Result == 0 ? "OK    " : "FAILED", getHeaderName(Target.headerid), Target.KeyStoreEntry.c_str(), Target.Output.c_str());
+        if (Target.Result != 0)
+            Failed++;
+    }
+
+    return Failed ? -1 : 0;
+}
+
+// collects the regular files below path (or path itself), sorted for a stable order
+int collectInputs(const std::string &path, std::vector<std::string> &files)
 {
-#if defined(__linux__) || defined(__APPLE__)
-    return std::string(getenv("HOME")) + "/PS2KEYS.dat";
-#else
-    return std::string(getenv("USERPROFILE")) + "\\PS2KEYS.dat";
-#endif
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    if (fs::is_regular_file(path, ec)) {
+        files.push_back(path);
+        return 0;
+    }
+    if (!fs::is_directory(path, ec)) {
+        printf("Couldn't open %s\n", path.c_str());
+        return -1;
+    }
+    for (fs::recursive_directory_iterator it(path, ec), end; !ec && it != end; it.increment(ec)) {
+        if (it->is_regular_file(ec))
+            files.push_back(it->path().string());
+    }
+    std::sort(files.begin(), files.end());
+    return 0;
 }
 
-int decrypt(int argc, char **argv)
+// location of input below root, '/' separated so it is the same on every host
+std::string getBatchRelative(const std::string &root, const std::string &input)
+{
+    namespace fs = std::filesystem;
+    fs::path rel = fs::is_directory(root) ? fs::path(input).lexically_relative(root) : fs::path(input).filename();
+    return rel.generic_string();
+}
+
+// maps input to the same relative location below outdir
+std::string getBatchOutput(const std::string &root, const std::string &input, const std::string &outdir)
+{
+    return (std::filesystem::path(outdir) / getBatchRelative(root, input)).string();
+}
+
+int batch(int argc, char **argv)
 {
     std::string KeyStoreEntry = "default";
+    std::string ReportFile;
+    BatchOptions Options;
+    unsigned Shard = 0, Shards = 1;
+    int headerid   = -1;
 
-    if (argc < 3) {
-        printf("%s decrypt <input> <output> [Flags]\n", argv[0]);
+    const char *mode = argc > 1 ? argv[1] : "";
+    int nargs        = !strcmp(mode, "encrypt") ? 5 : !strcmp(mode, "decrypt") ? 4 : 3;
+    if (argc < nargs || (strcmp(mode, "encrypt") && strcmp(mode, "decrypt") && strcmp(mode, "verify"))) {
+        printf("%s batch decrypt <input> <outdir> [Flags]\n", argv[0]);
+        printf("%s batch encrypt <headerid> <input> <outdir> [Flags]\n", argv[0]);
+        printf("%s batch verify <input> [Flags]\n", argv[0]);
+        printf("<input>: a file or a directory, which is processed recursively\n");
         printf("\tFlags:\n");
-        printf("\t\t--keys        Specify keys to be used\n");
+        printf("\t\t--keys        Specify keys to be used from PS2KEYS.dat\n");
+        printf("\t\t--jobs        Number of crypto worker threads (default: one per cpu)\n");
+        printf("\t\t--inflight    Number of reads/writes kept in flight (default 16)\n");
+        printf("\t\t--io          I/O backend: uring (default where supported) or sync\n");
+        printf("\t\t--manifest    Write path, size, SHA-256, keyset and header id of every output to a file\n");
+        printf("\t\t--manifest-inputs  Also record the SHA-256 of every input\n");
+        printf("\t\t--shard       i/n: only process the files of shard i (0 to n-1), chosen by a stable hash of\n");
+        printf("\t\t              their relative path, so n processes or hosts split the input without overlap\n");
+        printf("\t\t--report      Write the result of every file to a JSON report, combine shards with merge-reports\n");
+        printf("\t\tencrypt also accepts --mgzone, --apptype, --kflags, --systemtype, --blacklist and --whitelist\n");
         return -1;
     }
 
-    for (int x = 3; x < argc; x++) {
+    int ArgError = 0;
+    for (int x = nargs; x < argc; x++) {
         if (!strncmp("--keys=", argv[x], strlen("--keys="))) {
             KeyStoreEntry = &argv[x][7];
+        } else if (!strncmp("--jobs=", argv[x], strlen("--jobs="))) {
+            Options.Jobs = strtoul(&argv[x][7], NULL, 10);
+        } else if (!strncmp("--inflight=", argv[x], strlen("--inflight="))) {
+            Options.InFlight = std::max(1ul, strtoul(&argv[x][11], NULL, 10));
+        } else if (!strcmp("--io=sync", argv[x])) {
+            Options.UseUring = false;
+        } else if (!strcmp("--io=uring", argv[x])) {
+            Options.UseUring = true;
+        } else if (!strncmp("--shard=", argv[x], strlen("--shard="))) {
+            if (sscanf(&argv[x][8], "%u/%u", &Shard, &Shards) != 2 || Shards == 0 || Shard >= Shards) {
+                printf("Invalid shard %s, expected i/n with 0 <= i < n\n", &argv[x][8]);
+                return -1;
+            }
+        } else if (!strncmp("--report=", argv[x], strlen("--report="))) {
+            ReportFile = &argv[x][9];
+        } else if (!parseManifestArg(argv[x])) {
+            parseHeaderArg(argv[x], ArgError);
         }
     }
+    if (ArgError != 0)
+        return ArgError;
 
-    KeyStore ks;
-    int ret = ks.Load("./PS2KEYS.dat", KeyStoreEntry);
-    if (ret != 0) {
-        // try to load keys from working directory
-        ret = ks.Load(getKeyStorePath(), KeyStoreEntry);
+    std::string input  = argv[2];
+    std::string outdir = nargs > 3 ? argv[3] : "";
+    if (!strcmp(mode, "encrypt")) {
+        headerid = getHeaderId(argv[2]);
+        if (headerid == HEADER::INVALID) {
+            printf("Invalid header: %s\n", argv[2]);
+            return -1;
+        }
+        input  = argv[3];
+        outdir = argv[4];
+    }
+
+    auto ks = std::make_shared<KeyStore>();
+    int ret = loadKeyStore(*ks, KeyStoreEntry);
+    if (ret != 0)
+        return ret;
+
+    std::vector<std::string> files;
+    if (collectInputs(input, files) != 0)
+        return -1;
+    if (Shards > 1) {
+        size_t Total = files.size();
+        files.erase(std::remove_if(files.begin(), files.end(), [&](const std::string &file) { return GetShard(getBatchRelative(input, file), Shards) != Shard; }),
+                    files.end());
+        printf("Shard %u/%u: %zu of %zu files\n", Shard, Shards, files.size(), Total);
+    }
+
+    std::vector<BatchJob> Jobs(files.size());
+    for (size_t i = 0; i < files.size(); i++) {
+        Jobs[i].Input = files[i];
+        if (!outdir.empty()) {
+            Jobs[i].Output = getBatchOutput(input, files[i], outdir);
+            std::error_code ec;
+            std::filesystem::create_directories(std::filesystem::path(Jobs[i].Output).parent_path(), ec);
+        }
+    }
+
+    // decrypt and verify workers take their Kelf from the pool, so its buffers are reused from
+    // file to file; encrypt only patches the template of the target around each input
+    KelfPool Pool(ks);
+    std::shared_ptr<const KelfTemplate> Template = headerid != -1 ? KelfTemplate::Get(ks, headerid) : NULL;
+    BatchProcessor Process = [&](BatchJob &Job) {
+        std::string InputDigest = getManifestInputDigest(Job.Data);
+        int id                  = headerid;
+        int ret;
+        if (headerid != -1) {
+            ret = Template ? Template->Build(Kelf::PadContent(Job.Data), Job.Data) : KELF_ERROR_UNSUPPORTED_FILE;
+        } else {
+            KelfPool::Handle kelf = Pool.Acquire();
+            ret                   = kelf->LoadKelfData(Job.Data);
+            if (ret == 0 && !Job.Output.empty())
+                Job.Data.assign(kelf->GetContent().data(), kelf->GetContent().size());
+            id = GetHeaderId(kelf->GetHeader().UserDefined);
+        }
+        // hashed on the worker while the output is still in memory, the writer only writes it
+        if (ret == 0 && !Job.Output.empty() && !GManifestFile.empty())
+            GManifest.Add(Job.Output, Job.Data.data(), Job.Data.size(), KeyStoreEntry, getHeaderName(id), InputDigest);
+        return ret;
+    };
+    BatchCallback Done = [](BatchJob &Job) {
+        if (Job.Result == 0)
+            printf("OK      %s\n", Job.Input.c_str());
+        else
+            printf("FAILED  %s (%d)\n", Job.Input.c_str(), Job.Result);
+    };
+
+    // per-file dumps would interleave between the workers
+    GLog = NULL;
+    int Failed = RunBatch(Jobs, Process, Done, Options);
+    printf("%zu files, %d failed\n", Jobs.size(), Failed);
+
+    if (!ReportFile.empty()) {
+        BatchReport Report;
+        Report.Mode   = mode;
+        Report.KeySet = KeyStoreEntry;
+        Report.Shard  = Shard;
+        Report.Shards = Shards;
+        for (const BatchJob &Job : Jobs)
+            Report.Files.push_back({getBatchRelative(input, Job.Input), Job.Result});
+        if (Report.Save(ReportFile) != 0) {
+            printf("Failed to write report %s\n", ReportFile.c_str());
+            return -1;
+        }
+    }
+
+    return Failed ? -1 : 0;
+}
+
+// combines the partial reports of a sharded batch run
+int mergeReports(int argc, char **argv)
+{
+    if (argc < 3) {
+        printf("%s merge-reports <output.json> <report.json>...\n", argv[0]);
+        printf("checks that every shard of the run is there exactly once and no file was processed twice\n");
+        return -1;
+    }
+
+    std::vector<BatchReport> Parts(argc - 2);
+    for (int x = 2; x < argc; x++) {
+        int ret = Parts[x - 2].Load(argv[x]);
         if (ret != 0) {
-            printf("Failed to load keystore: %d - %s\n", ret, KeyStore::getErrorString(ret).c_str());
+            printf("Failed to read report %s: %d\n", argv[x], ret);
             return ret;
         }
     }
 
-    Kelf kelf(ks);
-    ret = kelf.LoadKelf(argv[1]);
-    if (ret != 0) {
-        printf("Failed to LoadKelf %d!\n", ret);
+    BatchReport Merged;
+    int ret = MergeReports(Parts, Merged);
+    if (ret != 0)
         return ret;
+
+    int Failed = 0;
+    for (const ReportEntry &Entry : Merged.Files) {
+        if (Entry.Result != 0) {
+            printf("FAILED  %s (%d)\n", Entry.Path.c_str(), Entry.Result);
+            Failed++;
+        }
     }
-    ret = kelf.SaveContent(argv[2]);
-    if (ret != 0) {
-        printf("Failed to SaveContent!\n");
-        return ret;
+    printf("%zu files in %u shards, %d failed\n", Merged.Files.size(), Parts[0].Shards, Failed);
+
+    if (Merged.Save(argv[1]) != 0) {
+        printf("Failed to write report %s\n", argv[1]);
+        return -1;
     }
+    return Failed ? -1 : 0;
+}
 
-    return 0;
+std::string toHex(const uint8_t *Data, size_t Size)
+{
+    std::string Hex;
+    char Byte[3];
+    for (size_t i = 0; i < Size; i++) {
+        snprintf(Byte, sizeof(Byte), "%02X", Data[i]);
+        Hex += Byte;
+    }
+    return Hex;
 }
 
-int encrypt(int argc, char **argv)
+// reports one field, true if it differs
+bool diffField(const char *Name, const void *A, const void *B, size_t Size)
+{
+    if (!memcmp(A, B, Size))
+        return false;
+    printf("%-24s %s != %s\n", Name, toHex((const uint8_t *)A, Size).c_str(), toHex((const uint8_t *)B, Size).c_str());
+    return true;
+}
+
+bool diffField(const char *Name, uint64_t A, uint64_t B)
+{
+    if (A == B)
+        return false;
+    printf("%-24s 0x%llX != 0x%llX\n", Name, (unsigned long long)A, (unsigned long long)B);
+    return true;
+}
+
+int diff(int argc, char **argv)
 {
     std::string KeyStoreEntry = "default";
-    int headerid              = -1;
+    bool All                  = false;
 
-    if (argc < 4) {
-        printf("%s encrypt <headerid> <input> <output> [Flags]\n", argv[0]);
-        printf("<headerid>: fmcb, fhdb, mbr, dnasload, dongle\n");
+    if (argc < 3) {
+        printf("%s diff <a.kelf> <b.kelf> [Flags]\n", argv[0]);
+        printf("compares header, keys and bit table, then the decrypted content block by block\n");
+        printf("exits 0 if both are the same, 1 if they differ\n");
         printf("\tFlags:\n");
-        printf("\t\t--keys        Specify keys to be used from PS2KEYS.dat (default, retail, dev, arcade, prototype)\n");
-        printf("\t\t--mgzone      Specify custom region whitelist (default 0xFF: all allowed), example: --mgzone=0x03 (Japan+North America)\n");
-        printf("\t\t--apptype     Specify application type (default 1: XOSDMAIN), example --apptype=7\n");
-        printf("\t\t--kflags      Specify custom flags for KELF Header, default: --kflags=KELF\n");
-        printf("\t\t--systemtype  Specify sys type (PS2 or PSX)\n");
+        printf("\t\t--keys        Specify keys to be used, or two comma separated keysets for <a> and <b>\n");
+        printf("\t\t--all         Report every difference instead of stopping at the first one\n");
         return -1;
     }
 
-    for (int x = 4; x < argc; x++) {
-        if (!strncmp("--keys=", argv[x], strlen("--keys="))) {
-            printf("- Custom keyset %s\n", &argv[x][7]);
+    for (int x = 3; x < argc; x++) {
+        if (!strncmp("--keys=", argv[x], strlen("--keys=")))
             KeyStoreEntry = &argv[x][7];
-        } else if (!strncmp("--systemtype=", argv[x], strlen("--systemtype="))) {
-            const char *a = &argv[x][13];
-            long t;
-            if (!strcmp(a, "PS2")) {
-                GSystemtype = SYSTEM_TYPE_PS2;
-            } else if (!strcmp(a, "PSX")) {
-                GSystemtype = SYSTEM_TYPE_PSX;
-            } else if ((t = strtoul(a, NULL, 10)) <= std::numeric_limits<std::uint8_t>::max()) {
-                GSystemtype = (uint8_t)t;
-            }
-        } else if (!strncmp("--kflags=", argv[x], strlen("--kflags="))) {
-            const char *a = &argv[x][9];
-            unsigned long t;
-            if (!strcmp(a, "KELF")) {
-                GFlags = HDR_PREDEF_KELF;
-            } else if (!strcmp(a, "KIRX")) {
-                GFlags = HDR_PREDEF_KIRX;
-            } else if ((t = strtoul(a, NULL, 16)) <= std::numeric_limits<std::uint16_t>::max()) {
-                GFlags = (uint16_t)t;
-                if ((GFlags & HDR_FLAG4_1DES) && (GFlags & HDR_FLAG4_3DES)) {
-                    printf("WARNING: 0x%x specifies both Single and Triple DES. only one should be defined\n", GFlags);
+        else if (!strcmp("--all", argv[x]))
+            All = true;
+    }
+
+    std::vector<std::string> entries = splitArg(KeyStoreEntry);
+    if (entries.size() == 1)
+        entries.push_back(entries[0]);
+
+    std::string Data[2];
+    std::unique_ptr<Kelf> kelf[2];
+    GLog = NULL;
+    for (int i = 0; i < 2; i++) {
+        auto ks = std::make_shared<KeyStore>();
+        int ret = loadKeyStore(*ks, entries[i]);
+        if (ret != 0)
+            return ret;
+        if (ReadWholeFile(argv[1 + i], Data[i]) != 0) {
+            printf("Failed to read %s\n", argv[1 + i]);
+            return KELF_ERROR_UNSUPPORTED_FILE;
+        }
+        kelf[i] = std::make_unique<Kelf>(ks);
+        ret     = kelf[i]->LoadKelfHeader(Data[i]);
+        if (ret != 0) {
+            printf("Failed to LoadKelf %s %d!\n", argv[1 + i], ret);
+            return ret;
+        }
+    }
+
+    // everything up to the content is already decrypted, so it is compared first
+    const KELFHeader &ha = kelf[0]->GetHeader(), &hb = kelf[1]->GetHeader();
+    const BitTable &ta = kelf[0]->GetBitTable(), &tb = kelf[1]->GetBitTable();
+    bool Differs = false;
+    Differs |= diffField("header.UserDefined", ha.UserDefined, hb.UserDefined, sizeof(ha.UserDefined));
+    Differs |= diffField("header.ContentSize", ha.ContentSize, hb.ContentSize);
+    Differs |= diffField("header.HeaderSize", ha.HeaderSize, hb.HeaderSize);
+    Differs |= diffField("header.SystemType", ha.SystemType, hb.SystemType);
+    Differs |= diffField("header.ApplicationType", ha.ApplicationType, hb.ApplicationType);
+    Differs |= diffField("header.Flags", ha.Flags, hb.Flags);
+    Differs |= diffField("header.BitCount", ha.BitCount, hb.BitCount);
+    Differs |= diffField("header.MGZones", ha.MGZones, hb.MGZones);
+    if (kelf[0]->GetIDList().size() != kelf[1]->GetIDList().size() ||
+        memcmp(kelf[0]->GetIDList().data(), kelf[1]->GetIDList().data(), kelf[0]->GetIDList().size() * sizeof(KELFConsoleID))) {
+        printf("%-24s differs\n", "IDList");
+        Differs = true;
+    }
+    Differs |= diffField("Kbit", kelf[0]->GetKbit().data(), kelf[1]->GetKbit().data(), 16);
+    Differs |= diffField("Kc", kelf[0]->GetKc().data(), kelf[1]->GetKc().data(), 16);
+    Differs |= diffField("bitTable.BlockCount", ta.BlockCount, tb.BlockCount);
+
+    bool SameLayout = ta.BlockCount == tb.BlockCount;
+    for (int i = 0; i < std::min(ta.BlockCount, tb.BlockCount); i++) {
+        std::string Name = "bitTable.Blocks[" + std::to_string(i) + "]";
+        SameLayout &= ta.Blocks[i].Size == tb.Blocks[i].Size;
+        Differs |= diffField((Name + ".Size").c_str(), ta.Blocks[i].Size, tb.Blocks[i].Size);
+        Differs |= diffField((Name + ".Flags").c_str(), ta.Blocks[i].Flags, tb.Blocks[i].Flags);
+        Differs |= diffField((Name + ".Signature").c_str(), ta.Blocks[i].Signature, tb.Blocks[i].Signature, 8);
+    }
+
+    if (Differs && !All) {
+        printf("%s and %s differ before the content\n", argv[1], argv[2]);
+        return 1;
+    }
+
+    // only the blocks that are needed are decrypted
+    if (SameLayout) {
+        uint64_t Offset = 0;
+        std::string Plain[2];
+        for (int i = 0; i < ta.BlockCount; i++) {
+            for (int k = 0; k < 2; k++) {
+                int ret = kelf[k]->LoadContentBlock(Data[k], i, Plain[k]);
+                if (ret != 0) {
+                    printf("Failed to read block %d of %s %d!\n", i, argv[1 + k], ret);
+                    return ret;
                 }
             }
-        } else if (!strncmp("--mgzone=", argv[x], strlen("--mgzone="))) {
-            const char *a = &argv[x][9];
-            long t;
-            if ((t = strtoul(a, NULL, 16)) < std::numeric_limits<std::uint8_t>::max()) {
-                GMGZones = (uint8_t)t;
+            if (Plain[0] != Plain[1]) {
+                size_t at = std::mismatch(Plain[0].begin(), Plain[0].end(), Plain[1].begin()).first - Plain[0].begin();
+                printf("content block %d differs, first at content offset 0x%llx\n", i, (unsigned long long)(Offset + at));
+                Differs = true;
+                if (!All)
+                    return 1;
             }
-        } else if (!strncmp("--apptype=", argv[x], strlen("--apptype="))) {
-            const char *a = &argv[x][10];
-            long t;
-            if ((t = strtoul(a, NULL, 16)) <= std::numeric_limits<std::uint8_t>::max()) {
-                GApplicationType = (uint8_t)t;
+            Offset += ta.Blocks[i].Size;
+        }
+    } else {
+        // different layouts, so the plaintext can only be compared as a whole
+        for (int k = 0; k < 2; k++) {
+            int ret = kelf[k]->LoadKelfContent(Data[k], kelf[k]->GetHeader().HeaderSize);
+            if (ret != 0) {
+                printf("Failed to LoadKelf %s %d!\n", argv[1 + k], ret);
+                return ret;
             }
         }
+        const AlignedBuffer &ca = kelf[0]->GetContent(), &cb = kelf[1]->GetContent();
+        size_t Size = std::min(ca.size(), cb.size());
+        size_t at   = std::mismatch(ca.data(), ca.data() + Size, cb.data()).first - ca.data();
+        if (at != Size || ca.size() != cb.size()) {
+            printf("content differs, first at content offset 0x%llx\n", (unsigned long long)at);
+            Differs = true;
+        }
+    }
+
+    if (Differs)
+        return 1;
+    printf("%s and %s are the same\n", argv[1], argv[2]);
+    return 0;
+}
+
+int watch(int argc, char **argv)
+{
+    namespace fs              = std::filesystem;
+    std::string KeyStoreEntry = "default";
+    WatchOptions Options;
+
+    if (argc < 4) {
+        printf("%s watch <indir> <outdir> <headerid> [Flags]\n", argv[0]);
+        printf("encrypts every file written or moved into <indir> to <outdir> until interrupted\n");
+        printf("\tFlags:\n");
+        printf("\t\t--keys        Specify keys to be used from PS2KEYS.dat\n");
+        printf("\t\t--jobs        Number of worker threads (default: one per cpu)\n");
+        printf("\t\t--debounce    Milliseconds a file must stay unchanged before it is encrypted (default 100)\n");
+        printf("\t\talso accepts --mgzone, --apptype, --kflags, --systemtype, --blacklist and --whitelist\n");
+        return -1;
+    }
+
+    std::string indir  = argv[1];
+    std::string outdir = argv[2];
+    int headerid       = getHeaderId(argv[3]);
+    if (headerid == HEADER::INVALID) {
+        printf("Invalid header: %s\n", argv[3]);
+        return -1;
+    }
+
+    int ArgError = 0;
+    for (int x = 4; x < argc; x++) {
+        if (!strncmp("--keys=", argv[x], strlen("--keys="))) {
+            KeyStoreEntry = &argv[x][7];
+        } else if (!strncmp("--jobs=", argv[x], strlen("--jobs="))) {
+            Options.Jobs = strtoul(&argv[x][7], NULL, 10);
+        } else if (!strncmp("--debounce=", argv[x], strlen("--debounce="))) {
+            Options.DebounceMs = strtoul(&argv[x][11], NULL, 10);
+        } else {
+            parseHeaderArg(argv[x], ArgError);
+        }
+    }
+    if (ArgError != 0)
+        return ArgError;
+
+    std::error_code ec;
+    fs::create_directories(outdir, ec);
+    if (fs::equivalent(indir, outdir, ec)) {
+        printf("<indir> and <outdir> must differ, the outputs would be encrypted again\n");
+        return -1;
     }
 
-    if (strcmp("fmcb", argv[1]) == 0)
-        headerid = HEADER::FMCB;
+    auto ks = std::make_shared<KeyStore>();
+    int ret = loadKeyStore(*ks, KeyStoreEntry);
+    if (ret != 0)
+        return ret;
 
-    if (strcmp("fhdb", argv[1]) == 0)
-        headerid = HEADER::FHDB;
+    // keystore, template and workers are set up once, each file only pays for copying itself
+    std::shared_ptr<const KelfTemplate> Template = KelfTemplate::Get(ks, headerid);
+    if (!Template)
+        return KELF_ERROR_UNSUPPORTED_FILE;
+    WatchHandler Handler = [&](const std::string &path) {
+        auto start         = std::chrono::steady_clock::now();
+        std::string name   = fs::path(path).filename().string();
+        std::string output = (fs::path(outdir) / name).string();
+        // written under a dot name first, so nothing reading <outdir> sees half a file
+        std::string partial = (fs::path(outdir) / ("." + name + ".part")).string();
 
-    if (strcmp("mbr", argv[1]) == 0)
-        headerid = HEADER::MBR;
+        std::string Data;
+        int ret = ReadWholeFile(path, Data);
+        if (ret == 0)
+            ret = Template->Build(Kelf::PadContent(Data), Data);
+        if (ret == 0) {
+            std::error_code ec;
+            ret = WriteWholeFile(partial, Data);
+            if (ret == 0)
+                fs::rename(partial, output, ec);
+            if (ec)
+                ret = FILEIO_ERROR_WRITE_FAILED;
+        }
 
-    if (strcmp("dnasload", argv[1]) == 0)
-        headerid = HEADER::DNASLOAD;
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (ret == 0)
+            printf("OK      %s -> %s (%.1f ms)\n", path.c_str(), output.c_str(), ms);
+        else
+            printf("FAILED  %s (%d)\n", path.c_str(), ret);
+        fflush(stdout);
+    };
 
-    if (strcmp("dongle", argv[1]) == 0)
-        headerid = HEADER::ARCADE_BOOTFILE;
+    GLog = NULL;
+    printf("Watching %s, encrypting to %s as %s\n", indir.c_str(), outdir.c_str(), getHeaderName(headerid));
+    fflush(stdout);
+    return WatchDirectory(indir, Options, Handler);
+}
 
-    if (headerid == HEADER::INVALID) {
+int scan(int argc, char **argv)
+{
+    std::string KeyStoreEntry = "default";
+    std::string ExtractDir;
+    ScanOptions Options;
+    bool All = false;
 
-        printf("Invalid header: %s\n", argv[1]);
+    if (argc < 2) {
+        printf("%s scan <image> [Flags]\n", argv[0]);
+        printf("\tFlags:\n");
+        printf("\t\t--keys        Specify keys to be used from PS2KEYS.dat\n");
+        printf("\t\t--threads     Number of scanning threads (default: one per cpu)\n");
+        printf("\t\t--extract     Write every valid KELF found to <dir>/<offset>.kelf\n");
+        printf("\t\t--all         Also list known headers whose signature does not match\n");
         return -1;
     }
 
-    KeyStore ks;
-    int ret = ks.Load("./PS2KEYS.dat", KeyStoreEntry);
-    if (ret != 0) {
-        // try to load keys from working directory
-        ret = ks.Load(getKeyStorePath(), KeyStoreEntry);
+    for (int x = 2; x < argc; x++) {
+        if (!strncmp("--keys=", argv[x], strlen("--keys="))) {
+            KeyStoreEntry = &argv[x][7];
+        } else if (!strncmp("--threads=", argv[x], strlen("--threads="))) {
+            Options.Threads = strtoul(&argv[x][10], NULL, 10);
+        } else if (!strncmp("--extract=", argv[x], strlen("--extract="))) {
+            ExtractDir = &argv[x][10];
+        } else if (!strcmp("--all", argv[x])) {
+            All = true;
+        } else {
+            printf("Unknown flag: %s\n", argv[x]);
+            return -1;
+        }
+    }
+
+    auto ks = std::make_shared<KeyStore>();
+    int ret = loadKeyStore(*ks, KeyStoreEntry);
+    if (ret != 0)
+        return ret;
+
+    if (!ExtractDir.empty()) {
+        std::error_code ec;
+        std::filesystem::create_directories(ExtractDir, ec);
+    }
+
+    FILE *Log = GLog;
+    GLog      = NULL;
+    std::vector<ScanResult> Results;
+    ret = ScanImage(argv[1], ks, Options, Results);
+    GLog = Log;
+    if (ret != 0)
+        return ret;
+
+    size_t Found = 0;
+    for (const ScanResult &result : Results) {
+        if (result.Status == SCAN_STATUS_CANDIDATE && !All)
+            continue;
+
+        const char *status = result.Status == SCAN_STATUS_VALID ? "valid" : result.Status == SCAN_STATUS_HEADER ? "header only" : "bad signature";
+        printf("0x%010llx %-8s ", (unsigned long long)result.Offset, getHeaderName(result.HeaderId));
+        if (result.Status == SCAN_STATUS_VALID)
+            printf("%10llu ", (unsigned long long)result.Size);
+        else
+            printf("%10s ", "?");
+        printf("%s\n", status);
+
+        if (result.Status != SCAN_STATUS_VALID)
+            continue;
+        Found++;
+
+        if (!ExtractDir.empty()) {
+            char name[32];
+            snprintf(name, sizeof(name), "%010llx.kelf", (unsigned long long)result.Offset);
+            std::string Data;
+            std::string output = (std::filesystem::path(ExtractDir) / name).string();
+            if (ReadFileRange(argv[1], result.Offset, result.Size, Data) != 0 || WriteWholeFile(output, Data) != 0)
+                printf("Failed to extract %s\n", output.c_str());
+        }
+    }
+    printf("%zu valid KELF(s) found\n", Found);
+
+    return 0;
+}
+
+int idindex(int argc, char **argv)
+{
+    std::string KeyStoreEntry = "default";
+
+    const char *mode = argc > 1 ? argv[1] : "";
+    if (argc < 4 || (strcmp(mode, "build") && strcmp(mode, "query"))) {
+        printf("%s idindex build <input> <index> [--keys=]\n", argv[0]);
+        printf("%s idindex query <index> <id>\n", argv[0]);
+        printf("<input>: a file or a directory, which is searched recursively\n");
+        printf("<id>: iLinkID or ConsoleID as 16 hex digits\n");
+        return -1;
+    }
+
+    ConsoleIndex Index;
+    if (!strcmp(mode, "query")) {
+        uint8_t ID[8];
+        if (!ParseConsoleID(argv[3], ID)) {
+            printf("Invalid ID: %s\n", argv[3]);
+            return -1;
+        }
+        int ret = Index.Load(argv[2]);
         if (ret != 0) {
-            printf("Failed to load keystore: %d - %s\n", ret, KeyStore::getErrorString(ret).c_str());
+            printf("Failed to load index %s: %d\n", argv[2], ret);
             return ret;
         }
+        for (const std::string &file : Index.Query(ID))
+            printf("%s\n", file.c_str());
+        return 0;
     }
 
-    Kelf kelf(ks);
-    ret = kelf.LoadContent(argv[2], headerid);
+    for (int x = 4; x < argc; x++) {
+        if (!strncmp("--keys=", argv[x], strlen("--keys=")))
+            KeyStoreEntry = &argv[x][7];
+    }
+
+    auto ks = std::make_shared<KeyStore>();
+    int ret = loadKeyStore(*ks, KeyStoreEntry);
+    if (ret != 0)
+        return ret;
+
+    std::vector<std::string> files;
+    if (collectInputs(argv[2], files) != 0)
+        return -1;
+
+    // only the headers are needed, the contents are never read
+    FILE *Log = GLog;
+    GLog      = NULL;
+    for (const std::string &file : files) {
+        Kelf kelf(ks);
+        if (kelf.LoadKelf(file, 0, 0, true) != 0)
+            continue;
+        Index.Add(file, kelf.GetHeader().Flags, kelf.GetIDList());
+    }
+    GLog = Log;
+
+    ret = Index.Save(argv[3]);
     if (ret != 0) {
-        printf("Failed to LoadContent!\n");
+        printf("Failed to save index %s: %d\n", argv[3], ret);
+        return ret;
+    }
+    printf("%zu of %zu files indexed\n", Index.GetFileCount(), files.size());
+
+    return 0;
+}
+
+// parses a catalog query term <field><op><value>, op is one of = != < > & (all bits set) !& (no bit set)
+bool parseCatalogTerm(const char *arg, CatalogTerm &Term)
+{
+    static const struct
+    {
+        const char *Text;
+        int Op;
+    } Ops[] = {{"!=", CATALOG_OP_NE}, {"!&", CATALOG_OP_NONE}, {"=", CATALOG_OP_EQ}, {"<", CATALOG_OP_LT}, {">", CATALOG_OP_GT}, {"&", CATALOG_OP_ALL}};
+
+    size_t pos = strcspn(arg, "!=<>&");
+    if (arg[pos] == 0)
+        return false;
+    Term.Field = GetCatalogField(std::string(arg, pos));
+    if (Term.Field == CATALOG_FIELD_INVALID)
+        return false;
+
+    const char *value = NULL;
+    for (const auto &op : Ops) {
+        if (!strncmp(&arg[pos], op.Text, strlen(op.Text))) {
+            Term.Op = op.Op;
+            value   = &arg[pos + strlen(op.Text)];
+            break;
+        }
+    }
+    if (value == NULL || *value == 0)
+        return false;
+
+    Term.Text = value;
+    char *end;
+    Term.Value = strtoull(value, &end, 0);
+    if (*end == 0 || Term.Field == CATALOG_FIELD_KEYSET)
+        return true;
+
+    // symbolic values
+    if (Term.Field == CATALOG_FIELD_HEADER && getHeaderId(value) != HEADER::INVALID) {
+        Term.Value = getHeaderId(value);
+    } else if (Term.Field == CATALOG_FIELD_FLAGS && !strcmp(value, "KELF")) {
+        Term.Value = HDR_PREDEF_KELF;
+    } else if (Term.Field == CATALOG_FIELD_FLAGS && !strcmp(value, "KIRX")) {
+        Term.Value = HDR_PREDEF_KIRX;
+    } else if (Term.Field == CATALOG_FIELD_STATUS && !strcmp(value, "ok")) {
+        Term.Value = 0;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+int catalog(int argc, char **argv)
+{
+    const char *mode = argc > 1 ? argv[1] : "";
+    if (argc < 3 || (strcmp(mode, "build") && strcmp(mode, "update") && strcmp(mode, "query")) || (strcmp(mode, "query") && argc < 4)) {
+        printf("%s catalog build <input> <catalog> [--jobs=]\n", argv[0]);
+        printf("%s catalog update <input> <catalog> [--jobs=]\n", argv[0]);
+        printf("%s catalog query <catalog> [<field><op><value>...]\n", argv[0]);
+        printf("<input>: a file or a directory, which is searched recursively\n");
+        printf("update only parses files that are new or changed size or mtime since the last build/update\n");
+        printf("<field>: size, status, keyset, header, contentsize, headersize, systemtype, apptype, flags, bitcount, mgzones, blocks\n");
+        printf("<op>: = != < > & (all bits set) !& (no bit set), numbers may be hex with 0x\n");
+        printf("\texample: catalog query lib.cat flags=KIRX apptype=5\n");
+        printf("\texample: catalog query lib.cat \"mgzones!&0x04\" status=ok\n");
+        return -1;
+    }
+
+    Catalog Cat;
+    if (!strcmp(mode, "query")) {
+        std::vector<CatalogTerm> Terms;
+        for (int x = 3; x < argc; x++) {
+            CatalogTerm Term;
+            if (!parseCatalogTerm(argv[x], Term)) {
+                printf("Invalid query term: %s\n", argv[x]);
+                return -1;
+            }
+            Terms.push_back(Term);
+        }
+
+        int ret = Cat.Load(argv[2]);
+        if (ret != 0) {
+            printf("Failed to load catalog %s: %d\n", argv[2], ret);
+            return ret;
+        }
+        for (const CatalogEntry *Entry : Cat.Query(Terms)) {
+            printf("%-8s %-8s flags=0x%04x apptype=%-2d mgzones=0x%02x status=%-3d %s\n",
+                   Entry->KeySet.empty() ? "-" : Entry->KeySet.c_str(), getHeaderName(GetHeaderId(Entry->Header.UserDefined)),
+                   Entry->Header.Flags, Entry->Header.ApplicationType, Entry->Header.MGZones, Entry->Status, Entry->Path.c_str());
+        }
+        return 0;
+    }
+
+    unsigned Jobs = 0;
+    for (int x = 4; x < argc; x++) {
+        if (!strncmp("--jobs=", argv[x], strlen("--jobs=")))
+            Jobs = strtoul(&argv[x][7], NULL, 10);
+    }
+
+    std::vector<std::pair<std::string, std::shared_ptr<const KeyStore>>> KeySets;
+    int ret = loadAllKeyStores(KeySets);
+    if (ret != 0)
         return ret;
+
+    if (!strcmp(mode, "update")) {
+        ret = Cat.Load(argv[3]);
+        if (ret == CATALOG_ERROR_BAD_CATALOG) {
+            printf("Failed to load catalog %s: %d\n", argv[3], ret);
+            return ret;
+        }
     }
 
-    ret = kelf.SaveKelf(argv[3], headerid);
+    std::vector<std::string> files;
+    if (collectInputs(argv[2], files) != 0)
+        return -1;
+
+    // the keyset is the first whose header signature matches, only that one verifies the rest
+    auto Parse = [&KeySets](CatalogEntry &Entry) {
+        // header fields and blocks are only kept once a keyset verifies the header, the first
+        // bytes of any other file would match queries at random
+        Entry.Status = KELF_ERROR_INVALID_HEADER_SIGNATURE;
+        Entry.Header = KELFHeader();
+        Entry.Blocks.clear();
+        for (auto &KeySet : KeySets) {
+            Kelf kelf(KeySet.second);
+            int ret = kelf.LoadKelf(Entry.Path, 0, 0, true);
+            if (ret == KELF_ERROR_INVALID_HEADER_SIGNATURE)
+                continue;
+            if (ret != 0 && ret != KELF_ERROR_INVALID_BIT_TABLE_SIGNATURE && ret != KELF_ERROR_INVALID_BIT_TABLE_SIZE) {
+                // not a kelf at all
+                Entry.Status = ret;
+                return;
+            }
+
+            Entry.Header = kelf.GetHeader();
+            Entry.KeySet = KeySet.first;
+            Entry.Status = kelf.LoadKelf(Entry.Path);
+            if (Entry.Status == 0 || Entry.Status == KELF_ERROR_INVALID_CONTENT_SIGNATURE) {
+                const BitTable &bitTable = kelf.GetBitTable();
+                for (int i = 0; i < bitTable.BlockCount; i++)
+                    Entry.Blocks.emplace_back(bitTable.Blocks[i].Size, bitTable.Blocks[i].Flags);
+            }
+            return;
+        }
+    };
+
+    FILE *Log     = GLog;
+    GLog          = NULL;
+    size_t Parsed = Cat.Update(files, Parse, Jobs);
+    GLog          = Log;
+
+    ret = Cat.Save(argv[3]);
     if (ret != 0) {
-        printf("Failed to SaveKelf!\n");
+        printf("Failed to save catalog %s: %d\n", argv[3], ret);
         return ret;
     }
+    printf("%zu files in catalog, %zu parsed\n", Cat.GetSize(), Parsed);
+
+    return 0;
+}
+
+// measures the crypto implementations on this host and stores the fastest verified ones
+int tune(int argc, char **argv)
+{
+    std::string ConfigPath = GetEngineConfigPath();
+    bool DryRun            = false;
+
+    for (int x = 1; x < argc; x++) {
+        if (!strncmp("--config=", argv[x], strlen("--config="))) {
+            ConfigPath = &argv[x][9];
+        } else if (!strcmp("--dry-run", argv[x])) {
+            DryRun = true;
+        } else {
+            printf("%s tune [Flags]\n", argv[0]);
+            printf("runs a known-answer test and a throughput probe of every content cipher, XOR fold and\n");
+            printf("key schedule implementation, and saves the fastest verified ones for later runs on this cpu\n");
+            printf("\tFlags:\n");
+            printf("\t\t--config      Config file to write (default: $KELFTOOL_ENGINE or ~/.kelftool-engine)\n");
+            printf("\t\t--dry-run     Only print the results\n");
+            return -1;
+        }
+    }
+
+    std::string Cpu = GetCpuName();
+    printf("Tuning on %s\n", Cpu.empty() ? "unknown cpu" : Cpu.c_str());
+    EngineConfig Best = TuneEngine();
+    printf("Selected %s\n", DescribeEngine(Best).c_str());
+    if (DryRun)
+        return 0;
 
+    if (SaveEngineConfig(ConfigPath, Best) != 0) {
+        printf("Failed to write %s\n", ConfigPath.c_str());
+        return -1;
+    }
+    printf("Saved to %s\n", ConfigPath.c_str());
     return 0;
 }
 
@@ -202,6 +1832,21 @@ int main(int argc, char **argv)
         printf("\t\t           Note: for mbr elf should load from 0x100000 and should be without headers:\n");
         printf("\t\t           readelf -h <input_elf> should show 0x100000 or 0x100008\n");
         printf("\t\t           $(EE_OBJCOPY) -O binary -v <input_elf> <headerless_elf>\n");
+        printf("\tdiff - compare two kelf files field by field and block by block\n");
+        printf("\trekey - move a kelf file to another keyset or header type without writing the plaintext\n");
+        printf("\tverify - check all signatures of a kelf file without writing anything\n");
+        printf("\tinfo - print the header and bit table of a kelf file\n");
+        printf("\telfinfo - print the ELF header and segments of a kelf file, decrypting only those bytes\n");
+        printf("\t\tencrypt --into-mc and decrypt/verify/info --from-mc work on a file inside PS2 memory card images\n");
+        printf("\t\tencrypt mbr --into-hdd writes straight into the __mbr partition of an APA HDD image\n");
+        printf("\tbatch <decrypt|encrypt|verify> - process whole directories with overlapped I/O\n");
+        printf("\tmerge-reports <output> <reports...> - combine the JSON reports of sharded batch runs\n");
+        printf("\twatch <indir> <outdir> <headerid> - encrypt files as soon as they are dropped into a directory\n");
+        printf("\tscan - find and carve KELFs out of raw disk and memory dumps\n");
+        printf("\tidindex <build|query> - index the console ID lists of many kelf files\n");
+        printf("\tcatalog <build|update|query> - keep the header metadata of a whole library in one file\n");
+        printf("\ttune - pick the fastest verified crypto implementations for this cpu, used by every later run\n");
+        printf("\t--trace=<file.json> with any submodule writes a Chrome trace-event timeline of its work\n");
         return -1;
     }
 
@@ -210,11 +1855,61 @@ int main(int argc, char **argv)
     argc--;
     argv++;
 
+    // --trace applies to every command, so it is taken out before the command parses its args
+    std::string TraceFile;
+    int n = 1;
+    for (int i = 1; i < argc; i++) {
+        if (!strncmp("--trace=", argv[i], strlen("--trace=")))
+            TraceFile = &argv[i][8];
+        else
+            argv[n++] = argv[i];
+    }
+    argc       = n;
+    argv[argc] = NULL;
+    if (!TraceFile.empty())
+        TraceStart();
+    // implementations chosen by tune on this host, the defaults without a config
+    LoadEngineConfig(GetEngineConfigPath(), GEngine);
+
+    int ret = -1;
     if (strcmp("decrypt", cmd) == 0)
-        return decrypt(argc, argv);
+        ret = decrypt(argc, argv);
     else if (strcmp("encrypt", cmd) == 0)
-        return encrypt(argc, argv);
+        ret = encrypt(argc, argv);
+    else if (strcmp("diff", cmd) == 0)
+        ret = diff(argc, argv);
+    else if (strcmp("rekey", cmd) == 0)
+        ret = rekey(argc, argv);
+    else if (strcmp("verify", cmd) == 0)
+        ret = inspect(argc, argv, false);
+    else if (strcmp("info", cmd) == 0)
+        ret = inspect(argc, argv, true);
+    else if (strcmp("elfinfo", cmd) == 0)
+        ret = elfinfo(argc, argv);
+    else if (strcmp("batch", cmd) == 0)
+        ret = batch(argc, argv);
+    else if (strcmp("tune", cmd) == 0)
+        ret = tune(argc, argv);
+    else if (strcmp("merge-reports", cmd) == 0)
+        ret = mergeReports(argc, argv);
+    else if (strcmp("watch", cmd) == 0)
+        ret = watch(argc, argv);
+    else if (strcmp("scan", cmd) == 0)
+        ret = scan(argc, argv);
+    else if (strcmp("idindex", cmd) == 0)
+        ret = idindex(argc, argv);
+    else if (strcmp("catalog", cmd) == 0)
+        ret = catalog(argc, argv);
+    else
+        printf("Unknown submodule!\n");
+
+    if (!GManifestFile.empty() && GManifest.Save(GManifestFile) != 0) {
+        fprintf(stderr, "Failed to write manifest %s\n", GManifestFile.c_str());
+        if (ret == 0)
+            ret = -1;
+    }
+    if (!TraceFile.empty() && TraceWrite(TraceFile) != 0)
+        fprintf(stderr, "Failed to write trace %s\n", TraceFile.c_str());
 
-    printf("Unknown submodule!\n");
-    return -1;
+    return ret;
 }
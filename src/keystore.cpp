@@ -15,7 +15,9 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "keystore.h"
+#include "digest.h"
 #include "inipp.h"
+#include <string.h>
 #include <fstream>
 #include <vector>
 #include <sstream>
@@ -66,38 +68,67 @@ int KeyStore::Load(std::string filename, std::string KeySet = "default")
     if (ini.sections.find(KeySet) == ini.sections.end()) {
         return KEYSTORE_SECTION_MISSING;
     }
-    inipp::get_value(ini.sections[KeySet], "MG_SIG_MASTER_KEY", SignatureMasterKey);
-    inipp::get_value(ini.sections[KeySet], "MG_SIG_HASH_KEY", SignatureHashKey);
-    inipp::get_value(ini.sections[KeySet], "MG_KBIT_MASTER_KEY", KbitMasterKey);
-    inipp::get_value(ini.sections[KeySet], "MG_KBIT_IV", KbitIV);
-    inipp::get_value(ini.sections[KeySet], "MG_KC_MASTER_KEY", KcMasterKey);
-    inipp::get_value(ini.sections[KeySet], "MG_KC_IV", KcIV);
-    inipp::get_value(ini.sections[KeySet], "MG_ROOTSIG_MASTER_KEY", RootSignatureMasterKey);
-    inipp::get_value(ini.sections[KeySet], "MG_ROOTSIG_HASH_KEY", RootSignatureHashKey);
-    inipp::get_value(ini.sections[KeySet], "MG_CONTENT_TABLE_IV", ContentTableIV);
-    inipp::get_value(ini.sections[KeySet], "MG_CONTENT_IV", ContentIV);
-    inipp::get_value(ini.sections[KeySet], "OVERRIDE_KBIT", OverrideKbit);
-    inipp::get_value(ini.sections[KeySet], "OVERRIDE_KC", OverrideKc);
-    SignatureMasterKey     = hex2bin(SignatureMasterKey);
-    SignatureHashKey       = hex2bin(SignatureHashKey);
-    KbitMasterKey          = hex2bin(KbitMasterKey);
-    KbitIV                 = hex2bin(KbitIV);
-    KcMasterKey            = hex2bin(KcMasterKey);
-    KcIV                   = hex2bin(KcIV);
-    RootSignatureMasterKey = hex2bin(RootSignatureMasterKey);
-    RootSignatureHashKey   = hex2bin(RootSignatureHashKey);
-    ContentTableIV         = hex2bin(ContentTableIV);
-    ContentIV              = hex2bin(ContentIV);
-    OverrideKbit           = hex2bin(OverrideKbit);
-    OverrideKc             = hex2bin(OverrideKc);
+    struct
+    {
+        const char *Name;
+        uint8_t *Key;
+        size_t Size;
+    } Keys[] = {
+        {"MG_SIG_MASTER_KEY", SignatureMasterKey.data(), SignatureMasterKey.size()},
+        {"MG_SIG_HASH_KEY", SignatureHashKey.data(), SignatureHashKey.size()},
+        {"MG_KBIT_MASTER_KEY", KbitMasterKey.data(), KbitMasterKey.size()},
+        {"MG_KBIT_IV", KbitIV.data(), KbitIV.size()},
+        {"MG_KC_MASTER_KEY", KcMasterKey.data(), KcMasterKey.size()},
+        {"MG_KC_IV", KcIV.data(), KcIV.size()},
+        {"MG_ROOTSIG_MASTER_KEY", RootSignatureMasterKey.data(), RootSignatureMasterKey.size()},
+        {"MG_ROOTSIG_HASH_KEY", RootSignatureHashKey.data(), RootSignatureHashKey.size()},
+        {"MG_CONTENT_TABLE_IV", ContentTableIV.data(), ContentTableIV.size()},
+        {"MG_CONTENT_IV", ContentIV.data(), ContentIV.size()},
+        {"OVERRIDE_KBIT", OverrideKbit.data(), OverrideKbit.size()}, // optional, arcade only
+        {"OVERRIDE_KC", OverrideKc.data(), OverrideKc.size()},       // optional, arcade only
+    };
+    const size_t Required = 10;
 
-    if (SignatureMasterKey.size() == 0 || SignatureHashKey.size() == 0 ||
-        KbitMasterKey.size() == 0 || KbitIV.size() == 0 ||
-        KcMasterKey.size() == 0 || KcIV.size() == 0 ||
-        RootSignatureMasterKey.size() == 0 || RootSignatureHashKey.size() == 0 ||
-        ContentTableIV.size() == 0 || ContentIV.size() == 0)
-        return KEYSTORE_ERROR_MISSING_KEY;
+    // the fingerprint keeps hashing the length of every key, absent ones as zero
+    Sha256 sha;
+    size_t Present = 0;
+    for (size_t i = 0; i < sizeof(Keys) / sizeof(Keys[0]); i++) {
+        std::string Value;
+        inipp::get_value(ini.sections[KeySet], Keys[i].Name, Value);
+        Value = hex2bin(Value);
+        if (Value.empty() && i < Required)
+            return KEYSTORE_ERROR_MISSING_KEY;
+        if (!Value.empty() && Value.size() != Keys[i].Size)
+            return KEYSTORE_ERROR_INVALID_KEY_LENGTH;
 
+        memset(Keys[i].Key, 0, Keys[i].Size);
+        memcpy(Keys[i].Key, Value.data(), Value.size());
+        if (!Value.empty())
+            Present++;
+
+        uint32_t size = Value.size();
+        sha.Update(&size, sizeof(size));
+        sha.Update(Value);
+    }
+    Override = Present == sizeof(Keys) / sizeof(Keys[0]);
+    Fingerprint        = sha.FinalHex();
+    std::string Digest = hex2bin(Fingerprint);
+    memcpy(FingerprintDigest.data(), Digest.data(), FingerprintDigest.size());
+
+    return 0;
+}
+
+int KeyStore::ListSections(const std::string &filename, std::vector<std::string> &Sections)
+{
+    inipp::Ini<char> ini;
+    std::ifstream infile(filename);
+    if (infile.fail())
+        return KEYSTORE_ERROR_OPEN_FAILED;
+    ini.parse(infile);
+
+    Sections.clear();
+    for (const auto &section : ini.sections)
+        Sections.push_back(section.first);
     return 0;
 }
 
@@ -116,6 +147,8 @@ std::string KeyStore::getErrorString(int err)
             return "Some keys are missing from the keystore!";
         case KEYSTORE_SECTION_MISSING:
             return "Cant find requested section in keystore!";
+        case KEYSTORE_ERROR_INVALID_KEY_LENGTH:
+            return "A key in the keystore has the wrong length!";
         default:
             return "Unknown error";
     }
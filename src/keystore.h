@@ -17,44 +17,63 @@
 #ifndef __KEYSTORE_H__
 #define __KEYSTORE_H__
 
+#include <stdint.h>
+#include <array>
 #include <string>
+#include <vector>
 
 #define KEYSTORE_ERROR_OPEN_FAILED        -1
 #define KEYSTORE_ERROR_LINE_NOT_KEY_VALUE -2
 #define KEYSTORE_ERROR_ODD_LEN_VALUE      -3
 #define KEYSTORE_ERROR_MISSING_KEY        -4
 #define KEYSTORE_SECTION_MISSING          -5
+#define KEYSTORE_ERROR_INVALID_KEY_LENGTH -6
+
+// fixed size key material, passed around by value without touching the heap
+typedef std::array<uint8_t, 8> Block8;   // single DES key, IV or signature
+typedef std::array<uint8_t, 16> Block16; // two key DES key, Kbit, Kc or KEK
+typedef std::array<uint8_t, 32> Block32;
 
 class KeyStore
 {
-    std::string SignatureMasterKey;
-    std::string SignatureHashKey;
-    std::string KbitMasterKey;
-    std::string KbitIV;
-    std::string KcMasterKey;
-    std::string KcIV;
-    std::string RootSignatureMasterKey;
-    std::string RootSignatureHashKey;
-    std::string ContentTableIV;
-    std::string ContentIV;
-    std::string OverrideKbit;
-    std::string OverrideKc;
+    Block8 SignatureMasterKey;
+    Block8 SignatureHashKey;
+    Block16 KbitMasterKey;
+    Block8 KbitIV;
+    Block16 KcMasterKey;
+    Block8 KcIV;
+    Block8 RootSignatureMasterKey;
+    Block16 RootSignatureHashKey;
+    Block8 ContentTableIV;
+    Block8 ContentIV;
+    Block16 OverrideKbit;
+    Block16 OverrideKc;
+    bool Override;
+    std::string Fingerprint;
+    Block32 FingerprintDigest;
 
 public:
     int Load(std::string filename, std::string KeyStoreEntry);
+    // names of all keysets in a keystore file
+    static int ListSections(const std::string &filename, std::vector<std::string> &Sections);
 
-    std::string GetSignatureMasterKey() { return SignatureMasterKey; }
-    std::string GetSignatureHashKey() { return SignatureHashKey; }
-    std::string GetKbitMasterKey() { return KbitMasterKey; }
-    std::string GetKbitIV() { return KbitIV; }
-    std::string GetKcMasterKey() { return KcMasterKey; }
-    std::string GetKcIV() { return KcIV; }
-    std::string GetRootSignatureMasterKey() { return RootSignatureMasterKey; }
-    std::string GetRootSignatureHashKey() { return RootSignatureHashKey; }
-    std::string GetContentTableIV() { return ContentTableIV; }
-    std::string GetContentIV() { return ContentIV; }
-    std::string GetOverrideKbit() { return OverrideKbit; }
-    std::string GetOverrideKc() { return OverrideKc; }
+    const Block8 &GetSignatureMasterKey() const { return SignatureMasterKey; }
+    const Block8 &GetSignatureHashKey() const { return SignatureHashKey; }
+    const Block16 &GetKbitMasterKey() const { return KbitMasterKey; }
+    const Block8 &GetKbitIV() const { return KbitIV; }
+    const Block16 &GetKcMasterKey() const { return KcMasterKey; }
+    const Block8 &GetKcIV() const { return KcIV; }
+    const Block8 &GetRootSignatureMasterKey() const { return RootSignatureMasterKey; }
+    const Block16 &GetRootSignatureHashKey() const { return RootSignatureHashKey; }
+    const Block8 &GetContentTableIV() const { return ContentTableIV; }
+    const Block8 &GetContentIV() const { return ContentIV; }
+    // arcade keysets replace Kbit and Kc of every file
+    bool HasOverride() const { return Override; }
+    const Block16 &GetOverrideKbit() const { return OverrideKbit; }
+    const Block16 &GetOverrideKc() const { return OverrideKc; }
+    // SHA-256 of the loaded key material, identifies a keyset independently of its name
+    const std::string &GetFingerprint() const { return Fingerprint; }
+    const Block32 &GetFingerprintDigest() const { return FingerprintDigest; }
 
     static std::string getErrorString(int err);
 };
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <algorithm>
+
+#include "manifest.h"
+#include "digest.h"
+
+void Manifest::Add(const std::string &Path, const void *Data, size_t Size, const std::string &KeySet, const std::string &Header, const std::string &InputDigest)
+{
+    ManifestEntry entry;
+    entry.Path = Path;
+    entry.Size = Size;
+    {
+        Sha256 sha;
+        sha.Update(Data, Size);
+        entry.Digest = sha.FinalHex();
+    }
+    entry.KeySet      = KeySet;
+    entry.Header      = Header;
+    entry.InputDigest = InputDigest;
+
+    std::lock_guard<std::mutex> lock(Mutex);
+    Entries.push_back(std::move(entry));
+}
+
+int Manifest::Save(const std::string &filename)
+{
+    std::lock_guard<std::mutex> lock(Mutex);
+    std::sort(Entries.begin(), Entries.end(), [](const ManifestEntry &a, const ManifestEntry &b) { return a.Path < b.Path; });
+
+    FILE *f = fopen(filename.c_str(), "w");
+    if (f == NULL)
+        return -1;
+    fprintf(f, "# path\tsize\tsha256\tkeyset\theader\tinput_sha256\n");
+    for (const ManifestEntry &e : Entries) {
+        fprintf(f, "%s\t%llu\t%s\t%s\t%s\t%s\n", e.Path.c_str(), (unsigned long long)e.Size, e.Digest.c_str(), e.KeySet.c_str(), e.Header.c_str(),
+                e.InputDigest.empty() ? "-" : e.InputDigest.c_str());
+    }
+    return fclose(f) == 0 ? 0 : -1;
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __MANIFEST_H__
+#define __MANIFEST_H__
+
+#include <stdint.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct ManifestEntry
+{
+    std::string Path;
+    uint64_t Size;
+    std::string Digest; // SHA-256 of the output, lowercase hex
+    std::string KeySet;
+    std::string Header;
+    std::string InputDigest; // empty unless input hashing was asked for
+};
+
+// Distribution manifest filled while outputs are written, so nothing has to be read back.
+// Lines are tab separated: path, size, sha256, keyset, header id, input sha256 (or -).
+class Manifest
+{
+    std::mutex Mutex;
+    std::vector<ManifestEntry> Entries;
+
+public:
+    // hashes Data, the bytes just written to Path; safe to call from several threads
+    void Add(const std::string &Path, const void *Data, size_t Size, const std::string &KeySet, const std::string &Header, const std::string &InputDigest = "");
+    // writes the entries sorted by path, returns 0 on success
+    int Save(const std::string &filename);
+};
+
+#endif
@@ -0,0 +1,462 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+
+#include "memcard.h"
+
+static const char MC_MAGIC[] = "Sony PS2 Memory Card Format ";
+
+static int Parity(uint8_t b)
+{
+    b ^= b >> 4;
+    b ^= b >> 2;
+    b ^= b >> 1;
+    return b & 1;
+}
+
+void McEccCalculate(const uint8_t *Chunk, uint8_t *Ecc)
+{
+    // column parity bits of every byte value
+    static const struct ColumnMasks
+    {
+        uint8_t Mask[256];
+        ColumnMasks()
+        {
+            for (int b = 0; b < 256; b++) {
+                Mask[b] = (Parity(b & 0x55) << 0) | (Parity(b & 0x33) << 1) | (Parity(b & 0x0F) << 2) |
+                          (Parity(b & 0xAA) << 4) | (Parity(b & 0xCC) << 5) | (Parity(b & 0xF0) << 6);
+            }
+        }
+    } Columns;
+
+    uint8_t ColumnParity = 0x77;
+    uint8_t LineParity0  = 0x7F;
+    uint8_t LineParity1  = 0x7F;
+    for (int i = 0; i < 128; i++) {
+        ColumnParity ^= Columns.Mask[Chunk[i]];
+        if (Parity(Chunk[i])) {
+            LineParity0 ^= ~i;
+            LineParity1 ^= i;
+        }
+    }
+    Ecc[0] = ColumnParity;
+    Ecc[1] = LineParity0 & 0x7F;
+    Ecc[2] = LineParity1;
+}
+
+// current time as the PS2 keeps it, in JST
+static McTime GetMcTime()
+{
+    time_t now = time(NULL) + 9 * 60 * 60;
+    struct tm t;
+#ifdef _WIN32
+    gmtime_s(&t, &now);
+#else
+    gmtime_r(&now, &t);
+#endif
+    McTime Time;
+    Time.Unused = 0;
+    Time.Sec    = t.tm_sec;
+    Time.Min    = t.tm_min;
+    Time.Hour   = t.tm_hour;
+    Time.Day    = t.tm_mday;
+    Time.Month  = t.tm_mon + 1;
+    Time.Year   = t.tm_year + 1900;
+    return Time;
+}
+
+MemoryCard::MemoryCard()
+    : Super()
+    , ClusterSize(0)
+    , RawPageSize(0)
+    , NextFree(0)
+{
+}
+
+int MemoryCard::Open(const std::string &filename, bool Write)
+{
+    Image.open(filename, std::ios::binary | std::ios::in | (Write ? std::ios::out : std::ios::openmode()));
+    if (!Image.is_open())
+        return MC_ERROR_OPEN_FAILED;
+
+    Image.seekg(0, std::ios::end);
+    uint64_t ImageSize = Image.tellg();
+    Image.seekg(0);
+    if (!Image.read((char *)&Super, sizeof(Super)))
+        return MC_ERROR_NOT_A_CARD;
+
+    if (memcmp(Super.Magic, MC_MAGIC, sizeof(Super.Magic)) != 0 || Super.PageLen == 0 || Super.PageLen % 128 || Super.PagesPerCluster == 0)
+        return MC_ERROR_NOT_A_CARD;
+    ClusterSize = Super.PageLen * Super.PagesPerCluster;
+    if (ClusterSize % sizeof(McDirEntry) || Super.AllocOffset + Super.AllocEnd > Super.ClustersPerCard)
+        return MC_ERROR_NOT_A_CARD;
+
+    // raw dumps carry a spare area of PageLen / 32 bytes per page that holds the ECC
+    uint64_t Pages = (uint64_t)Super.ClustersPerCard * Super.PagesPerCluster;
+    if (ImageSize == Pages * (Super.PageLen + Super.PageLen / 32))
+        RawPageSize = Super.PageLen + Super.PageLen / 32;
+    else if (ImageSize == Pages * Super.PageLen)
+        RawPageSize = Super.PageLen;
+    else
+        return MC_ERROR_NOT_A_CARD;
+
+    return 0;
+}
+
+uint8_t *MemoryCard::GetCluster(uint32_t Absolute, bool ForWrite)
+{
+    if (Absolute >= Super.ClustersPerCard)
+        return NULL;
+
+    auto it = Cache.find(Absolute);
+    if (it == Cache.end()) {
+        Cluster c;
+        c.Data.resize(ClusterSize);
+        c.Dirty = false;
+        for (uint32_t p = 0; p < Super.PagesPerCluster; p++) {
+            Image.seekg(((uint64_t)Absolute * Super.PagesPerCluster + p) * RawPageSize);
+            if (!Image.read(&c.Data[p * Super.PageLen], Super.PageLen)) {
+                Image.clear();
+                return NULL;
+            }
+        }
+        it = Cache.emplace(Absolute, std::move(c)).first;
+    }
+    if (ForWrite)
+        it->second.Dirty = true;
+    return (uint8_t *)&it->second.Data[0];
+}
+
+uint32_t *MemoryCard::GetFatEntry(uint32_t Relative, bool ForWrite)
+{
+    // two levels: IfcList -> indirect FAT cluster -> FAT cluster -> entry
+    uint32_t PerCluster    = ClusterSize / 4;
+    uint32_t FatIndex      = Relative / PerCluster;
+    uint32_t IndirectIndex = FatIndex / PerCluster;
+    if (Relative >= Super.AllocEnd || IndirectIndex >= 32)
+        return NULL;
+
+    uint32_t *Indirect = (uint32_t *)GetCluster(Super.IfcList[IndirectIndex], false);
+    if (Indirect == NULL)
+        return NULL;
+    uint32_t *Fat = (uint32_t *)GetCluster(Indirect[FatIndex % PerCluster], ForWrite);
+    if (Fat == NULL)
+        return NULL;
+    return &Fat[Relative % PerCluster];
+}
+
+int MemoryCard::Allocate(uint32_t Previous, uint32_t &Relative)
+{
+    for (uint32_t n = NextFree; n < Super.AllocEnd; n++) {
+        uint32_t *Entry = GetFatEntry(n, false);
+        if (Entry == NULL)
+            return MC_ERROR_IO;
+        if (*Entry & MC_FAT_ALLOCATED)
+            continue;
+
+        *GetFatEntry(n, true) = MC_FAT_CHAIN_END;
+        if (Previous != MC_FAT_CHAIN_END)
+            *GetFatEntry(Previous, true) = MC_FAT_ALLOCATED | n;
+        NextFree = n + 1;
+        Relative = n;
+        return 0;
+    }
+    return MC_ERROR_CARD_FULL;
+}
+
+void MemoryCard::FreeChain(uint32_t First)
+{
+    uint32_t n = First;
+    for (uint32_t Steps = 0; Steps < Super.AllocEnd && n < Super.AllocEnd; Steps++) {
+        uint32_t *Entry = GetFatEntry(n, true);
+        if (Entry == NULL)
+            return;
+        uint32_t Next = *Entry;
+        *Entry        = MC_FAT_FREE;
+        NextFree      = std::min(NextFree, n);
+        if (Next == MC_FAT_CHAIN_END || !(Next & MC_FAT_ALLOCATED))
+            return;
+        n = Next & ~MC_FAT_ALLOCATED;
+    }
+}
+
+McDirEntry *MemoryCard::GetEntry(const DirRef &Dir, uint32_t Index, bool ForWrite)
+{
+    uint32_t PerCluster = ClusterSize / sizeof(McDirEntry);
+    uint32_t n          = Dir.Cluster;
+    for (uint32_t k = Index / PerCluster; k > 0; k--) {
+        uint32_t *Entry = GetFatEntry(n, false);
+        if (Entry == NULL || *Entry == MC_FAT_CHAIN_END || !(*Entry & MC_FAT_ALLOCATED))
+            return NULL;
+        n = *Entry & ~MC_FAT_ALLOCATED;
+    }
+
+    uint8_t *Data = GetCluster(Super.AllocOffset + n, ForWrite);
+    if (Data == NULL)
+        return NULL;
+    return (McDirEntry *)(Data + (Index % PerCluster) * sizeof(McDirEntry));
+}
+
+int MemoryCard::OpenRoot(DirRef &Dir)
+{
+    // the root has no parent, its "." entry keeps the length
+    Dir = {Super.RootdirCluster, 1, 0, 0, true};
+    McDirEntry *Dot = GetEntry(Dir, 0, false);
+    if (Dot == NULL || !(Dot->Mode & MC_DF_EXISTS))
+        return MC_ERROR_CORRUPT;
+    Dir.Length = Dot->Length;
+    return 0;
+}
+
+int MemoryCard::Lookup(const DirRef &Dir, const std::string &Name, uint32_t &Index)
+{
+    for (uint32_t i = 0; i < Dir.Length; i++) {
+        McDirEntry *Entry = GetEntry(Dir, i, false);
+        if (Entry == NULL)
+            return MC_ERROR_CORRUPT;
+        if ((Entry->Mode & MC_DF_EXISTS) && !strncmp(Entry->Name, Name.c_str(), sizeof(Entry->Name))) {
+            Index = i;
+            return 0;
+        }
+    }
+    return MC_ERROR_NOT_FOUND;
+}
+
+int MemoryCard::AddEntry(DirRef &Dir, uint32_t &Index)
+{
+    // slots of deleted entries are reused first
+    for (uint32_t i = 2; i < Dir.Length; i++) {
+        McDirEntry *Entry = GetEntry(Dir, i, true);
+        if (Entry == NULL)
+            return MC_ERROR_CORRUPT;
+        if (!(Entry->Mode & MC_DF_EXISTS)) {
+            memset(Entry, 0, sizeof(*Entry));
+            Index = i;
+            return 0;
+        }
+    }
+
+    Index = Dir.Length;
+    if (Index % (ClusterSize / sizeof(McDirEntry)) == 0) {
+        uint32_t Last = Dir.Cluster, Added;
+        for (uint32_t *Entry; (Entry = GetFatEntry(Last, false)) != NULL && *Entry != MC_FAT_CHAIN_END;)
+            Last = *Entry & ~MC_FAT_ALLOCATED;
+        int ret = Allocate(Last, Added);
+        if (ret != 0)
+            return ret;
+    }
+
+    McDirEntry *Entry = GetEntry(Dir, Index, true);
+    if (Entry == NULL)
+        return MC_ERROR_CORRUPT;
+    memset(Entry, 0, sizeof(*Entry));
+
+    DirRef Parent     = {Dir.ParentCluster, 0, 0, 0, false};
+    McDirEntry *Owner = Dir.Root ? GetEntry(Dir, 0, true) : GetEntry(Parent, Dir.IndexInParent, true);
+    if (Owner == NULL)
+        return MC_ERROR_CORRUPT;
+    Owner->Length = ++Dir.Length;
+    return 0;
+}
+
+int MemoryCard::MakeDirectory(DirRef &Parent, const std::string &Name, DirRef &Dir)
+{
+    uint32_t Index, Cluster;
+    int ret = AddEntry(Parent, Index);
+    if (ret == 0)
+        ret = Allocate(MC_FAT_CHAIN_END, Cluster);
+    if (ret != 0)
+        return ret;
+
+    uint8_t *Data = GetCluster(Super.AllocOffset + Cluster, true);
+    if (Data == NULL)
+        return MC_ERROR_IO;
+    memset(Data, 0, ClusterSize);
+
+    McTime Now       = GetMcTime();
+    McDirEntry *Dot  = (McDirEntry *)Data;
+    Dot->Mode        = MC_DF_READ | MC_DF_WRITE | MC_DF_EXECUTE | MC_DF_DIRECTORY | MC_DF_0400 | MC_DF_EXISTS;
+    Dot->Created     = Now;
+    Dot->Modified    = Now;
+    Dot->Cluster     = Parent.Cluster;
+    Dot->DirEntry    = Index;
+    strcpy(Dot->Name, ".");
+    McDirEntry *DotDot = Dot + 1;
+    DotDot->Mode       = MC_DF_WRITE | MC_DF_EXECUTE | MC_DF_DIRECTORY | MC_DF_0400 | MC_DF_HIDDEN | MC_DF_EXISTS;
+    DotDot->Created    = Now;
+    DotDot->Modified   = Now;
+    strcpy(DotDot->Name, "..");
+
+    McDirEntry *Entry = GetEntry(Parent, Index, true);
+    if (Entry == NULL)
+        return MC_ERROR_CORRUPT;
+    Entry->Mode     = MC_DF_READ | MC_DF_WRITE | MC_DF_EXECUTE | MC_DF_DIRECTORY | MC_DF_0400 | MC_DF_EXISTS;
+    Entry->Length   = 2;
+    Entry->Created  = Now;
+    Entry->Modified = Now;
+    Entry->Cluster  = Cluster;
+    strncpy(Entry->Name, Name.c_str(), sizeof(Entry->Name));
+
+    Dir = {Cluster, 2, Parent.Cluster, Index, false};
+    return 0;
+}
+
+int MemoryCard::ResolveParent(const std::string &path, bool Create, DirRef &Dir, std::string &Name)
+{
+    std::vector<std::string> Parts;
+    for (size_t start = 0, end; start <= path.size(); start = end + 1) {
+        end = std::min(path.find('/', start), path.size());
+        if (end > start)
+            Parts.push_back(path.substr(start, end - start));
+    }
+    if (Parts.empty())
+        return MC_ERROR_NOT_FOUND;
+    for (const std::string &Part : Parts) {
+        if (Part.size() >= sizeof(McDirEntry::Name))
+            return MC_ERROR_NOT_FOUND;
+    }
+    Name = Parts.back();
+    Parts.pop_back();
+
+    int ret = OpenRoot(Dir);
+    for (size_t i = 0; ret == 0 && i < Parts.size(); i++) {
+        uint32_t Index;
+        ret = Lookup(Dir, Parts[i], Index);
+        if (ret == MC_ERROR_NOT_FOUND && Create) {
+            DirRef Parent = Dir;
+            ret           = MakeDirectory(Parent, Parts[i], Dir);
+        } else if (ret == 0) {
+            McDirEntry *Entry = GetEntry(Dir, Index, false);
+            if (!(Entry->Mode & MC_DF_DIRECTORY))
+                return MC_ERROR_NOT_FOUND;
+            Dir = {Entry->Cluster, Entry->Length, Dir.Cluster, Index, false};
+        }
+    }
+    return ret;
+}
+
+int MemoryCard::ReadFile(const std::string &path, std::string &Data)
+{
+    DirRef Dir;
+    std::string Name;
+    uint32_t Index;
+    int ret = ResolveParent(path, false, Dir, Name);
+    if (ret == 0)
+        ret = Lookup(Dir, Name, Index);
+    if (ret != 0)
+        return ret;
+
+    McDirEntry *Entry = GetEntry(Dir, Index, false);
+    if (!(Entry->Mode & MC_DF_FILE))
+        return MC_ERROR_NOT_A_FILE;
+
+    Data.resize(Entry->Length);
+    uint32_t n = Entry->Cluster;
+    for (size_t done = 0; done < Data.size(); done += ClusterSize) {
+        uint8_t *Cluster = n < Super.AllocEnd ? GetCluster(Super.AllocOffset + n, false) : NULL;
+        if (Cluster == NULL)
+            return MC_ERROR_CORRUPT;
+        memcpy(&Data[done], Cluster, std::min<size_t>(ClusterSize, Data.size() - done));
+
+        uint32_t *Next = GetFatEntry(n, false);
+        if (Next == NULL)
+            return MC_ERROR_CORRUPT;
+        n = *Next == MC_FAT_CHAIN_END ? MC_FAT_CHAIN_END : *Next & ~MC_FAT_ALLOCATED;
+    }
+    return 0;
+}
+
+int MemoryCard::WriteFile(const std::string &path, const std::string &Data)
+{
+    DirRef Dir;
+    std::string Name;
+    uint32_t Index;
+    int ret = ResolveParent(path, true, Dir, Name);
+    if (ret != 0)
+        return ret;
+
+    McTime Now     = GetMcTime();
+    McTime Created = Now;
+    ret            = Lookup(Dir, Name, Index);
+    if (ret == 0) {
+        // replaced in place, the old clusters go back to the FAT first
+        McDirEntry *Entry = GetEntry(Dir, Index, false);
+        if (!(Entry->Mode & MC_DF_FILE))
+            return MC_ERROR_NOT_A_FILE;
+        Created = Entry->Created;
+        if (Entry->Length)
+            FreeChain(Entry->Cluster);
+    } else if (ret == MC_ERROR_NOT_FOUND) {
+        ret = AddEntry(Dir, Index);
+    }
+    if (ret != 0)
+        return ret;
+
+    uint32_t First = MC_FAT_CHAIN_END, Previous = MC_FAT_CHAIN_END;
+    for (size_t done = 0; done < Data.size(); done += ClusterSize) {
+        uint32_t n;
+        ret = Allocate(Previous, n);
+        if (ret != 0)
+            return ret;
+        uint8_t *Cluster = GetCluster(Super.AllocOffset + n, true);
+        if (Cluster == NULL)
+            return MC_ERROR_IO;
+        size_t Size = std::min<size_t>(ClusterSize, Data.size() - done);
+        memcpy(Cluster, &Data[done], Size);
+        memset(Cluster + Size, 0, ClusterSize - Size);
+        if (First == MC_FAT_CHAIN_END)
+            First = n;
+        Previous = n;
+    }
+
+    McDirEntry *Entry = GetEntry(Dir, Index, true);
+    if (Entry == NULL)
+        return MC_ERROR_CORRUPT;
+    memset(Entry, 0, sizeof(*Entry));
+    Entry->Mode     = MC_DF_READ | MC_DF_WRITE | MC_DF_EXECUTE | MC_DF_FILE | MC_DF_0080 | MC_DF_0400 | MC_DF_EXISTS;
+    Entry->Length   = Data.size();
+    Entry->Created  = Created;
+    Entry->Modified = Now;
+    Entry->Cluster  = First;
+    strncpy(Entry->Name, Name.c_str(), sizeof(Entry->Name));
+    return 0;
+}
+
+int MemoryCard::Flush()
+{
+    std::string Page(RawPageSize, 0);
+    for (auto &it : Cache) {
+        if (!it.second.Dirty)
+            continue;
+        for (uint32_t p = 0; p < Super.PagesPerCluster; p++) {
+            const uint8_t *Data = (const uint8_t *)&it.second.Data[p * Super.PageLen];
+            memcpy(&Page[0], Data, Super.PageLen);
+            if (RawPageSize > Super.PageLen) {
+                memset(&Page[Super.PageLen], 0, RawPageSize - Super.PageLen);
+                for (uint32_t c = 0; c < Super.PageLen / 128; c++)
+                    McEccCalculate(Data + c * 128, (uint8_t *)&Page[Super.PageLen + c * 3]);
+            }
+            Image.seekp(((uint64_t)it.first * Super.PagesPerCluster + p) * RawPageSize);
+            Image.write(Page.data(), Page.size());
+        }
+        it.second.Dirty = false;
+    }
+    Image.flush();
+    return Image ? 0 : MC_ERROR_IO;
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __MEMCARD_H__
+#define __MEMCARD_H__
+
+#include <stdint.h>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#define MC_ERROR_OPEN_FAILED -300
+#define MC_ERROR_NOT_A_CARD  -301
+#define MC_ERROR_NOT_FOUND   -302
+#define MC_ERROR_NOT_A_FILE  -303
+#define MC_ERROR_CARD_FULL   -304
+#define MC_ERROR_IO          -305
+#define MC_ERROR_CORRUPT     -306
+
+#pragma pack(push, 1)
+struct McSuperblock
+{
+    char Magic[28]; // "Sony PS2 Memory Card Format "
+    char Version[12];
+    uint16_t PageLen;
+    uint16_t PagesPerCluster;
+    uint16_t PagesPerBlock;
+    uint16_t Unused0;
+    uint32_t ClustersPerCard;
+    uint32_t AllocOffset; // first cluster of the allocatable area, FAT cluster numbers are relative to it
+    uint32_t AllocEnd;    // number of allocatable clusters
+    uint32_t RootdirCluster;
+    uint32_t BackupBlock1;
+    uint32_t BackupBlock2;
+    uint8_t Unused1[8];
+    uint32_t IfcList[32]; // indirect FAT clusters, absolute
+    int32_t BadBlockList[32];
+    uint8_t CardType;
+    uint8_t CardFlags;
+};
+
+struct McTime
+{
+    uint8_t Unused;
+    uint8_t Sec;
+    uint8_t Min;
+    uint8_t Hour;
+    uint8_t Day;
+    uint8_t Month;
+    uint16_t Year;
+};
+
+struct McDirEntry
+{
+    uint16_t Mode;
+    uint16_t Unused0;
+    uint32_t Length; // bytes for files, entries for directories
+    McTime Created;
+    uint32_t Cluster;  // first cluster, relative to AllocOffset
+    uint32_t DirEntry; // "." only: index of the directory in its parent
+    McTime Modified;
+    uint32_t Attr;
+    uint8_t Unused1[28];
+    char Name[32];
+    uint8_t Unused2[416];
+};
+#pragma pack(pop)
+
+// McDirEntry.Mode
+#define MC_DF_READ      0x0001
+#define MC_DF_WRITE     0x0002
+#define MC_DF_EXECUTE   0x0004
+#define MC_DF_PROTECTED 0x0008
+#define MC_DF_FILE      0x0010
+#define MC_DF_DIRECTORY 0x0020
+#define MC_DF_0080      0x0080
+#define MC_DF_0400      0x0400
+#define MC_DF_HIDDEN    0x2000
+#define MC_DF_EXISTS    0x8000
+
+// FAT entries
+#define MC_FAT_ALLOCATED 0x80000000
+#define MC_FAT_CHAIN_END 0xFFFFFFFF
+#define MC_FAT_FREE      0x7FFFFFFF
+
+// Raw PS2 memory card image (8 MB cards, with or without the 16 byte ECC spare area per page).
+// Clusters are read on demand and cached; Flush writes back only the clusters that changed,
+// with their ECC recomputed, so injecting a file leaves the rest of the image untouched.
+class MemoryCard
+{
+    struct Cluster
+    {
+        std::string Data;
+        bool Dirty;
+    };
+
+    // a directory and where its length is kept
+    struct DirRef
+    {
+        uint32_t Cluster;
+        uint32_t Length;
+        uint32_t ParentCluster;
+        uint32_t IndexInParent;
+        bool Root;
+    };
+
+    std::fstream Image;
+    McSuperblock Super;
+    uint32_t ClusterSize;
+    uint32_t RawPageSize; // PageLen plus the spare area if the image has one
+    uint32_t NextFree;
+    std::map<uint32_t, Cluster> Cache; // absolute cluster number -> contents
+
+    uint8_t *GetCluster(uint32_t Absolute, bool ForWrite);
+    uint32_t *GetFatEntry(uint32_t Relative, bool ForWrite);
+    int Allocate(uint32_t Previous, uint32_t &Relative);
+    void FreeChain(uint32_t First);
+    McDirEntry *GetEntry(const DirRef &Dir, uint32_t Index, bool ForWrite);
+    int OpenRoot(DirRef &Dir);
+    int Lookup(const DirRef &Dir, const std::string &Name, uint32_t &Index);
+    int AddEntry(DirRef &Dir, uint32_t &Index);
+    int MakeDirectory(DirRef &Parent, const std::string &Name, DirRef &Dir);
+    int ResolveParent(const std::string &path, bool Create, DirRef &Dir, std::string &Name);
+
+public:
+    MemoryCard();
+
+    // Write opens the image for in-place updates
+    int Open(const std::string &filename, bool Write);
+    int ReadFile(const std::string &path, std::string &Data);
+    // creates or replaces path, missing directories are created; after an error the card
+    // must be dropped without Flush
+    int WriteFile(const std::string &path, const std::string &Data);
+    // writes the changed clusters back to the image
+    int Flush();
+};
+
+// 3 byte Hamming code of one 128 byte chunk, as stored in the spare area of each page
+void McEccCalculate(const uint8_t *Chunk, uint8_t *Ecc);
+
+#endif
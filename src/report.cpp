@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+
+#include "report.h"
+#include "fileio.h"
+
+static std::string JsonString(const std::string &s)
+{
+    std::string out = "\"";
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c < 0x20) {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            out += esc;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+int BatchReport::Save(const std::string &filename) const
+{
+    int Failed = 0;
+    for (const ReportEntry &e : Files)
+        Failed += e.Result != 0;
+
+    FILE *f = fopen(filename.c_str(), "w");
+    if (f == NULL)
+        return REPORT_ERROR_OPEN_FAILED;
+    fprintf(f, "{\"mode\":%s,\"keyset\":%s,\"shard\":%u,\"shards\":%u,\"total\":%zu,\"failed\":%d,\"files\":[", JsonString(Mode).c_str(),
+            JsonString(KeySet).c_str(), Shard, Shards, Files.size(), Failed);
+    for (size_t i = 0; i < Files.size(); i++)
+        fprintf(f, "%s\n{\"path\":%s,\"result\":%d}", i ? "," : "", JsonString(Files[i].Path).c_str(), Files[i].Result);
+    fprintf(f, "\n]}\n");
+    return fclose(f) == 0 ? 0 : REPORT_ERROR_OPEN_FAILED;
+}
+
+// just enough JSON for the reports written above: objects, arrays, strings and integers
+class ReportParser
+{
+    const std::string &Text;
+    size_t Pos = 0;
+
+    void SkipSpace()
+    {
+        while (Pos < Text.size() && (Text[Pos] == ' ' || Text[Pos] == '\t' || Text[Pos] == '\r' || Text[Pos] == '\n'))
+            Pos++;
+    }
+
+    bool Expect(char c)
+    {
+        SkipSpace();
+        if (Pos >= Text.size() || Text[Pos] != c)
+            return false;
+        Pos++;
+        return true;
+    }
+
+    bool Peek(char c)
+    {
+        SkipSpace();
+        return Pos < Text.size() && Text[Pos] == c;
+    }
+
+    bool String(std::string &s)
+    {
+        s.clear();
+        if (!Expect('"'))
+            return false;
+        while (Pos < Text.size() && Text[Pos] != '"') {
+            char c = Text[Pos++];
+            if (c == '\\' && Pos < Text.size()) {
+                c = Text[Pos++];
+                if (c == 'u' && Pos + 4 <= Text.size()) {
+                    c = (char)strtoul(Text.substr(Pos, 4).c_str(), NULL, 16);
+                    Pos += 4;
+                } else if (c == 'n') {
+                    c = '\n';
+                } else if (c == 't') {
+                    c = '\t';
+                }
+            }
+            s += c;
+        }
+        return Expect('"');
+    }
+
+    bool Number(long long &n)
+    {
+        SkipSpace();
+        char *end;
+        n = strtoll(Text.c_str() + Pos, &end, 10);
+        if (end == Text.c_str() + Pos)
+            return false;
+        Pos = end - Text.c_str();
+        return true;
+    }
+
+    // calls Member for every "key": of an object, which has to consume the value
+    template <typename F>
+    bool Object(F Member)
+    {
+        if (!Expect('{'))
+            return false;
+        if (Expect('}'))
+            return true;
+        do {
+            std::string Key;
+            if (!String(Key) || !Expect(':') || !Member(Key))
+                return false;
+        } while (Expect(','));
+        return Expect('}');
+    }
+
+    // skips a value of a member the reader does not know
+    bool Skip()
+    {
+        std::string s;
+        long long n;
+        if (Peek('"'))
+            return String(s);
+        if (Peek('{'))
+            return Object([this](const std::string &) { return Skip(); });
+        if (Peek('[')) {
+            Expect('[');
+            if (Expect(']'))
+                return true;
+            do {
+                if (!Skip())
+                    return false;
+            } while (Expect(','));
+            return Expect(']');
+        }
+        return Number(n);
+    }
+
+public:
+    explicit ReportParser(const std::string &text)
+        : Text(text)
+    {
+    }
+
+    bool Parse(BatchReport &Report)
+    {
+        bool ok = Object([&](const std::string &Key) {
+            long long n;
+            if (Key == "mode")
+                return String(Report.Mode);
+            if (Key == "keyset")
+                return String(Report.KeySet);
+            if (Key == "shard" || Key == "shards") {
+                if (!Number(n) || n < 0)
+                    return false;
+                (Key == "shard" ? Report.Shard : Report.Shards) = (unsigned)n;
+                return true;
+            }
+            if (Key != "files")
+                return Skip();
+
+            if (!Expect('['))
+                return false;
+            if (Expect(']'))
+                return true;
+            do {
+                ReportEntry Entry = {"", 0};
+                bool entry        = Object([&](const std::string &Field) {
+                    if (Field == "path")
+                        return String(Entry.Path);
+                    if (Field == "result") {
+                        if (!Number(n))
+                            return false;
+                        Entry.Result = (int)n;
+                        return true;
+                    }
+                    return Skip();
+                });
+                if (!entry)
+                    return false;
+                Report.Files.push_back(Entry);
+            } while (Expect(','));
+            return Expect(']');
+        });
+        SkipSpace();
+        return ok && Pos == Text.size();
+    }
+};
+
+int BatchReport::Load(const std::string &filename)
+{
+    std::string Text;
+    if (ReadWholeFile(filename, Text) != 0)
+        return REPORT_ERROR_OPEN_FAILED;
+
+    *this = BatchReport();
+    if (!ReportParser(Text).Parse(*this) || Shards == 0 || Shard >= Shards)
+        return REPORT_ERROR_PARSE;
+    return 0;
+}
+
+unsigned GetShard(const std::string &RelativePath, unsigned Shards)
+{
+    uint64_t Hash = 0xcbf29ce484222325ull;
+    for (unsigned char c : RelativePath) {
+        Hash ^= c;
+        Hash *= 0x100000001b3ull;
+    }
+    return Shards ? Hash % Shards : 0;
+}
+
+int MergeReports(const std::vector<BatchReport> &Parts, BatchReport &Merged)
+{
+    Merged = BatchReport();
+    if (Parts.empty())
+        return REPORT_ERROR_MISMATCH;
+
+    std::vector<bool> Seen(Parts[0].Shards, false);
+    Merged.Mode   = Parts[0].Mode;
+    Merged.KeySet = Parts[0].KeySet;
+    for (const BatchReport &Part : Parts) {
+        if (Part.Mode != Merged.Mode || Part.KeySet != Merged.KeySet || Part.Shards != Seen.size()) {
+            fprintf(stderr, "Reports come from different runs\n");
+            return REPORT_ERROR_MISMATCH;
+        }
+        if (Seen[Part.Shard]) {
+            fprintf(stderr, "Shard %u/%u given twice\n", Part.Shard, Part.Shards);
+            return REPORT_ERROR_MISMATCH;
+        }
+        Seen[Part.Shard] = true;
+        Merged.Files.insert(Merged.Files.end(), Part.Files.begin(), Part.Files.end());
+    }
+    for (size_t i = 0; i < Seen.size(); i++) {
+        if (!Seen[i]) {
+            fprintf(stderr, "Shard %zu/%zu is missing\n", i, Seen.size());
+            return REPORT_ERROR_MISMATCH;
+        }
+    }
+
+    std::sort(Merged.Files.begin(), Merged.Files.end(), [](const ReportEntry &a, const ReportEntry &b) { return a.Path < b.Path; });
+    for (size_t i = 1; i < Merged.Files.size(); i++) {
+        if (Merged.Files[i].Path == Merged.Files[i - 1].Path) {
+            fprintf(stderr, "%s was processed by more than one shard\n", Merged.Files[i].Path.c_str());
+            return REPORT_ERROR_MISMATCH;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __REPORT_H__
+#define __REPORT_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#define REPORT_ERROR_OPEN_FAILED -500
+#define REPORT_ERROR_PARSE       -501
+#define REPORT_ERROR_MISMATCH    -502
+
+struct ReportEntry
+{
+    std::string Path; // relative to the batch input, '/' separated
+    int Result;
+};
+
+// Outcome of one batch run, possibly over one shard of the inputs, saved as JSON:
+// {"mode":"verify","keyset":"retail","shard":0,"shards":4,"total":2,"failed":0,"files":[{"path":"a/b.kelf","result":0},...]}
+struct BatchReport
+{
+    std::string Mode;
+    std::string KeySet;
+    unsigned Shard  = 0;
+    unsigned Shards = 1;
+    std::vector<ReportEntry> Files;
+
+    int Save(const std::string &filename) const;
+    int Load(const std::string &filename);
+};
+
+// shard of a relative input path, FNV-1a so every host and every run agrees on it
+unsigned GetShard(const std::string &RelativePath, unsigned Shards);
+
+// combines the reports of shards 0..n-1 of one run; fails unless every shard is there exactly once
+// and no file was processed twice. Merged is the report of an unsharded run
+int MergeReports(const std::vector<BatchReport> &Parts, BatchReport &Merged);
+
+#endif
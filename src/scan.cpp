@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SCAN_SSE2
+#endif
+
+#include "scan.h"
+#include "kelf.h"
+#include "fileio.h"
+
+// the header signature follows the fixed header when there is no ID list, so this is what most candidate checks need
+#define SCAN_WINDOW (sizeof(KELFHeader) + 8)
+
+static bool IsKnownUserHeader(const uint8_t *p)
+{
+    return GetHeaderId(p) != HEADER::INVALID;
+}
+
+static bool IsPlausibleHeader(const KELFHeader &header)
+{
+    if (header.gap[0] || header.gap[1] || header.gap[2])
+        return false;
+    if (header.SystemType > SYSTEM_TYPE_PSX)
+        return false;
+    // exactly one of single/triple DES, nothing in the never seen high bits
+    if (!(header.Flags & HDR_FLAG4_1DES) == !(header.Flags & HDR_FLAG4_3DES))
+        return false;
+    if (header.Flags & (HDR_FLAG11 | HDR_FLAG12 | HDR_FLAG13 | HDR_FLAG14 | HDR_FLAG15))
+        return false;
+
+    // header + ID list (BitCount entries, whatever the flags, like LoadKelfHeader) + header signature + Kbit + Kc + bit table header + two signatures, then 16 bytes per block
+    size_t fixed = sizeof(KELFHeader) + header.BitCount * sizeof(KELFConsoleID) + 8 + 16 + 16 + 8 + 8 + 8;
+    if (header.HeaderSize < fixed + 16 || header.HeaderSize > fixed + 16 * 256)
+        return false;
+    return (header.HeaderSize - fixed) % 16 == 0;
+}
+
+// cheap byte tests shared by every candidate: the gap is zero and exactly one DES flag is set,
+// or UserDefined starts like all of the known headers
+static inline bool Prefilter(const uint8_t *p)
+{
+    bool structural = !p[0x1D] && !p[0x1E] && !p[0x1F] && ((p[0x18] & 0x30) == 0x10 || (p[0x18] & 0x30) == 0x20);
+    bool known      = p[0] == 0x01 && p[1] == 0x00 && p[2] == 0x00;
+    return structural || known;
+}
+
+#ifdef SCAN_SSE2
+// Prefilter for 16 consecutive offsets at once, returns one bit per offset
+static inline unsigned Prefilter16(const uint8_t *p)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i des        = _mm_and_si128(_mm_loadu_si128((const __m128i *)(p + 0x18)), _mm_set1_epi8(0x30));
+    __m128i structural = _mm_or_si128(_mm_cmpeq_epi8(des, _mm_set1_epi8(0x10)), _mm_cmpeq_epi8(des, _mm_set1_epi8(0x20)));
+    structural         = _mm_and_si128(structural, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 0x1D)), zero));
+    structural         = _mm_and_si128(structural, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 0x1E)), zero));
+    structural         = _mm_and_si128(structural, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 0x1F)), zero));
+
+    __m128i known = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), _mm_set1_epi8(0x01));
+    known         = _mm_and_si128(known, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 1)), zero));
+    known         = _mm_and_si128(known, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 2)), zero));
+
+    return _mm_movemask_epi8(_mm_or_si128(structural, known));
+}
+#endif
+
+class ImageScanner
+{
+    const std::string &Filename;
+    std::shared_ptr<const KeyStore> ks;
+    uint64_t ImageSize;
+    uint64_t ChunkSize;
+    std::atomic<uint64_t> NextChunk;
+    std::mutex ResultsMutex;
+    std::vector<ScanResult> &Results;
+
+    struct Candidate
+    {
+        uint64_t Offset;
+        bool Known;
+        std::string Signed; // header, ID list and HeaderSignature
+    };
+
+    void Collect(const uint8_t *p, uint64_t Offset, std::vector<Candidate> &Candidates)
+    {
+        KELFHeader header;
+        memcpy(&header, p, sizeof(header));
+        bool known = IsKnownUserHeader(p);
+        if (!known && !IsPlausibleHeader(header))
+            return;
+
+        Candidate candidate;
+        candidate.Offset = Offset;
+        candidate.Known  = known;
+        candidate.Signed.assign((const char *)p, SCAN_WINDOW);
+        // the ID list usually reaches past the scan window
+        if (header.BitCount && ReadFileRange(Filename, Offset, sizeof(KELFHeader) + header.BitCount * sizeof(KELFConsoleID) + 8, candidate.Signed) != 0)
+            return;
+        if (candidate.Signed.size() < sizeof(KELFHeader) + header.BitCount * sizeof(KELFConsoleID) + 8)
+            return;
+        Candidates.push_back(std::move(candidate));
+    }
+
+    void Check(Kelf &kelf, std::vector<Candidate> &Candidates)
+    {
+        for (const Candidate &candidate : Candidates) {
+            KELFHeader header;
+            memcpy(&header, candidate.Signed.data(), sizeof(header));
+            Block8 Signature = kelf.GetHeaderSignature(header, candidate.Signed.data() + sizeof(KELFHeader));
+
+            ScanResult result;
+            result.Offset   = candidate.Offset;
+            result.HeaderId = GetHeaderId(header.UserDefined);
+            result.Size     = 0;
+            result.Status   = SCAN_STATUS_CANDIDATE;
+
+            if (!memcmp(Signature.data(), candidate.Signed.data() + candidate.Signed.size() - 8, 8)) {
+                result.Status = SCAN_STATUS_HEADER;
+
+                // confirmed, now the bit table tells the size
+                std::string Data;
+                if (ReadFileRange(Filename, candidate.Offset, header.HeaderSize, Data) == 0 && kelf.LoadKelfHeader(Data) == 0) {
+                    result.Status = SCAN_STATUS_VALID;
+                    result.Size   = header.HeaderSize + kelf.GetContentSize();
+                }
+            } else if (!candidate.Known) {
+                // structure alone matches far too much random data to be worth reporting
+                continue;
+            }
+
+            std::lock_guard<std::mutex> lock(ResultsMutex);
+            Results.push_back(result);
+        }
+    }
+
+    void ScanChunk(Kelf &kelf, uint64_t Start, std::string &Buffer)
+    {
+        uint64_t End = std::min(Start + ChunkSize, ImageSize);
+        // the last candidates of the chunk need their window from the next one
+        if (ReadFileRange(Filename, Start, End - Start + SCAN_WINDOW + 16, Buffer) != 0)
+            return;
+
+        const uint8_t *base = (const uint8_t *)Buffer.data();
+        size_t Count        = End - Start;
+        size_t Limit        = Buffer.size() >= SCAN_WINDOW ? Buffer.size() - SCAN_WINDOW + 1 : 0;
+        Count               = std::min(Count, Limit);
+
+        std::vector<Candidate> Candidates;
+        size_t i = 0;
+#ifdef SCAN_SSE2
+        for (; i + 16 + SCAN_WINDOW <= Buffer.size() && i + 16 <= Count; i += 16) {
+            unsigned mask = Prefilter16(base + i);
+            while (mask) {
+                unsigned bit = 0;
+                while (!(mask & (1u << bit)))
+                    bit++;
+                mask &= mask - 1;
+                Collect(base + i + bit, Start + i + bit, Candidates);
+            }
+        }
+#endif
+        for (; i < Count; i++) {
+            if (Prefilter(base + i))
+                Collect(base + i, Start + i, Candidates);
+        }
+        Check(kelf, Candidates);
+    }
+
+public:
+    ImageScanner(const std::string &filename, std::shared_ptr<const KeyStore> _ks, uint64_t imageSize, uint64_t chunkSize, std::vector<ScanResult> &results)
+        : Filename(filename)
+        , ks(_ks)
+        , ImageSize(imageSize)
+        , ChunkSize(chunkSize)
+        , NextChunk(0)
+        , Results(results)
+    {
+    }
+
+    void Run()
+    {
+        Kelf kelf(ks);
+        std::string Buffer;
+        for (;;) {
+            uint64_t Start = NextChunk.fetch_add(ChunkSize);
+            if (Start >= ImageSize)
+                break;
+            ScanChunk(kelf, Start, Buffer);
+        }
+    }
+};
+
+int ScanImage(const std::string &filename, std::shared_ptr<const KeyStore> ks, const ScanOptions &Options, std::vector<ScanResult> &Results)
+{
+    std::error_code ec;
+    uint64_t ImageSize = std::filesystem::file_size(filename, ec);
+    if (ec) {
+        fprintf(stderr, "Couldn't open %s: %s\n", filename.c_str(), ec.message().c_str());
+        return FILEIO_ERROR_OPEN_FAILED;
+    }
+
+    unsigned Threads = Options.Threads ? Options.Threads : std::thread::hardware_concurrency();
+    if (Threads == 0)
+        Threads = 1;
+
+    ImageScanner scanner(filename, ks, ImageSize, std::max<uint64_t>(Options.ChunkSize, 4096), Results);
+    std::vector<std::thread> Pool;
+    for (unsigned i = 0; i < Threads; i++)
+        Pool.emplace_back([&scanner] { scanner.Run(); });
+    for (std::thread &t : Pool)
+        t.join();
+
+    std::sort(Results.begin(), Results.end(), [](const ScanResult &a, const ScanResult &b) { return a.Offset < b.Offset; });
+    return 0;
+}
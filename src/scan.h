@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __SCAN_H__
+#define __SCAN_H__
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "keystore.h"
+
+#define SCAN_STATUS_CANDIDATE 0 // looks like a header, signature does not match
+#define SCAN_STATUS_HEADER    1 // header signature matches
+#define SCAN_STATUS_VALID     2 // header and bit table signatures match, Size is known
+
+struct ScanResult
+{
+    uint64_t Offset;
+    int HeaderId;  // HEADER enum, INVALID for unknown UserDefined
+    uint64_t Size; // whole KELF, 0 unless SCAN_STATUS_VALID
+    int Status;
+};
+
+struct ScanOptions
+{
+    unsigned Threads   = 0; // 0 = one per cpu
+    uint64_t ChunkSize = 16 * 1024 * 1024;
+};
+
+// Sweeps a raw image for KELF headers, chunks are searched in parallel
+int ScanImage(const std::string &filename, std::shared_ptr<const KeyStore> ks, const ScanOptions &Options, std::vector<ScanResult> &Results);
+
+#endif
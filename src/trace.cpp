@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "trace.h"
+
+std::atomic<bool> GTraceEnabled(false);
+
+struct TraceRecord
+{
+    const char *Name;
+    char Phase;
+    uint64_t Time; // ns since TraceStart
+    uint64_t Bytes;
+};
+
+struct ThreadTrace
+{
+    uint32_t Tid;
+    std::vector<TraceRecord> Records;
+};
+
+static std::mutex TraceMutex;
+static std::vector<std::shared_ptr<ThreadTrace>> TraceThreads; // kept after their thread exits
+static std::chrono::steady_clock::time_point TraceEpoch;
+
+// the buffer of the calling thread, registered on its first event
+static ThreadTrace &GetThreadTrace()
+{
+    thread_local std::shared_ptr<ThreadTrace> Trace;
+    if (!Trace) {
+        Trace = std::make_shared<ThreadTrace>();
+        Trace->Records.reserve(4096);
+        std::lock_guard<std::mutex> lock(TraceMutex);
+        Trace->Tid = (uint32_t)TraceThreads.size() + 1;
+        TraceThreads.push_back(Trace);
+    }
+    return *Trace;
+}
+
+void TraceEvent(const char *Name, char Phase, uint64_t Bytes)
+{
+    uint64_t Time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - TraceEpoch).count();
+    GetThreadTrace().Records.push_back({Name, Phase, Time, Bytes});
+}
+
+void TraceStart()
+{
+    TraceEpoch = std::chrono::steady_clock::now();
+    GetThreadTrace(); // the caller becomes tid 1, "main"
+    GTraceEnabled.store(true);
+}
+
+int TraceWrite(const std::string &filename)
+{
+    GTraceEnabled.store(false);
+
+    FILE *f = fopen(filename.c_str(), "w");
+    if (f == NULL)
+        return -1;
+
+    std::lock_guard<std::mutex> lock(TraceMutex);
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = true;
+    for (const auto &thread : TraceThreads) {
+        std::string Name = thread->Tid == 1 ? "main" : "worker " + std::to_string(thread->Tid - 1);
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", thread->Tid, Name.c_str());
+        first = false;
+        for (const TraceRecord &r : thread->Records) {
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%u,\"ts\":%llu.%03u",
+                    r.Name, r.Phase, thread->Tid, (unsigned long long)(r.Time / 1000), (unsigned)(r.Time % 1000));
+            if (r.Bytes)
+                fprintf(f, ",\"args\":{\"bytes\":%llu}", (unsigned long long)r.Bytes);
+            fprintf(f, "}");
+        }
+    }
+    fprintf(f, "\n]}\n");
+
+    return fclose(f) == 0 ? 0 : -1;
+}
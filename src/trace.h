@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+// Timeline of the hot paths in Chrome trace-event format (chrome://tracing, Perfetto).
+// Every thread records into its own buffer, so tracing adds no locking to the workers.
+
+extern std::atomic<bool> GTraceEnabled;
+
+// Name must be a string literal, it is stored as a pointer
+void TraceEvent(const char *Name, char Phase, uint64_t Bytes);
+
+// starts recording, events before this call are dropped
+void TraceStart();
+// writes everything recorded so far, returns 0 on success
+int TraceWrite(const std::string &filename);
+
+// records a begin event now and the matching end event when it goes out of scope
+class TraceScope
+{
+    const char *Name;
+    bool Active;
+
+public:
+    explicit TraceScope(const char *name, uint64_t Bytes = 0)
+        : Name(name)
+        , Active(GTraceEnabled.load(std::memory_order_relaxed))
+    {
+        if (Active)
+            TraceEvent(Name, 'B', Bytes);
+    }
+
+    ~TraceScope()
+    {
+        if (Active)
+            TraceEvent(Name, 'E', 0);
+    }
+
+    TraceScope(const TraceScope &)            = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+};
+
+#endif
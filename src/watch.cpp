@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "watch.h"
+#include "batch.h"
+
+#ifdef __linux__
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+int WatchDirectory(const std::string &Dir, const WatchOptions &Options, const WatchHandler &Handler)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0)
+        return WATCH_ERROR_WATCH_FAILED;
+    // IN_MODIFY only pushes the deadline back, the file is never taken while it is still written
+    if (inotify_add_watch(fd, Dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY) < 0) {
+        fprintf(stderr, "Couldn't watch %s: %s\n", Dir.c_str(), strerror(errno));
+        close(fd);
+        return WATCH_ERROR_WATCH_FAILED;
+    }
+
+    // a worker that finishes a name wakes the loop through this pipe, so a rewrite that came in
+    // meanwhile is handed out without polling
+    int Wake[2];
+    if (pipe2(Wake, O_CLOEXEC | O_NONBLOCK) < 0) {
+        close(fd);
+        return WATCH_ERROR_WATCH_FAILED;
+    }
+
+    // names a worker is on, a name is never handed out twice at once, the second job
+    // would write the same output
+    std::mutex RunningMutex;
+    std::unordered_set<std::string> Running;
+    auto IsRunning = [&](const std::string &name) {
+        std::lock_guard<std::mutex> lock(RunningMutex);
+        return Running.count(name) != 0;
+    };
+
+    // the workers stay up for the whole run, so every file finds them warm
+    BoundedQueue<std::string> Ready(1024);
+    unsigned Workers = Options.Jobs ? Options.Jobs : std::thread::hardware_concurrency();
+    std::vector<std::thread> Pool;
+    for (unsigned i = 0; i < std::max(1u, Workers); i++) {
+        Pool.emplace_back([&] {
+            std::string name;
+            while (Ready.Pop(name)) {
+                Handler(Dir + "/" + name);
+                {
+                    std::lock_guard<std::mutex> lock(RunningMutex);
+                    Running.erase(name);
+                }
+                // a full pipe means the loop is woken already
+                char c    = 0;
+                ssize_t n = write(Wake[1], &c, 1);
+                (void)n;
+            }
+        });
+    }
+
+    // name -> time it may be handed out, only files that were closed or moved in are due
+    struct PendingFile
+    {
+        Clock::time_point Due;
+        bool Complete;
+    };
+    std::unordered_map<std::string, PendingFile> Pending;
+    const auto Debounce = std::chrono::milliseconds(Options.DebounceMs);
+
+    alignas(struct inotify_event) char Buffer[64 * 1024];
+    int ret = 0;
+    for (;;) {
+        int timeout = -1;
+        auto now    = Clock::now();
+        for (const auto &it : Pending) {
+            if (!it.second.Complete || IsRunning(it.first))
+                continue;
+            int left = (int)std::chrono::duration_cast<std::chrono::milliseconds>(it.second.Due - now).count();
+            timeout  = timeout < 0 ? std::max(left, 0) : std::min(timeout, std::max(left, 0));
+        }
+
+        struct pollfd pfd[2] = {{fd, POLLIN, 0}, {Wake[0], POLLIN, 0}};
+        if (poll(pfd, 2, timeout) < 0 && errno != EINTR) {
+            ret = WATCH_ERROR_WATCH_FAILED;
+            break;
+        }
+        if (pfd[1].revents & POLLIN) {
+            char Drain[64];
+            while (read(Wake[0], Drain, sizeof(Drain)) > 0)
+                continue;
+        }
+
+        if (pfd[0].revents & POLLIN) {
+            ssize_t len = read(fd, Buffer, sizeof(Buffer));
+            if (len < 0 && errno != EINTR && errno != EAGAIN) {
+                ret = WATCH_ERROR_WATCH_FAILED;
+                break;
+            }
+            now = Clock::now();
+            for (ssize_t off = 0; off < len;) {
+                const struct inotify_event *ev = (const struct inotify_event *)&Buffer[off];
+                off += sizeof(struct inotify_event) + ev->len;
+                if (ev->mask & IN_Q_OVERFLOW)
+                    fprintf(stderr, "WARNING: too many changes in %s, some files were missed\n", Dir.c_str());
+                if (!ev->len || ev->name[0] == '.' || (ev->mask & IN_ISDIR))
+                    continue;
+
+                PendingFile &file = Pending[ev->name];
+                file.Due          = now + Debounce;
+                file.Complete |= (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) != 0;
+            }
+        }
+
+        now = Clock::now();
+        for (auto it = Pending.begin(); it != Pending.end();) {
+            if (it->second.Complete && it->second.Due <= now && !IsRunning(it->first)) {
+                {
+                    std::lock_guard<std::mutex> lock(RunningMutex);
+                    Running.insert(it->first);
+                }
+                Ready.Push(it->first);
+                it = Pending.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    Ready.Close();
+    for (std::thread &t : Pool)
+        t.join();
+    close(Wake[0]);
+    close(Wake[1]);
+    close(fd);
+    return ret;
+}
+#else
+int WatchDirectory(const std::string &Dir, const WatchOptions &Options, const WatchHandler &Handler)
+{
+    fprintf(stderr, "watch needs inotify and is only supported on Linux\n");
+    return WATCH_ERROR_UNSUPPORTED;
+}
+#endif
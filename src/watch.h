@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __WATCH_H__
+#define __WATCH_H__
+
+#include <functional>
+#include <string>
+
+#define WATCH_ERROR_UNSUPPORTED  -200
+#define WATCH_ERROR_WATCH_FAILED -201
+
+struct WatchOptions
+{
+    unsigned Jobs       = 0;   // worker threads, 0 = one per cpu
+    unsigned DebounceMs = 100; // a file must be quiet this long before it is handed out
+};
+
+typedef std::function<void(const std::string &path)> WatchHandler;
+
+// Calls Handler on a worker thread for every file in Dir that was closed after
+// writing or moved in, once no further write was seen for DebounceMs.
+// Names starting with '.' are ignored, they are the temporaries of copy tools.
+// A name is only handed to one worker at a time, a rewrite during the run is taken after it.
+// Only returns on error; needs inotify, so it is Linux only.
+int WatchDirectory(const std::string &Dir, const WatchOptions &Options, const WatchHandler &Handler);
+
+#endif
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// A Kelf that already loaded one file must load the next one without touching the heap:
+// Reset keeps the buffers, keys and signatures are fixed size values. Covers LoadKelfData only,
+// LoadKelf(filename) reads the file into a fresh std::string first.
+//
+// usage: alloc_test <scratch dir>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+#include <string>
+
+#include "kelf.h"
+#include "fileio.h"
+
+uint8_t GSystemtype      = SYSTEM_TYPE_PS2;
+uint8_t GMGZones         = REGION_ALL_ALLOWED;
+uint16_t GFlags          = HDR_PREDEF_KELF;
+uint8_t GApplicationType = KELFTYPE_XOSDMAIN;
+FILE *GLog               = NULL;
+std::vector<KELFConsoleID> GIDList;
+
+static std::atomic<bool> Counting(false);
+static std::atomic<size_t> Allocations(0);
+
+void *operator new(size_t size)
+{
+    if (Counting.load())
+        Allocations++;
+    if (void *p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    if (Counting.load())
+        Allocations++;
+    return malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &tag) noexcept
+{
+    return operator new(size, tag);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+    free(p);
+}
+
+// made up keys, only the format matters
+static const char *TestKeys =
+    "[default]\n"
+    "MG_SIG_MASTER_KEY=0123456789ABCDEF\n"
+    "MG_SIG_HASH_KEY=FEDCBA9876543210\n"
+    "MG_KBIT_MASTER_KEY=00112233445566778899AABBCCDDEEFF\n"
+    "MG_KBIT_IV=0102030405060708\n"
+    "MG_KC_MASTER_KEY=FFEEDDCCBBAA99887766554433221100\n"
+    "MG_KC_IV=1112131415161718\n"
+    "MG_ROOTSIG_MASTER_KEY=2122232425262728\n"
+    "MG_ROOTSIG_HASH_KEY=3132333435363738393A3B3C3D3E3F40\n"
+    "MG_CONTENT_TABLE_IV=4142434445464748\n"
+    "MG_CONTENT_IV=5152535455565758\n";
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        printf("usage: %s <scratch dir>\n", argv[0]);
+        return 1;
+    }
+
+    std::string KeysPath = std::string(argv[1]) + "/alloc_test_keys.dat";
+    if (WriteWholeFile(KeysPath, std::string(TestKeys)) != 0) {
+        printf("FAIL: cannot write %s\n", KeysPath.c_str());
+        return 1;
+    }
+    auto ks = std::make_shared<KeyStore>();
+    int ret = ks->Load(KeysPath, "default");
+    if (ret != 0) {
+        printf("FAIL: keystore: %s\n", KeyStore::getErrorString(ret).c_str());
+        return 1;
+    }
+
+    std::string Input(0x10000, '\0');
+    for (size_t i = 0; i < Input.size(); i++)
+        Input[i] = (char)(i * 7 + i / 251);
+
+    std::string Data;
+    Kelf Writer(ks);
+    ret = Writer.LoadContentData(Input, HEADER::FHDB);
+    if (ret == 0)
+        ret = Writer.SaveKelfData(Data, HEADER::FHDB);
+    if (ret != 0) {
+        printf("FAIL: encrypt: %d\n", ret);
+        return 1;
+    }
+
+    // the first load sizes the buffers and fills the per thread key schedule and memo caches
+    Kelf kelf(ks);
+    ret = kelf.LoadKelfData(Data);
+    if (ret != 0) {
+        printf("FAIL: first LoadKelfData: %d\n", ret);
+        return 1;
+    }
+    const char *Buffer = kelf.GetContent().data();
+
+    kelf.Reset();
+    Counting = true;
+    ret      = kelf.LoadKelfData(Data);
+    Counting = false;
+    if (ret != 0) {
+        printf("FAIL: warm LoadKelfData: %d\n", ret);
+        return 1;
+    }
+    // the content buffer comes from aligned_alloc, which operator new does not see
+    if (Allocations != 0 || kelf.GetContent().data() != Buffer) {
+        printf("FAIL: warm LoadKelfData made %zu heap allocations%s\n", Allocations.load(),
+               kelf.GetContent().data() != Buffer ? " and reallocated the content buffer" : "");
+        return 1;
+    }
+
+    printf("OK: warm LoadKelfData made no heap allocations\n");
+    return 0;
+}